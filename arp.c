@@ -91,6 +91,7 @@ arp_table_select (const ip_addr_t *pa) {
 static int
 arp_table_update (struct netdev *dev, const ip_addr_t *pa, const uint8_t *ha) {
     struct arp_entry *entry;
+    struct netvec vec;
 
     entry = arp_table_select(pa);
     if (!entry) {
@@ -103,7 +104,9 @@ arp_table_update (struct netdev *dev, const ip_addr_t *pa, const uint8_t *ha) {
             /* warning: receive response from unintended device */
             dev = entry->netif->dev;
         }
-        dev->ops->xmit(dev, ETHERNET_TYPE_IP, (uint8_t *)entry->data, entry->len, entry->ha);
+        vec.base = (uint8_t *)entry->data;
+        vec.len = entry->len;
+        dev->ops->xmit(dev, ETHERNET_TYPE_IP, &vec, 1, entry->ha);
         kfree(entry->data);
         entry->data = NULL;
         entry->len = 0;
@@ -170,6 +173,7 @@ arp_table_patrol (void) {
 static int
 arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
     struct arp_ethernet request;
+    struct netvec vec;
 
     if (!tpa) {
         return -1;
@@ -187,7 +191,9 @@ arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
     cprintf(">>> arp_send_request <<<\n");
     arp_dump((uint8_t *)&request, sizeof(request));
 #endif
-    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&request, sizeof(request), ETHERNET_ADDR_BROADCAST) == -1) {
+    vec.base = (uint8_t *)&request;
+    vec.len = sizeof(request);
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, &vec, 1, ETHERNET_ADDR_BROADCAST) == -1) {
         return -1;
     }
     return 0;
@@ -196,6 +202,7 @@ arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
 static int
 arp_send_reply (struct netif *netif, const uint8_t *tha, const ip_addr_t *tpa, const uint8_t *dst) {
     struct arp_ethernet reply;
+    struct netvec vec;
 
     if (!tha || !tpa) {
         return -1;
@@ -213,7 +220,9 @@ arp_send_reply (struct netif *netif, const uint8_t *tha, const ip_addr_t *tpa, c
     cprintf(">>> arp_send_reply <<<\n");
     arp_dump((uint8_t *)&reply, sizeof(reply));
 #endif
-    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst) < 0) {
+    vec.base = (uint8_t *)&reply;
+    vec.len = sizeof(reply);
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_ARP, &vec, 1, dst) < 0) {
         return -1;
     }
     return 0;
@@ -254,8 +263,9 @@ arp_rx (uint8_t *packet, size_t plen, struct netdev *dev) {
     }
     marge = (arp_table_update(dev, &message->spa, message->sha) == 0) ? 1 : 0;
     release(&arplock);
-    netif = netdev_get_netif(dev, NETIF_FAMILY_IPV4);
-    if (netif && ((struct netif_ip *)netif)->unicast == message->tpa) {
+    // 目标地址可以是设备上的任意一个地址，应答的发送方地址也使用该地址
+    netif = ip_netif_by_addr(&message->tpa);
+    if (netif && netif->dev == dev) {
         if (!marge) {
             acquire(&arplock);
             arp_table_insert(&message->spa, message->sha);
@@ -310,6 +320,20 @@ arp_resolve (struct netif *netif, const ip_addr_t *pa, uint8_t *ha, const void *
     return ARP_RESOLVE_QUERY;
 }
 
+// 删除地址时清除通过它发出查询的表项，它们保存的 netif 指针不再有效
+void
+arp_netif_detach (struct netif *netif) {
+    struct arp_entry *entry;
+
+    acquire(&arplock);
+    for (entry = arp_table; entry < array_tailof(arp_table); entry++) {
+        if (entry->used && entry->netif == netif) {
+            arp_entry_clear(entry);
+        }
+    }
+    release(&arplock);
+}
+
 int
 arp_init (void) {
     struct arp_entry *entry;
@@ -0,0 +1,132 @@
+#include "types.h"
+
+/*
+ * Internet checksum (RFC 1071)
+ *
+ * 补码和与字节序无关，所以可以按 32 位字读取、累加到 64 位累加器里，最后再折叠成 16 位，
+ * 结果与逐个 16 位字相加相同。x86 允许非对齐访问，因此这里不需要先对齐缓冲区。
+ * 内核没有打开 CR4.OSFXSR，不能使用 SSE2 寄存器，所以只用通用寄存器展开循环。
+ *
+ * cksum_partial / cksum_copy 返回未取反的 32 位部分和，可以链式地传给下一次调用；
+ * 除最后一段外每段的长度都必须是偶数。
+ */
+
+static uint32_t
+cksum_reduce (uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+uint32_t
+cksum_partial (const void *data, size_t len, uint32_t init) {
+    const uint32_t *p32;
+    const uint8_t *p8;
+    uint64_t sum;
+
+    sum = init;
+    p32 = (const uint32_t *)data;
+    while (len >= 32) {
+        sum += (uint64_t)p32[0] + p32[1] + p32[2] + p32[3];
+        sum += (uint64_t)p32[4] + p32[5] + p32[6] + p32[7];
+        p32 += 8;
+        len -= 32;
+    }
+    while (len >= 4) {
+        sum += *p32++;
+        len -= 4;
+    }
+    p8 = (const uint8_t *)p32;
+    if (len >= 2) {
+        sum += *(const uint16_t *)p8;
+        p8 += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum += *p8;
+    }
+    return cksum_reduce(sum);
+}
+
+// 一次遍历同时完成拷贝和校验和计算，避免 memcpy 之后再读一遍数据
+uint32_t
+cksum_copy (void *dst, const void *src, size_t len, uint32_t init) {
+    const uint32_t *s32;
+    uint32_t *d32, w0, w1, w2, w3;
+    const uint8_t *s8;
+    uint8_t *d8;
+    uint64_t sum;
+
+    sum = init;
+    s32 = (const uint32_t *)src;
+    d32 = (uint32_t *)dst;
+    while (len >= 16) {
+        w0 = s32[0];
+        w1 = s32[1];
+        w2 = s32[2];
+        w3 = s32[3];
+        d32[0] = w0;
+        d32[1] = w1;
+        d32[2] = w2;
+        d32[3] = w3;
+        sum += (uint64_t)w0 + w1 + w2 + w3;
+        s32 += 4;
+        d32 += 4;
+        len -= 16;
+    }
+    while (len >= 4) {
+        w0 = *s32++;
+        *d32++ = w0;
+        sum += w0;
+        len -= 4;
+    }
+    s8 = (const uint8_t *)s32;
+    d8 = (uint8_t *)d32;
+    if (len >= 2) {
+        *(uint16_t *)d8 = *(const uint16_t *)s8;
+        sum += *(const uint16_t *)s8;
+        s8 += 2;
+        d8 += 2;
+        len -= 2;
+    }
+    if (len) {
+        *d8 = *s8;
+        sum += *s8;
+    }
+    return cksum_reduce(sum);
+}
+
+uint16_t
+cksum_fold (uint32_t sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~(uint16_t)sum;
+}
+
+uint16_t
+cksum16 (uint16_t *data, uint16_t size, uint32_t init) {
+    return cksum_fold(cksum_partial(data, size, init));
+}
+
+/*
+ * Incremental update (RFC 1624 eqn. 3): HC' = ~(~HC + ~m + m')
+ * 字段在报文里是什么字节序，old/new 就按同样的字节序传入
+ */
+
+uint16_t
+cksum_adjust (uint16_t sum, uint16_t old, uint16_t new) {
+    uint32_t tmp;
+
+    tmp = (uint16_t)~sum + (uint16_t)~old + new;
+    return cksum_fold(tmp);
+}
+
+uint16_t
+cksum_adjust32 (uint16_t sum, uint32_t old, uint32_t new) {
+    uint32_t tmp;
+
+    tmp = (uint16_t)~sum;
+    tmp += (uint16_t)~(old >> 16) + (uint16_t)~(old & 0xffff);
+    tmp += (new >> 16) + (new & 0xffff);
+    return cksum_fold(tmp);
+}
@@ -0,0 +1,100 @@
+#include "types.h"
+#include "user.h"
+
+/*
+ * cksumbench: compare the Internet checksum routines in cksum.c against the
+ * original one-16-bit-word-per-iteration loop.
+ */
+
+uint32_t cksum_partial(const void *data, size_t len, uint32_t init);
+uint32_t cksum_copy(void *dst, const void *src, size_t len, uint32_t init);
+uint16_t cksum_fold(uint32_t sum);
+
+#define ROUNDS 2000
+
+static uint8_t src[4096 + 1];
+static uint8_t dst[4096 + 1];
+
+static uint32_t
+rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return lo;
+}
+
+// the original cksum16 from common.c
+static uint16_t
+cksum16_ref(uint16_t *data, uint16_t size, uint32_t init)
+{
+    uint32_t sum;
+
+    sum = init;
+    while(size > 1) {
+        sum += *(data++);
+        size -= 2;
+    }
+    if(size) {
+        sum += *(uint8_t *)data;
+    }
+    sum  = (sum & 0xffff) + (sum >> 16);
+    sum  = (sum & 0xffff) + (sum >> 16);
+    return ~(uint16_t)sum;
+}
+
+static int
+same(uint8_t *a, uint8_t *b, int len)
+{
+    while (len-- > 0)
+        if (*a++ != *b++)
+            return 0;
+    return 1;
+}
+
+static void
+bench(uint8_t *buf, int len)
+{
+    uint32_t start, ref, partial, memsum, copy;
+    uint16_t a, b, c;
+    int n;
+
+    start = rdtsc();
+    for (n = 0; n < ROUNDS; n++)
+        a = cksum16_ref((uint16_t *)buf, len, 0);
+    ref = (rdtsc() - start) / ROUNDS;
+    start = rdtsc();
+    for (n = 0; n < ROUNDS; n++)
+        b = cksum_fold(cksum_partial(buf, len, 0));
+    partial = (rdtsc() - start) / ROUNDS;
+    start = rdtsc();
+    for (n = 0; n < ROUNDS; n++) {
+        memmove(dst, buf, len);
+        cksum16_ref((uint16_t *)dst, len, 0);
+    }
+    memsum = (rdtsc() - start) / ROUNDS;
+    start = rdtsc();
+    for (n = 0; n < ROUNDS; n++)
+        c = cksum_fold(cksum_copy(dst, buf, len, 0));
+    copy = (rdtsc() - start) / ROUNDS;
+    printf(1, "%d%s\t%d\t%d\t%d\t%d\t%s\n", len, buf == src ? "" : "u",
+        ref, partial, memsum, copy,
+        (a == b && a == c && same(dst, buf, len)) ? "ok" : "MISMATCH");
+}
+
+int
+main(int argc, char *argv[])
+{
+    static int sizes[] = {20, 64, 576, 1460, 1500, 4096};
+    int n;
+
+    for (n = 0; n < (int)sizeof(src); n++)
+        src[n] = n * 7 + 13;
+    printf(1, "cycles per call (u = unaligned buffer)\n");
+    printf(1, "len\tcksum16\tpartial\tmemmove+cksum16\tcopy\n");
+    for (n = 0; n < (int)(sizeof(sizes) / sizeof(sizes[0])); n++) {
+        bench(src, sizes[n]);
+        bench(src + 1, sizes[n] - 1);
+    }
+    exit();
+}
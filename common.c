@@ -3,6 +3,9 @@
 
 #include "types.h"
 #include "defs.h"
+#include "mmu.h"
+#include "x86.h"
+#include "spinlock.h"
 #include "common.h"
 
 #define isascii(x) ((x >= 0x00) && (x <= 0x7f))
@@ -102,23 +105,6 @@ ntoh32(uint32_t n)
     return endian == __LITTLE_ENDIAN ? byteswap32(n) : n;
 }
 
-uint16_t
-cksum16 (uint16_t *data, uint16_t size, uint32_t init) {
-    uint32_t sum;
-
-    sum = init;
-    while(size > 1) {
-        sum += *(data++);
-        size -= 2;
-    }
-    if(size) {
-        sum += *(uint8_t *)data;
-    }
-    sum  = (sum & 0xffff) + (sum >> 16);
-    sum  = (sum & 0xffff) + (sum >> 16);
-    return ~(uint16_t)sum;
-}
-
 struct queue_entry *
 queue_push (struct queue_head *queue, void *data, size_t size) {
     struct queue_entry *entry;
@@ -160,6 +146,73 @@ queue_pop (struct queue_head *queue) {
     return entry;
 }
 
+/*
+ * 固定大小对象的分配器：把 kalloc() 得到的物理页切分成等长的对象，用空闲链表管理。
+ * 分配器本身不加锁，由调用者负责互斥；切分过的页只在 slab_destroy() 时归还给 kalloc()。
+ */
+
+#define SLAB_PAGE_LINK(page) (*(char **)((page) + PGSIZE - sizeof(char *)))
+
+void
+slab_init (struct slab_cache *cache, size_t size) {
+    cache->size = ROUNDUP(MAX(size, sizeof(struct slab_object)), sizeof(void *));
+    cache->free = NULL;
+    cache->num = 0;
+    cache->pages = NULL;
+}
+
+// 归还所有的页，调用者保证已经没有分配出去的对象；之后可以继续使用
+void
+slab_destroy (struct slab_cache *cache) {
+    char *page;
+
+    while ((page = cache->pages) != NULL) {
+        cache->pages = SLAB_PAGE_LINK(page);
+        kfree(page);
+    }
+    cache->free = NULL;
+    cache->num = 0;
+}
+
+void *
+slab_alloc (struct slab_cache *cache) {
+    struct slab_object *obj;
+    char *page;
+    size_t offset;
+
+    if (!cache->free) {
+        page = kalloc();
+        if (!page) {
+            return NULL;
+        }
+        SLAB_PAGE_LINK(page) = cache->pages;
+        cache->pages = page;
+        for (offset = 0; offset + cache->size <= PGSIZE - sizeof(char *); offset += cache->size) {
+            obj = (struct slab_object *)(page + offset);
+            obj->next = cache->free;
+            cache->free = obj;
+        }
+    }
+    obj = cache->free;
+    cache->free = obj->next;
+    cache->num++;
+    memset(obj, 0, cache->size);
+    return obj;
+}
+
+void
+slab_free (struct slab_cache *cache, void *ptr) {
+    struct slab_object *obj;
+
+    if (!ptr) {
+        return;
+    }
+    obj = (struct slab_object *)ptr;
+    obj->next = cache->free;
+    cache->free = obj;
+    cache->num--;
+}
+
 time_t
 time(time_t *t)
 {
@@ -171,6 +224,25 @@ time(time_t *t)
     return tmp;
 }
 
+// 消耗一个令牌，允许时返回 1；不加锁，并发调用时计数可能略有偏差，对限速来说可以接受
+int
+ratelimit_check(struct ratelimit *rl)
+{
+    unsigned int now, n;
+
+    now = ticks;
+    n = (now - rl->last) / rl->interval;
+    if (n) {
+        rl->tokens = (n >= (unsigned int)rl->burst) ? rl->burst : MIN(rl->tokens + (int)n, rl->burst);
+        rl->last += n * rl->interval;
+    }
+    if (rl->tokens <= 0) {
+        return 0;
+    }
+    rl->tokens--;
+    return 1;
+}
+
 unsigned long
 random(void)
 {
@@ -186,3 +258,29 @@ random(void)
     }
     return genrand_int32();
 }
+
+static struct spinlock urandomlock = {0, "urandom", 0, {0}};
+static uint64_t urandom_state;
+
+// splitmix64 的输出函数
+static uint64_t
+urandom_mix (uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// 协议中需要对外不可预测的值（ISS、IP ID、时间戳偏移、临时端口等）使用这里的数，不使用 random()：
+// random() 在 ticks 还是 0 时以 ticks 播种，输出在每次启动时都相同，而且 MT 的状态可以从输出中还原。
+// 每次调用都把 TSC 的当前值混入状态，启动时刻和报文到达时刻的抖动都会成为熵的来源
+uint32_t
+urandom (void) {
+    uint64_t x;
+
+    acquire(&urandomlock);
+    urandom_state += rdtsc() ^ 0x9e3779b97f4a7c15ULL;
+    x = urandom_mix(urandom_state);
+    urandom_state ^= x;
+    release(&urandomlock);
+    return (uint32_t)(x >> 32);
+}
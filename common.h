@@ -9,3 +9,24 @@ struct queue_head {
     struct queue_entry *tail;
     unsigned int num;
 };
+
+struct slab_object {
+    struct slab_object *next;
+};
+
+struct slab_cache {
+    size_t size;
+    struct slab_object *free;
+    unsigned int num; // 已分配出去的对象数
+    char *pages; // 切分过的页，每页末尾保存下一页的地址
+};
+
+// 令牌桶限速：每 interval 个 tick 补充一个令牌，最多积攒 burst 个
+struct ratelimit {
+    unsigned int interval;
+    int burst;
+    int tokens;
+    unsigned int last;
+};
+
+#define RATELIMIT_INIT(interval, burst) { (interval), (burst), (burst), 0 }
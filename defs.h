@@ -114,6 +114,8 @@ struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
+void            quiescent_begin(void);
+int             quiescent_passed(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
@@ -233,24 +235,45 @@ struct netdev;
 struct netif;
 struct queue_head;
 struct queue_entry;
+struct slab_cache;
+struct ratelimit;
 struct socket;
 struct sockaddr;
+struct ip_route;
+struct netvec;
+struct ip6_hdr;
+struct tcp_cc;
+struct tcp_cc_ops;
 
 // arp.c
 int             arp_resolve(struct netif *netif, const ip_addr_t *pa, uint8_t *ha, const void *data, size_t len);
+void            arp_netif_detach(struct netif *netif);
 int             arp_init(void);
 
+// cksum.c
+uint32_t        cksum_partial(const void *data, size_t len, uint32_t init);
+uint32_t        cksum_copy(void *dst, const void *src, size_t len, uint32_t init);
+uint16_t        cksum_fold(uint32_t sum);
+uint16_t        cksum16(uint16_t *data, uint16_t size, uint32_t init);
+uint16_t        cksum_adjust(uint16_t sum, uint16_t old, uint16_t new);
+uint16_t        cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new);
+
 // common.c
 void            hexdump(void *data, size_t size);
 uint16_t        hton16(uint16_t h);
 uint16_t        ntoh16(uint16_t n);
 uint32_t        hton32(uint32_t h);
 uint32_t        ntoh32(uint32_t n);
-uint16_t        cksum16 (uint16_t *data, uint16_t size, uint32_t init);
 struct queue_entry *queue_push(struct queue_head *queue, void *data, size_t size);
 struct queue_entry *queue_pop(struct queue_head *queue);
+void            slab_init(struct slab_cache *cache, size_t size);
+void *          slab_alloc(struct slab_cache *cache);
+void            slab_free(struct slab_cache *cache, void *ptr);
+void            slab_destroy(struct slab_cache *cache);
 time_t          time(time_t *t);
+int             ratelimit_check(struct ratelimit *rl);
 unsigned long   random(void);
+uint32_t        urandom(void);
 
 // e1000.c
 int             e1000_init(struct pci_func *pcif);
@@ -260,29 +283,84 @@ void            e1000intr(void);
 int             ethernet_addr_pton(const char *p, uint8_t *n);
 char *          ethernet_addr_ntop(const uint8_t *n, char *p, size_t size);
 ssize_t         ethernet_rx_helper(struct netdev *dev, uint8_t *frame, size_t flen, void (*cb)(struct netdev*, uint16_t, uint8_t*, size_t));
-ssize_t         ethernet_tx_helper(struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*cb)(struct netdev*, uint8_t*, size_t));
+ssize_t         ethernet_tx_helper(struct netdev *dev, uint16_t type, const struct netvec *vec, int cnt, const void *dst, ssize_t (*cb)(struct netdev*, const struct netvec*, int));
 void            ethernet_netdev_setup(struct netdev *dev);
 
 // icmp.c
 int             icmp_tx(struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *data, size_t len, ip_addr_t *dst);
+int             icmp_unreach(struct netif *netif, uint8_t code, uint8_t protocol, ip_addr_t *src, ip_addr_t *dst, uint8_t *payload, size_t plen);
+int             icmp_error(struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *dgram, size_t dlen);
 int             icmp_init(void);
+int             icmp_api_open(void);
+int             icmp_api_close(int soc);
+ssize_t         icmp_api_recvfrom(int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int *addrlen, int nonblock);
+ssize_t         icmp_api_sendto(int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int addrlen);
+
+// icmp6.c
+int             icmp6_tx(struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *data, size_t len, const ip6_addr_t *dst, uint8_t hlim);
+int             icmp6_init(void);
+
+// igmp.c
+struct netif *  igmp_group_netif(struct netdev *dev, ip_addr_t group);
+int             igmp_join(struct netif *netif, ip_addr_t group);
+int             igmp_leave(struct netif *netif, ip_addr_t group);
+int             igmp_init(void);
 
 // ip.c
 int             ip_addr_pton(const char *p, ip_addr_t *n);
 char *          ip_addr_ntop(const ip_addr_t *n, char *p, size_t size);
 struct netif *  ip_netif_alloc(ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway);
+void            ip_mcast_ha(const ip_addr_t *group, uint8_t *ha);
+int             ip_netif_add(struct netdev *dev, struct netif *netif);
+int             ip_netif_delete(struct netif *netif);
 struct netif *  ip_netif_register(struct netdev *dev, const char *addr, const char *netmask, const char *gateway);
 int             ip_netif_reconfigure(struct netif *netif, ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway);
 struct netif *  ip_netif_by_addr(ip_addr_t *addr);
 struct netif *  ip_netif_by_peer(ip_addr_t *peer);
+int             ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct netif *netif);
+int             ip_route_delete(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct netif *netif);
+int             ip_route_get(int index, struct ip_route *result);
+int             ip_forwarding(int enable);
+void            ip_pmtu_update(const ip_addr_t *dst, uint16_t mtu, int verified);
+int             ip_pmtu_get(const ip_addr_t *dst);
 ssize_t         ip_tx(struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *dst);
-int             ip_add_protocol(uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif));
+ssize_t         ip_txv(struct netif *netif, uint8_t protocol, const struct netvec *vec, int cnt, const ip_addr_t *dst, uint16_t flags);
+int             ip_add_protocol(uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif), void (*errhandler)(uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif));
+void            ip_rx_error(uint8_t type, uint8_t code, uint32_t values, uint8_t *dgram, size_t dlen, struct netif *netif);
 int             ip_init(void);
 
+// ip6.c
+int             ip6_addr_pton(const char *p, ip6_addr_t *n);
+char *          ip6_addr_ntop(const ip6_addr_t *n, char *p, size_t size);
+void            ip6_solicited_node(const ip6_addr_t *unicast, ip6_addr_t *maddr);
+void            ip6_mcast_ha(const ip6_addr_t *maddr, uint8_t *ha);
+struct netif *  ip6_netif_alloc(const ip6_addr_t *unicast, int prefixlen, const ip6_addr_t *gateway);
+struct netif *  ip6_netif_linklocal(struct netdev *dev);
+int             ip6_netif_add(struct netdev *dev, struct netif *netif);
+int             ip6_netif_delete(struct netif *netif);
+struct netif *  ip6_netif_by_addr(const ip6_addr_t *addr);
+struct netif *  ip6_netif_by_peer(const ip6_addr_t *peer);
+void            ip6_route_invalidate(void);
+void            ip6_pmtu_update(const ip6_addr_t *dst, uint32_t mtu);
+int             ip6_pmtu_get(const ip6_addr_t *dst);
+uint32_t        ip6_pseudo_sum(const ip6_addr_t *src, const ip6_addr_t *dst, uint8_t nxt, uint32_t len);
+ssize_t         ip6_txv(struct netif *netif, uint8_t nxt, const struct netvec *vec, int cnt, const ip6_addr_t *dst, uint8_t hlim);
+void            ip6_rx_error(uint8_t type, uint8_t code, uint32_t values, uint8_t *dgram, size_t dlen, struct netif *netif);
+int             ip6_add_protocol(uint8_t type, void (*handler)(uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *netif), void (*errhandler)(uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *netif));
+int             ip6_init(void);
+
 // mt19937ar.c
 void            init_genrand(unsigned long s);
 unsigned long   genrand_int32(void);
 
+// nd6.c
+void            nd6_rx_solicit(uint8_t *msg, size_t len, struct ip6_hdr *hdr, struct netif *netif);
+void            nd6_rx_advert(uint8_t *msg, size_t len, struct ip6_hdr *hdr, struct netif *netif);
+void            nd6_rx_router_advert(uint32_t values, uint8_t *msg, size_t len, struct ip6_hdr *hdr, struct netif *netif);
+int             nd6_resolve(struct netif *netif, const ip6_addr_t *addr, uint8_t *ha);
+void            nd6_netif_detach(struct netif *netif);
+int             nd6_init(void);
+
 // net.c
 struct netdev * netdev_root(void);
 struct netdev * netdev_alloc(void (*setup)(struct netdev *));
@@ -291,28 +369,45 @@ struct netdev * netdev_by_index(int index);
 struct netdev * netdev_by_name(const char *name);
 void            netdev_receive(struct netdev *dev, uint16_t type, uint8_t *packet, unsigned int plen);
 int             netdev_add_netif(struct netdev *dev, struct netif *netif);
+int             netdev_del_netif(struct netdev *dev, struct netif *netif);
+int             netdev_add_mcast(struct netdev *dev, const uint8_t *addr);
+int             netdev_del_mcast(struct netdev *dev, const uint8_t *addr);
+int             netdev_has_mcast(struct netdev *dev, const uint8_t *addr);
 struct netif *  netdev_get_netif(struct netdev *dev, int family);
+void            netif_retire(struct netif *netif);
 int             netproto_register(unsigned short type, void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev));
+int             nettimer_register(unsigned int interval, void (*handler)(void));
+void            nettimer_tick(void);
 void            netinit(void);
 
 // tcp.c
 int             tcp_init(void);
-int             tcp_api_open(void);
+void            tcp_netif_detach(struct netif *iface);
+int             tcp_api_open(int family);
 int             tcp_api_close(int soc);
 int             tcp_api_connect(int soc, struct sockaddr *addr, int addrlen);
 int             tcp_api_bind(int soc, struct sockaddr *addr, int addrlen);
 int             tcp_api_listen(int soc, int backlog);
 int             tcp_api_accept(int soc, struct sockaddr *addr, int *addrlen);
-ssize_t         tcp_api_recv(int soc, uint8_t *buf, size_t size);
-ssize_t         tcp_api_send(int soc, uint8_t *buf, size_t len);
+ssize_t         tcp_api_recv(int soc, uint8_t *buf, size_t size, int nonblock);
+ssize_t         tcp_api_send(int soc, uint8_t *buf, size_t len, int nonblock);
+int             tcp_api_setsockopt(int soc, int level, int optname, void *optval, int optlen);
+int             tcp_api_getsockopt(int soc, int level, int optname, void *optval, int *optlen);
+
+// tcp_cc.c
+const struct tcp_cc_ops *tcp_cc_find(const char *name);
+void            tcp_cc_start(struct tcp_cc *cc, uint32_t mss);
 
 // udp.c
 int             udp_init(void);
-int             udp_api_open(void);
+void            udp_netif_detach(struct netif *iface);
+int             udp_api_open(int family);
 int             udp_api_close(int soc);
 int             udp_api_bind(int soc, struct sockaddr *addr, int addrlen);
-ssize_t         udp_api_recvfrom(int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int *addrlen);
+ssize_t         udp_api_recvfrom(int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int *addrlen, int nonblock);
 ssize_t         udp_api_sendto(int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int addrlen);
+int             udp_api_setsockopt(int soc, int level, int optname, void *optval, int optlen);
+int             udp_api_getsockopt(int soc, int level, int optname, void *optval, int *optlen);
 
 // socket.c
 struct file *   socketalloc(int domain, int type, int protocol);
@@ -326,6 +421,8 @@ int             socketwrite(struct socket*, char*, int);
 int             socketrecvfrom(struct socket*, char*, int, struct sockaddr*, int*);
 int             socketsendto(struct socket*, char*, int, struct sockaddr*, int);
 int             socketioctl(struct socket*, int, void*);
+int             socketsetsockopt(struct socket*, int, int, void*, int);
+int             socketgetsockopt(struct socket*, int, int, void*, int*);
 
 #define sizeof_member(s, m) sizeof(((s *)NULL)->m)
 #define array_tailof(x) (x + (sizeof(x) / sizeof(*x)))
@@ -4,6 +4,7 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "spinlock.h"
 #include "memlayout.h"
 #include "mmu.h"
 #include "pci.h"
@@ -19,6 +20,7 @@ struct e1000 {
     uint32_t mmio_base; // 用于存储 MMIO（Memory Mapped Input/Output）基地址
     struct rx_desc rx_ring[RX_RING_SIZE] __attribute__((aligned(16)));; //用于存储接收数据的描述符
     struct tx_desc tx_ring[TX_RING_SIZE] __attribute__((aligned(16)));; // 用于存储发送数据的描述符
+    struct spinlock txlock; // 发送可以同时来自各个 CPU 的中断、定时器和进程，从读 TDT 到描述符完成都要持有
     uint8_t addr[6]; // 存储MAC地址
     uint8_t irq; // 存储中断请求号
     struct netdev *netdev; // 表示与该 e1000 设备相关联的网络设备
@@ -96,7 +98,6 @@ e1000_rx_init(struct e1000 *dev)
     e1000_reg_write(dev, E1000_RCTL, (
         E1000_RCTL_SBP        | /* store bad packet */
         E1000_RCTL_UPE        | /* unicast promiscuous enable */
-        E1000_RCTL_MPE        | /* multicast promiscuous enab */
         E1000_RCTL_RDMTS_HALF | /* rx desc min threshold size */
         E1000_RCTL_SECRC      | /* Strip Ethernet CRC */
         E1000_RCTL_LPE        | /* long packet enable */
@@ -163,31 +164,68 @@ e1000_stop(struct netdev *netdev)
     return 0;
 }
 
+// 每个片段占用一个发送描述符，只有最后一个描述符带 EOP，网卡直接从各片段所在内存 DMA
 static ssize_t
-e1000_tx_cb(struct netdev *netdev, uint8_t *data, size_t len)
+e1000_tx_cb(struct netdev *netdev, const struct netvec *vec, int cnt)
 {
     struct e1000 *dev = (struct e1000 *)netdev->priv;
-    uint32_t tail = e1000_reg_read(dev, E1000_TDT);
-    struct tx_desc *desc = &dev->tx_ring[tail];
+    uint32_t tail;
+    struct tx_desc *desc = NULL;
+    size_t len = 0;
+    int n;
 
-    desc->addr = (uint64_t)V2P(data);
-    desc->length = len;
-    desc->status = 0;
-    desc->cmd = (E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS);
-#ifdef DEBUG
-    cprintf("[e1000] %s: %u bytes data transmit\n", dev->netdev->name, desc->length);
-#endif
-    e1000_reg_write(dev, E1000_TDT, (tail + 1) % TX_RING_SIZE);
+    if (cnt <= 0 || cnt >= TX_RING_SIZE) {
+        return -1;
+    }
+    acquire(&dev->txlock);
+    tail = e1000_reg_read(dev, E1000_TDT);
+    for (n = 0; n < cnt; n++) {
+        desc = &dev->tx_ring[(tail + n) % TX_RING_SIZE];
+        desc->addr = (uint64_t)V2P(vec[n].base);
+        desc->length = vec[n].len;
+        desc->status = 0;
+        desc->cmd = (n == cnt - 1) ? (E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS) : 0;
+        len += vec[n].len;
+    }
+    e1000_reg_write(dev, E1000_TDT, (tail + cnt) % TX_RING_SIZE);
+    // 等待最后一个描述符完成，返回之后调用方的缓冲区才可以被释放或重用
     while(!(desc->status & 0x0f)) {
         microdelay(1);
     }
+    release(&dev->txlock);
+#ifdef DEBUG
+    cprintf("[e1000] %s: %u bytes data transmit (%d descriptors)\n", dev->netdev->name, len, cnt);
+#endif
     return len;
 }
 
+// 组播表（MTA）是 4096 位的散列表，用目的地址最后 12 位（MO=00）选出一位；每次按完整的地址表重新计算
+static int
+e1000_set_mcast(struct netdev *netdev)
+{
+    struct e1000 *dev = (struct e1000 *)netdev->priv;
+    uint32_t mta[128];
+    uint16_t hash;
+    int n;
+
+    memset(mta, 0, sizeof(mta));
+    for (n = 0; n < NETDEV_MCAST_MAX; n++) {
+        if (!netdev->mcast[n].refs) {
+            continue;
+        }
+        hash = ((netdev->mcast[n].addr[4] >> 4) | (netdev->mcast[n].addr[5] << 4)) & 0xfff;
+        mta[hash >> 5] |= 1 << (hash & 0x1f);
+    }
+    for (n = 0; n < 128; n++) {
+        e1000_reg_write(dev, E1000_MTA + (n << 2), mta[n]);
+    }
+    return 0;
+}
+
 static ssize_t
-e1000_tx(struct netdev *dev, uint16_t type, const uint8_t *packet, size_t len, const void *dst)
+e1000_tx(struct netdev *dev, uint16_t type, const struct netvec *vec, int cnt, const void *dst)
 {
-    return ethernet_tx_helper(dev, type, packet, len, dst, e1000_tx_cb);
+    return ethernet_tx_helper(dev, type, vec, cnt, dst, e1000_tx_cb);
 }
 
 static void
@@ -260,6 +298,7 @@ struct netdev_ops e1000_ops = {
     .open = e1000_open,
     .stop = e1000_stop,
     .xmit = e1000_tx,
+    .set_mcast = e1000_set_mcast,
 };
 
 int
@@ -267,6 +306,7 @@ e1000_init(struct pci_func *pcif)
 {
     pci_func_enable(pcif);
     struct e1000 *dev = (struct e1000 *)kalloc();
+    initlock(&dev->txlock, "e1000tx");
     // Resolve MMIO base address
     dev->mmio_base = e1000_resolve_mmio_base(pcif);
     assert(dev->mmio_base);
@@ -59,6 +59,7 @@ ethernet_addr_ntop(const uint8_t *n, char *p, size_t size)
     return p;
 }
 
+// 只解析 frame 开头的以太网头部，hexdump 由调用方负责
 static void
 ethernet_dump(struct netdev *dev, uint8_t *frame, size_t flen)
 {
@@ -71,7 +72,6 @@ ethernet_dump(struct netdev *dev, uint8_t *frame, size_t flen)
     cprintf("  dst: %s\n", ethernet_addr_ntop(hdr->dst, addr, sizeof(addr)));
     cprintf(" type: 0x%04x (%s)\n", ntoh16(hdr->type), ethernet_type_ntoa(hdr->type));
     cprintf("  len: %u octets\n", flen);
-    hexdump(frame, flen);
 }
 
 ssize_t
@@ -85,15 +85,16 @@ ethernet_rx_helper(struct netdev *dev, uint8_t *frame, size_t flen, void (*cb)(s
         return -1;
     }
     hdr = (struct ethernet_hdr *)frame;
-    // 如果设备的mac地址和以太网帧目的不一致，检查是否是广播地址，如果不是，丢弃该包
+    // 如果设备的mac地址和以太网帧目的不一致，检查是否是广播地址或设备加入了的组播地址，如果不是，丢弃该包
     if (memcmp(dev->addr, hdr->dst, ETHERNET_ADDR_LEN) != 0) {
-        if (memcmp(ETHERNET_ADDR_BROADCAST, hdr->dst, ETHERNET_ADDR_LEN) != 0) {
+        if (memcmp(ETHERNET_ADDR_BROADCAST, hdr->dst, ETHERNET_ADDR_LEN) != 0 && (!(hdr->dst[0] & 0x01) || !netdev_has_mcast(dev, hdr->dst))) {
             return -1;
         }
     }
 #ifdef DEBUG
     cprintf(">>> ethernet_rx <<<\n");
     ethernet_dump(dev, frame, flen);
+    hexdump(frame, flen);
 #endif
     payload = (uint8_t *)(hdr + 1);
     plen = flen - sizeof(struct ethernet_hdr);
@@ -102,27 +103,49 @@ ethernet_rx_helper(struct netdev *dev, uint8_t *frame, size_t flen, void (*cb)(s
 }
 
 ssize_t
-ethernet_tx_helper(struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*cb)(struct netdev*, uint8_t*, size_t))
+ethernet_tx_helper(struct netdev *dev, uint16_t type, const struct netvec *vec, int cnt, const void *dst, ssize_t (*cb)(struct netdev*, const struct netvec*, int))
 {
-    uint8_t frame[ETHERNET_FRAME_SIZE_MAX];
-    struct ethernet_hdr *hdr;
-    size_t flen;
+    static const uint8_t pad[ETHERNET_PAYLOAD_SIZE_MIN];
+    struct ethernet_hdr hdr;
+    struct netvec frame[NETVEC_MAX];
+    size_t plen, flen;
+    int n, num;
 
-    if (!payload || plen > ETHERNET_PAYLOAD_SIZE_MAX || !dst) {
+    if (!vec || !dst || cnt > NETVEC_MAX - 2) {
         return -1;
     }
-    memset(frame, 0, sizeof(frame));
-    hdr = (struct ethernet_hdr *)frame;
-    memcpy(hdr->dst, dst, ETHERNET_ADDR_LEN);
-    memcpy(hdr->src, dev->addr, ETHERNET_ADDR_LEN);
-    hdr->type = hton16(type);
-    memcpy(hdr + 1, payload, plen);
-    flen = sizeof(struct ethernet_hdr) + (plen < ETHERNET_PAYLOAD_SIZE_MIN ? ETHERNET_PAYLOAD_SIZE_MIN : plen);
+    memcpy(hdr.dst, dst, ETHERNET_ADDR_LEN);
+    memcpy(hdr.src, dev->addr, ETHERNET_ADDR_LEN);
+    hdr.type = hton16(type);
+    // 以太网头部作为第一个片段，载荷片段原样跟在后面，不再拷贝到栈上的帧缓冲区
+    frame[0].base = (uint8_t *)&hdr;
+    frame[0].len = sizeof(hdr);
+    num = 1;
+    plen = 0;
+    for (n = 0; n < cnt; n++) {
+        if (!vec[n].len) {
+            continue;
+        }
+        frame[num++] = vec[n];
+        plen += vec[n].len;
+    }
+    if (plen > ETHERNET_PAYLOAD_SIZE_MAX) {
+        return -1;
+    }
+    if (plen < ETHERNET_PAYLOAD_SIZE_MIN) {
+        frame[num].base = pad;
+        frame[num].len = ETHERNET_PAYLOAD_SIZE_MIN - plen;
+        num++;
+    }
+    flen = sizeof(hdr) + (plen < ETHERNET_PAYLOAD_SIZE_MIN ? ETHERNET_PAYLOAD_SIZE_MIN : plen);
 #ifdef DEBUG
     cprintf(">>> ethernet_tx <<<\n");
-    ethernet_dump(dev, frame, flen);
+    ethernet_dump(dev, (uint8_t *)&hdr, flen);
+    for (n = 1; n < num; n++) {
+        hexdump((void *)frame[n].base, frame[n].len);
+    }
 #endif
-    return cb(dev, frame, flen) == (ssize_t)flen ? (ssize_t)plen : -1;
+    return cb(dev, frame, num) == (ssize_t)flen ? (ssize_t)plen : -1;
 }
 
 void
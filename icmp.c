@@ -3,9 +3,21 @@
 
 #include "types.h"
 #include "defs.h"
+#include "spinlock.h"
+#include "mmu.h"
+#include "param.h"
+#include "proc.h"
+#include "common.h"
 #include "net.h"
 #include "ip.h"
 #include "icmp.h"
+#include "socket.h"
+
+#define ICMP_RATELIMIT_INTERVAL 10 /* ticks */
+#define ICMP_RATELIMIT_BURST 10
+
+#define ICMP_CB_TABLE_SIZE 16
+#define ICMP_CB_QUEUE_MAX 32
 #define DEBUG
 
 struct icmp_hdr {
@@ -30,7 +42,20 @@ struct icmp_hdr {
     uint8_t data[0];
 };
 
-#define ICMP_BUFSIZ IP_PAYLOAD_SIZE_MAX
+// 原始 ICMP 套接字（SOCK_RAW/IPPROTO_ICMP），收到的每个 ICMP 报文都复制一份到所有打开的套接字
+struct icmp_cb {
+    int used;
+    struct queue_head queue;
+};
+
+struct icmp_queue_hdr {
+    ip_addr_t addr;
+    uint16_t len;
+    uint8_t data[0];
+};
+
+static struct spinlock icmplock;
+static struct icmp_cb cb_table[ICMP_CB_TABLE_SIZE];
 
 static char *
 icmp_type_ntoa (uint8_t type) {
@@ -99,9 +124,76 @@ icmp_dump (struct netif *netif, ip_addr_t *src, ip_addr_t *dst, uint8_t *packet,
     hexdump(packet, plen);
 }
 
+// RFC 1191 的 MTU plateau 表，用于不携带 Next-Hop MTU 的旧路由器
+static const uint16_t icmp_mtu_plateaus[] = {
+    32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68
+};
+
+// 返回报文给出的下一跳 MTU，不可信时返回 0
+static uint16_t
+icmp_rx_frag_needed (struct icmp_hdr *hdr, size_t plen) {
+    struct ip_hdr *ihdr;
+    uint16_t mtu, len;
+    const uint16_t *p;
+
+    if (plen < sizeof(struct icmp_hdr) + IP_HDR_SIZE_MIN) {
+        return 0;
+    }
+    ihdr = (struct ip_hdr *)hdr->data;
+    len = ntoh16(ihdr->len);
+    mtu = ntoh32(hdr->ih_values) & 0xffff;
+    if (!mtu) {
+        for (p = icmp_mtu_plateaus; p < array_tailof(icmp_mtu_plateaus); p++) {
+            if (*p < len) {
+                mtu = *p;
+                break;
+            }
+        }
+    }
+    // 声称的 MTU 不小于原数据报长度时，这个报文是不可信的
+    if (!mtu || mtu >= len) {
+        return 0;
+    }
+    // 这里还不能确认报文引用的是本机发出的数据报，先按下限更新，上层协议验证后再更新为实际值
+    ip_pmtu_update(&ihdr->dst, mtu, 0);
+    return mtu;
+}
+
+static struct ratelimit icmp_ratelimit = RATELIMIT_INIT(ICMP_RATELIMIT_INTERVAL, ICMP_RATELIMIT_BURST);
+
+static void
+icmp_rx_socket (uint8_t *packet, size_t plen, ip_addr_t *src) {
+    struct icmp_cb *cb;
+    struct icmp_queue_hdr *queue_hdr;
+
+    if (sizeof(struct icmp_queue_hdr) + plen > PGSIZE) {
+        return;
+    }
+    acquire(&icmplock);
+    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
+        if (!cb->used || cb->queue.num >= ICMP_CB_QUEUE_MAX) {
+            continue;
+        }
+        queue_hdr = (struct icmp_queue_hdr *)kalloc();
+        if (!queue_hdr) {
+            break;
+        }
+        queue_hdr->addr = *src;
+        queue_hdr->len = plen;
+        memcpy(queue_hdr + 1, packet, plen);
+        if (!queue_push(&cb->queue, queue_hdr, sizeof(struct icmp_queue_hdr) + plen)) {
+            kfree((char *)queue_hdr);
+            break;
+        }
+        wakeup(cb);
+    }
+    release(&icmplock);
+}
+
 static void
 icmp_rx (uint8_t *packet, size_t plen, ip_addr_t *src, ip_addr_t *dst, struct netif *netif) {
     struct icmp_hdr *hdr;
+    uint32_t values;
 
     (void)dst;
     if (plen < sizeof(struct icmp_hdr)) {
@@ -111,37 +203,238 @@ icmp_rx (uint8_t *packet, size_t plen, ip_addr_t *src, ip_addr_t *dst, struct ne
     cprintf(">>> icmp_rx <<<\n");
     icmp_dump(netif, src, dst, packet, plen);
 #endif
+    if (cksum16((uint16_t *)packet, plen, 0) != 0) {
+        cprintf("icmp checksum error\n");
+        return;
+    }
+    icmp_rx_socket(packet, plen, src);
     hdr = (struct icmp_hdr *)packet;
     switch (hdr->type) {
     case ICMP_TYPE_ECHO:
         icmp_tx(netif, ICMP_TYPE_ECHOREPLY, hdr->code, hdr->ih_values, hdr->data, plen - sizeof(struct icmp_hdr), src);
         break;
+    case ICMP_TYPE_DEST_UNREACH:
+    case ICMP_TYPE_TIME_EXCEEDED:
+    case ICMP_TYPE_PARAM_PROBLEM:
+        values = hdr->ih_values;
+        if (hdr->type == ICMP_TYPE_DEST_UNREACH && hdr->code == ICMP_CODE_FRAGMENT_NEEDED) {
+            // 上层协议看到的是校验过的 MTU（plateau 估计值或 0）
+            values = hton32(icmp_rx_frag_needed(hdr, plen));
+        }
+        ip_rx_error(hdr->type, hdr->code, values, hdr->data, plen - sizeof(struct icmp_hdr), netif);
+        break;
     }
 }
 
+// data 必须位于内核内存中，与 ICMP 头部一起以 gather 列表交给 IP 层，不再拷贝到栈上的缓冲区
 int
 icmp_tx (struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *data, size_t len, ip_addr_t *dst) {
-    uint8_t buf[ICMP_BUFSIZ];
-    struct icmp_hdr *hdr;
-    size_t msg_len;
+    struct icmp_hdr hdr;
+    struct netvec vec[2];
 
-    hdr = (struct icmp_hdr *)buf;
-    hdr->type = type;
-    hdr->code = code;
-    hdr->sum = 0;
-    hdr->ih_values = values;
-    memcpy(hdr->data, data, len);
-    msg_len = sizeof(struct icmp_hdr) + len;
-    hdr->sum = cksum16((uint16_t *)hdr, msg_len, 0);
+    hdr.type = type;
+    hdr.code = code;
+    hdr.sum = 0;
+    hdr.ih_values = values;
+    hdr.sum = cksum_fold(cksum_partial(data, len, cksum_partial(&hdr, sizeof(hdr), 0)));
 #ifdef DEBUG
     cprintf(">>> icmp_tx <<<\n");
-    icmp_dump(netif, NULL, dst, (uint8_t *)hdr, msg_len);
+    icmp_dump(netif, NULL, dst, (uint8_t *)&hdr, sizeof(hdr));
 #endif
-    return ip_tx(netif, IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, dst);
+    vec[0].base = (uint8_t *)&hdr;
+    vec[0].len = sizeof(hdr);
+    vec[1].base = data;
+    vec[1].len = len;
+    return ip_txv(netif, IP_PROTOCOL_ICMP, vec, 2, dst, 0);
+}
+
+static int
+icmp_is_error (uint8_t type) {
+    switch (type) {
+    case ICMP_TYPE_DEST_UNREACH:
+    case ICMP_TYPE_SOURCE_QUENCH:
+    case ICMP_TYPE_REDIRECT:
+    case ICMP_TYPE_TIME_EXCEEDED:
+    case ICMP_TYPE_PARAM_PROBLEM:
+        return 1;
+    }
+    return 0;
+}
+
+// 针对收到的数据报 dgram 生成 ICMP 差错报文，报文中携带原数据报的 IP 头部和随后的 8 字节
+int
+icmp_error (struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *dgram, size_t dlen) {
+    struct ip_hdr *ihdr;
+    size_t hlen, len;
+
+    ihdr = (struct ip_hdr *)dgram;
+    hlen = (ihdr->vhl & 0x0f) << 2;
+    if (dlen < hlen) {
+        return -1;
+    }
+    // 不对分片的非首片、广播以及 ICMP 差错报文本身再生成差错报文（RFC 1122 3.2.2）
+    if (ntoh16(ihdr->offset) & IP_OFFSET_MASK) {
+        return -1;
+    }
+    if (ihdr->dst == IP_ADDR_BROADCAST || ihdr->src == IP_ADDR_ANY || ihdr->src == IP_ADDR_BROADCAST) {
+        return -1;
+    }
+    if (ihdr->protocol == IP_PROTOCOL_ICMP) {
+        if (dlen < hlen + 1 || icmp_is_error(dgram[hlen])) {
+            return -1;
+        }
+    }
+    if (!ratelimit_check(&icmp_ratelimit)) {
+        return -1;
+    }
+    len = MIN(dlen, hlen + 8);
+    return icmp_tx(netif, type, code, values, dgram, len, &ihdr->src);
+}
+
+// 上层协议只拿得到载荷，按原数据报的地址和协议重新构造 IP 头部，再附上载荷的前 8 字节
+int
+icmp_unreach (struct netif *netif, uint8_t code, uint8_t protocol, ip_addr_t *src, ip_addr_t *dst, uint8_t *payload, size_t plen) {
+    uint8_t buf[IP_HDR_SIZE_MIN + 8];
+    struct ip_hdr *hdr;
+    size_t len;
+
+    len = MIN(plen, 8);
+    hdr = (struct ip_hdr *)buf;
+    memset(hdr, 0, IP_HDR_SIZE_MIN);
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    hdr->len = hton16(IP_HDR_SIZE_MIN + plen);
+    hdr->ttl = 1;
+    hdr->protocol = protocol;
+    hdr->src = *src;
+    hdr->dst = *dst;
+    hdr->sum = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    memcpy(hdr + 1, payload, len);
+    return icmp_error(netif, ICMP_TYPE_DEST_UNREACH, code, 0, buf, IP_HDR_SIZE_MIN + len);
+}
+
+int
+icmp_api_open (void) {
+    struct icmp_cb *cb;
+
+    acquire(&icmplock);
+    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
+        if (!cb->used) {
+            cb->used = 1;
+            release(&icmplock);
+            return array_offset(cb_table, cb);
+        }
+    }
+    release(&icmplock);
+    return -1;
+}
+
+int
+icmp_api_close (int soc) {
+    struct icmp_cb *cb;
+    struct queue_entry *entry;
+
+    if (soc < 0 || soc >= ICMP_CB_TABLE_SIZE) {
+        return -1;
+    }
+    acquire(&icmplock);
+    cb = &cb_table[soc];
+    if (!cb->used) {
+        release(&icmplock);
+        return -1;
+    }
+    cb->used = 0;
+    while ((entry = queue_pop(&cb->queue)) != NULL) {
+        kfree((char*)entry->data);
+        kfree((char*)entry);
+    }
+    cb->queue.next = cb->queue.tail = NULL;
+    release(&icmplock);
+    return 0;
+}
+
+// 返回 ICMP 报文（不含 IP 头部），nonblock 时没有报文返回 -EAGAIN
+ssize_t
+icmp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int *addrlen, int nonblock) {
+    struct sockaddr_in *peer = NULL;
+    struct icmp_cb *cb;
+    struct queue_entry *entry;
+    struct icmp_queue_hdr *queue_hdr;
+    ssize_t len;
+
+    if (soc < 0 || soc >= ICMP_CB_TABLE_SIZE) {
+        return -1;
+    }
+    if (addr) {
+        if (*addrlen < sizeof(struct sockaddr_in)) {
+            return -1;
+        }
+        *addrlen = sizeof(struct sockaddr_in);
+        peer = (struct sockaddr_in *)addr;
+    }
+    acquire(&icmplock);
+    cb = &cb_table[soc];
+    if (!cb->used) {
+        release(&icmplock);
+        return -1;
+    }
+    while (!(entry = queue_pop(&cb->queue))) {
+        if (nonblock) {
+            release(&icmplock);
+            return -EAGAIN;
+        }
+        if(myproc()->killed){
+            release(&icmplock);
+            return -1;
+        }
+        sleep(cb, &icmplock);
+    }
+    release(&icmplock);
+    queue_hdr = (struct icmp_queue_hdr *)entry->data;
+    if (peer) {
+        peer->sin_family = AF_INET;
+        peer->sin_addr = queue_hdr->addr;
+        peer->sin_port = 0;
+    }
+    len = MIN(size, queue_hdr->len);
+    memcpy(buf, queue_hdr + 1, len);
+    kfree((char*)entry->data);
+    kfree((char*)entry);
+    return len;
+}
+
+// buf 是完整的 ICMP 报文，校验和由内核计算
+ssize_t
+icmp_api_sendto (int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int addrlen) {
+    struct sockaddr_in *peer;
+    struct icmp_hdr *hdr;
+    ssize_t ret;
+
+    if (soc < 0 || soc >= ICMP_CB_TABLE_SIZE || !cb_table[soc].used) {
+        return -1;
+    }
+    if (!addr || addr->sa_family != AF_INET || addrlen < sizeof(struct sockaddr_in)) {
+        return -1;
+    }
+    if (len < sizeof(struct icmp_hdr) || len > PGSIZE) {
+        return -1;
+    }
+    peer = (struct sockaddr_in *)addr;
+    // 用户空间的缓冲区不能直接 DMA，拷贝到内核页中
+    hdr = (struct icmp_hdr *)kalloc();
+    if (!hdr) {
+        return -1;
+    }
+    memcpy(hdr, buf, len);
+    hdr->sum = 0;
+    hdr->sum = cksum16((uint16_t *)hdr, len, 0);
+    ret = ip_tx(NULL, IP_PROTOCOL_ICMP, (uint8_t *)hdr, len, &peer->sin_addr);
+    kfree((char *)hdr);
+    return ret == -1 ? -1 : (ssize_t)len;
 }
 
 int
 icmp_init (void) {
-    ip_add_protocol(IP_PROTOCOL_ICMP, icmp_rx);
+    initlock(&icmplock, "icmp");
+    ip_add_protocol(IP_PROTOCOL_ICMP, icmp_rx, NULL);
     return 0;
 }
@@ -0,0 +1,140 @@
+#include "types.h"
+#include "defs.h"
+#include "net.h"
+#include "ip6.h"
+#include "icmp6.h"
+
+#define DEBUG
+
+// 邻居发现报文的跳数限制必须是 255，保证它来自同一链路（RFC 4861 6.1）
+#define ICMP6_ND_HOPLIMIT 255
+
+static char *
+icmp6_type_ntoa (uint8_t type) {
+    switch (type) {
+    case ICMP6_TYPE_DEST_UNREACH:
+        return "Destination Unreachable";
+    case ICMP6_TYPE_PACKET_TOO_BIG:
+        return "Packet Too Big";
+    case ICMP6_TYPE_TIME_EXCEEDED:
+        return "Time Exceeded";
+    case ICMP6_TYPE_PARAM_PROBLEM:
+        return "Parameter Problem";
+    case ICMP6_TYPE_ECHO_REQUEST:
+        return "Echo Request";
+    case ICMP6_TYPE_ECHO_REPLY:
+        return "Echo Reply";
+    case ICMP6_TYPE_ROUTER_SOLICIT:
+        return "Router Solicitation";
+    case ICMP6_TYPE_ROUTER_ADVERT:
+        return "Router Advertisement";
+    case ICMP6_TYPE_NEIGHBOR_SOLICIT:
+        return "Neighbor Solicitation";
+    case ICMP6_TYPE_NEIGHBOR_ADVERT:
+        return "Neighbor Advertisement";
+    case ICMP6_TYPE_REDIRECT:
+        return "Redirect";
+    }
+    return "Unknown";
+}
+
+void
+icmp6_dump (uint8_t *packet, size_t plen) {
+    struct icmp6_hdr *hdr;
+
+    hdr = (struct icmp6_hdr *)packet;
+    cprintf("   type: %u (%s)\n", hdr->type, icmp6_type_ntoa(hdr->type));
+    cprintf("   code: %u\n", hdr->code);
+    cprintf("    sum: 0x%04x\n", ntoh16(hdr->sum));
+    cprintf(" values: 0x%08x\n", ntoh32(hdr->values));
+    hexdump(packet, plen);
+}
+
+// data 必须位于内核直接映射的内存中，源地址是 netif 的地址
+int
+icmp6_tx (struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *data, size_t len, const ip6_addr_t *dst, uint8_t hlim) {
+    struct icmp6_hdr hdr;
+    struct netvec vec[2];
+    uint32_t sum;
+
+    hdr.type = type;
+    hdr.code = code;
+    hdr.sum = 0;
+    hdr.values = values;
+    sum = ip6_pseudo_sum(&((struct netif_ip6 *)netif)->unicast, dst, IP6_NEXTHDR_ICMPV6, sizeof(hdr) + len);
+    sum = cksum_partial(&hdr, sizeof(hdr), sum);
+    hdr.sum = cksum_fold(cksum_partial(data, len, sum));
+#ifdef DEBUG
+    cprintf(">>> icmp6_tx <<<\n");
+    icmp6_dump((uint8_t *)&hdr, sizeof(hdr));
+#endif
+    vec[0].base = (uint8_t *)&hdr;
+    vec[0].len = sizeof(hdr);
+    vec[1].base = data;
+    vec[1].len = len;
+    return ip6_txv(netif, IP6_NEXTHDR_ICMPV6, vec, 2, dst, hlim);
+}
+
+static void
+icmp6_rx (uint8_t *packet, size_t plen, struct ip6_hdr *ihdr, struct netif *netif) {
+    struct icmp6_hdr *hdr;
+    uint32_t sum;
+
+    if (plen < sizeof(struct icmp6_hdr)) {
+        return;
+    }
+    sum = ip6_pseudo_sum(&ihdr->src, &ihdr->dst, IP6_NEXTHDR_ICMPV6, plen);
+    if (cksum_fold(cksum_partial(packet, plen, sum)) != 0) {
+        cprintf("icmp6 checksum error\n");
+        return;
+    }
+#ifdef DEBUG
+    cprintf(">>> icmp6_rx <<<\n");
+    icmp6_dump(packet, plen);
+#endif
+    hdr = (struct icmp6_hdr *)packet;
+    switch (hdr->type) {
+    case ICMP6_TYPE_ECHO_REQUEST:
+        if (IP6_ADDR_IS_UNSPECIFIED(&ihdr->src)) {
+            break;
+        }
+        // 应答的数据直接引用接收缓冲区
+        icmp6_tx(netif, ICMP6_TYPE_ECHO_REPLY, 0, hdr->values, (uint8_t *)(hdr + 1), plen - sizeof(struct icmp6_hdr), &ihdr->src, 0);
+        break;
+    case ICMP6_TYPE_NEIGHBOR_SOLICIT:
+        if (ihdr->hlim == ICMP6_ND_HOPLIMIT && !hdr->code) {
+            nd6_rx_solicit((uint8_t *)(hdr + 1), plen - sizeof(struct icmp6_hdr), ihdr, netif);
+        }
+        break;
+    case ICMP6_TYPE_NEIGHBOR_ADVERT:
+        if (ihdr->hlim == ICMP6_ND_HOPLIMIT && !hdr->code) {
+            nd6_rx_advert((uint8_t *)(hdr + 1), plen - sizeof(struct icmp6_hdr), ihdr, netif);
+        }
+        break;
+    case ICMP6_TYPE_ROUTER_ADVERT:
+        if (ihdr->hlim == ICMP6_ND_HOPLIMIT && !hdr->code) {
+            nd6_rx_router_advert(hdr->values, (uint8_t *)(hdr + 1), plen - sizeof(struct icmp6_hdr), ihdr, netif);
+        }
+        break;
+    case ICMP6_TYPE_PACKET_TOO_BIG:
+        // 路径 MTU 不会低于 1280，伪造的报文最多让段变小，所以不等上层协议验证就更新（RFC 8201 4）
+        if (plen >= sizeof(struct icmp6_hdr) + IP6_HDR_SIZE) {
+            ip6_pmtu_update(&((struct ip6_hdr *)(hdr + 1))->dst, ntoh32(hdr->values));
+        }
+        /* fall through */
+    case ICMP6_TYPE_DEST_UNREACH:
+    case ICMP6_TYPE_TIME_EXCEEDED:
+    case ICMP6_TYPE_PARAM_PROBLEM:
+        ip6_rx_error(hdr->type, hdr->code, hdr->values, (uint8_t *)(hdr + 1), plen - sizeof(struct icmp6_hdr), netif);
+        break;
+    default:
+        /* ignore */
+        break;
+    }
+}
+
+int
+icmp6_init (void) {
+    ip6_add_protocol(IP6_NEXTHDR_ICMPV6, icmp6_rx, NULL);
+    return 0;
+}
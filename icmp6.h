@@ -0,0 +1,24 @@
+#define ICMP6_TYPE_DEST_UNREACH 1
+#define ICMP6_TYPE_PACKET_TOO_BIG 2
+#define ICMP6_TYPE_TIME_EXCEEDED 3
+#define ICMP6_TYPE_PARAM_PROBLEM 4
+#define ICMP6_TYPE_ECHO_REQUEST 128
+#define ICMP6_TYPE_ECHO_REPLY 129
+#define ICMP6_TYPE_ROUTER_SOLICIT 133
+#define ICMP6_TYPE_ROUTER_ADVERT 134
+#define ICMP6_TYPE_NEIGHBOR_SOLICIT 135
+#define ICMP6_TYPE_NEIGHBOR_ADVERT 136
+#define ICMP6_TYPE_REDIRECT 137
+
+/* for DEST_UNREACH */
+#define ICMP6_CODE_NO_ROUTE 0
+#define ICMP6_CODE_ADMIN_PROHIBITED 1
+#define ICMP6_CODE_ADDR_UNREACH 3
+#define ICMP6_CODE_PORT_UNREACH 4
+
+struct icmp6_hdr {
+    uint8_t type;
+    uint8_t code;
+    uint16_t sum;
+    uint32_t values;
+};
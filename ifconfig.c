@@ -8,6 +8,9 @@ static void
 display(const char *name)
 {
     struct ifreq ifr;
+    struct ifaliasreq ifra;
+    struct in6_aliasreq ifra6;
+    char buf[IP6_ADDR_STR_LEN];
     int fd;
     char **s, *str[] = {
         "UP",
@@ -64,26 +67,25 @@ display(const char *name)
         p = (uint8_t *)ifr.ifr_hwaddr.sa_data;
         printf(0, "\tether %x:%x:%x:%x:%x:%x\n", p[0], p[1], p[2], p[3], p[4], p[5]);
     }
-    do {
-        // addr
-        ifr.ifr_addr.sa_family = AF_INET;
-        if (ioctl(fd, SIOCGIFADDR, &ifr) == -1)
-            break;
-        p = (uint8_t *)&((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+    // addresses (the first one is the primary address)
+    strcpy(ifra.ifra_name, name);
+    for (ifra.ifra_index = 0; ioctl(fd, SIOCGIFALIAS, &ifra) != -1; ifra.ifra_index++) {
+        p = (uint8_t *)&((struct sockaddr_in *)&ifra.ifra_addr)->sin_addr;
         printf(0, "\tinet %d.%d.%d.%d", p[0], p[1], p[2], p[3]);
-        // netmask
-        ifr.ifr_netmask.sa_family = AF_INET;
-        if (ioctl(fd, SIOCGIFNETMASK, &ifr) == -1)
-            break;
-        p = (uint8_t *)&((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr;
+        p = (uint8_t *)&((struct sockaddr_in *)&ifra.ifra_mask)->sin_addr;
         printf(0, " netmask %d.%d.%d.%d", p[0], p[1], p[2], p[3]);
-        // broadcast
-        ifr.ifr_broadaddr.sa_family = AF_INET;
-        if (ioctl(fd, SIOCGIFBRDADDR, &ifr) == -1)
-            break;
-        p = (uint8_t *)&((struct sockaddr_in *)&ifr.ifr_broadaddr)->sin_addr;
+        p = (uint8_t *)&((struct sockaddr_in *)&ifra.ifra_broadaddr)->sin_addr;
         printf(0, " broadcast %d.%d.%d.%d\n", p[0], p[1], p[2], p[3]);
-    } while(0);
+    }
+    strcpy(ifra6.ifra_name, name);
+    for (ifra6.ifra_index = 0; ioctl(fd, SIOCGIFALIAS_IN6, &ifra6) != -1; ifra6.ifra_index++) {
+        printf(0, "\tinet6 %s", ip6_addr_ntop(&ifra6.ifra_addr.sin6_addr, buf, sizeof(buf)));
+        printf(0, " prefixlen %d", ifra6.ifra_prefixlen);
+        if (ifra6.ifra_gateway.sin6_addr.addr32[0] || ifra6.ifra_gateway.sin6_addr.addr32[1] ||
+            ifra6.ifra_gateway.sin6_addr.addr32[2] || ifra6.ifra_gateway.sin6_addr.addr32[3])
+            printf(0, " gateway %s", ip6_addr_ntop(&ifra6.ifra_gateway.sin6_addr, buf, sizeof(buf)));
+        printf(0, "\n");
+    }
     close(fd);
 }
 
@@ -181,12 +183,57 @@ ifset(const char *name, ip_addr_t *addr, ip_addr_t *netmask)
     close(fd);
 }
 
+static void
+ifalias(const char *name, int req, ip_addr_t *addr, ip_addr_t *netmask)
+{
+    int fd;
+    struct ifaliasreq ifra;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        return;
+    memset(&ifra, 0, sizeof(ifra));
+    strcpy(ifra.ifra_name, name);
+    ifra.ifra_addr.sa_family = AF_INET;
+    ((struct sockaddr_in *)&ifra.ifra_addr)->sin_addr = *addr;
+    ifra.ifra_mask.sa_family = AF_INET;
+    ((struct sockaddr_in *)&ifra.ifra_mask)->sin_addr = *netmask;
+    if (ioctl(fd, req, &ifra) == -1)
+        printf(0, "ifconfig: ioctl(%s) failure, interface=%s\n", req == SIOCAIFADDR ? "SIOCAIFADDR" : "SIOCDIFADDR", name);
+    close(fd);
+}
+
+static void
+ifalias6(const char *name, int req, ip6_addr_t *addr, int prefixlen, ip6_addr_t *gateway)
+{
+    int fd;
+    struct in6_aliasreq ifra;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        return;
+    memset(&ifra, 0, sizeof(ifra));
+    strcpy(ifra.ifra_name, name);
+    ifra.ifra_addr.sin6_family = AF_INET6;
+    ifra.ifra_addr.sin6_addr = *addr;
+    ifra.ifra_gateway.sin6_family = AF_INET6;
+    ifra.ifra_gateway.sin6_addr = *gateway;
+    ifra.ifra_prefixlen = prefixlen;
+    if (ioctl(fd, req, &ifra) == -1)
+        printf(0, "ifconfig: ioctl(%s) failure, interface=%s\n", req == SIOCAIFADDR_IN6 ? "SIOCAIFADDR_IN6" : "SIOCDIFADDR_IN6", name);
+    close(fd);
+}
+
 static void
 usage(void)
 {
     printf(0, "usage: ifconfig interface [command|address]\n");
     printf(0, "           - command: up | down\n");
     printf(0, "           - address: ADDRESS/PREFIX | ADDRESS netmask NETMASK\n");
+    printf(0, "       ifconfig interface alias ADDRESS[/PREFIX] [netmask NETMASK]\n");
+    printf(0, "       ifconfig interface -alias ADDRESS\n");
+    printf(0, "       ifconfig interface inet6 ADDRESS/PREFIX [gw GATEWAY]\n");
+    printf(0, "       ifconfig interface inet6 -alias ADDRESS\n");
     printf(0, "       ifconfig [-a]\n");
     exit();
 }
@@ -196,6 +243,7 @@ main(int argc, char *argv[])
 {
     char *s;
     ip_addr_t addr, netmask;
+    ip6_addr_t addr6, gateway6;
     int prefix = 0;
 
     if (argc == 1) {
@@ -209,6 +257,58 @@ main(int argc, char *argv[])
             display(argv[1]);
         exit();
     }
+    if (argc >= 4 && strcmp(argv[2], "inet6") == 0) {
+        memset(&gateway6, 0, sizeof(gateway6));
+        if (strcmp(argv[3], "-alias") == 0) {
+            if (argc != 5 || ip6_addr_pton(argv[4], &addr6) == -1)
+                usage();
+            ifalias6(argv[1], SIOCDIFADDR_IN6, &addr6, 0, &gateway6);
+            exit();
+        }
+        s = strchr(argv[3], '/');
+        if (!s)
+            usage();
+        *s++ = 0;
+        prefix = atoi(s);
+        if (prefix <= 0 || prefix > 128 || ip6_addr_pton(argv[3], &addr6) == -1)
+            usage();
+        if (argc == 6 && strcmp(argv[4], "gw") == 0) {
+            if (ip6_addr_pton(argv[5], &gateway6) == -1)
+                usage();
+        } else if (argc != 4) {
+            usage();
+        }
+        ifalias6(argv[1], SIOCAIFADDR_IN6, &addr6, prefix, &gateway6);
+        exit();
+    }
+    if (argc >= 4 && strcmp(argv[2], "-alias") == 0) {
+        if (argc != 4 || ip_addr_pton(argv[3], &addr) == -1)
+            usage();
+        netmask = 0;
+        ifalias(argv[1], SIOCDIFADDR, &addr, &netmask);
+        exit();
+    }
+    if (argc >= 4 && strcmp(argv[2], "alias") == 0) {
+        netmask = 0xffffffff;
+        s = strchr(argv[3], '/');
+        if (s) {
+            *s++ = 0;
+            prefix = atoi(s);
+            if (prefix < 0 || prefix > 32)
+                usage();
+            netmask = prefix ? hton32(0xffffffff << (32 - prefix)) : 0;
+        }
+        if (ip_addr_pton(argv[3], &addr) == -1)
+            usage();
+        if (argc == 6 && strcmp(argv[4], "netmask") == 0) {
+            if (ip_addr_pton(argv[5], &netmask) == -1)
+                usage();
+        } else if (argc != 4) {
+            usage();
+        }
+        ifalias(argv[1], SIOCAIFADDR, &addr, &netmask);
+        exit();
+    }
     if (argc == 3) {
         if (strcmp(argv[2], "up") == 0) {
             ifup(argv[1]);
@@ -0,0 +1,201 @@
+#include "types.h"
+#include "defs.h"
+#include "spinlock.h"
+#include "net.h"
+#include "ethernet.h"
+#include "ip.h"
+
+/*
+ * IGMPv2 (RFC 2236) 的主机部分：加入组时发送成员报告，最后一个成员离开时发送离开报文，
+ * 收到查询时立即为设备上加入的组回复报告（不做随机延迟和报告抑制）。
+ * 组表按 (接口, 组地址) 计数，同一组的多个套接字共享一个表项和一个硬件过滤表项。
+ */
+
+#define DEBUG
+
+#define IGMP_GROUP_TABLE_SIZE 32
+
+#define IGMP_TYPE_QUERY     0x11
+#define IGMP_TYPE_V1_REPORT 0x12
+#define IGMP_TYPE_V2_REPORT 0x16
+#define IGMP_TYPE_LEAVE     0x17
+
+#define IGMP_ADDR_ALLHOSTS   0xe0000001 /* 224.0.0.1 */
+#define IGMP_ADDR_ALLROUTERS 0xe0000002 /* 224.0.0.2 */
+
+struct igmp_hdr {
+    uint8_t type;
+    uint8_t mrt; // 最大响应时间，以 0.1 秒为单位（只在查询中使用）
+    uint16_t sum;
+    ip_addr_t group;
+};
+
+struct igmp_group {
+    int refs;
+    struct netif *netif;
+    ip_addr_t group;
+};
+
+static struct spinlock igmplock;
+static struct igmp_group groups[IGMP_GROUP_TABLE_SIZE];
+
+static void
+igmp_dump (uint8_t *packet, size_t plen) {
+    struct igmp_hdr *hdr;
+    char addr[IP_ADDR_STR_LEN];
+
+    hdr = (struct igmp_hdr *)packet;
+    cprintf("  type: 0x%02x\n", hdr->type);
+    cprintf("   mrt: %u\n", hdr->mrt);
+    cprintf("   sum: 0x%04x\n", ntoh16(hdr->sum));
+    cprintf(" group: %s\n", ip_addr_ntop(&hdr->group, addr, sizeof(addr)));
+    hexdump(packet, plen);
+}
+
+static int
+igmp_tx (struct netif *netif, uint8_t type, ip_addr_t group, ip_addr_t dst) {
+    struct igmp_hdr hdr;
+
+    hdr.type = type;
+    hdr.mrt = 0;
+    hdr.sum = 0;
+    hdr.group = group;
+    hdr.sum = cksum16((uint16_t *)&hdr, sizeof(hdr), 0);
+#ifdef DEBUG
+    cprintf(">>> igmp_tx <<<\n");
+    igmp_dump((uint8_t *)&hdr, sizeof(hdr));
+#endif
+    return ip_tx(netif, IP_PROTOCOL_IGMP, (uint8_t *)&hdr, sizeof(hdr), &dst);
+}
+
+// 收到的组播数据报交给哪个接口：设备上加入了该组的接口，全主机组总是交给主地址
+struct netif *
+igmp_group_netif (struct netdev *dev, ip_addr_t group) {
+    struct igmp_group *entry;
+    struct netif *netif = NULL;
+
+    if (group == hton32(IGMP_ADDR_ALLHOSTS)) {
+        return netdev_get_netif(dev, NETIF_FAMILY_IPV4);
+    }
+    acquire(&igmplock);
+    for (entry = groups; entry < array_tailof(groups); entry++) {
+        if (entry->refs && entry->group == group && entry->netif->dev == dev) {
+            netif = entry->netif;
+            break;
+        }
+    }
+    release(&igmplock);
+    return netif;
+}
+
+int
+igmp_join (struct netif *netif, ip_addr_t group) {
+    struct igmp_group *entry, *free = NULL;
+    uint8_t ha[ETHERNET_ADDR_LEN];
+
+    if (!IP_ADDR_IS_MULTICAST(&group) || group == hton32(IGMP_ADDR_ALLHOSTS)) {
+        return -1;
+    }
+    acquire(&igmplock);
+    for (entry = groups; entry < array_tailof(groups); entry++) {
+        if (entry->refs && entry->netif == netif && entry->group == group) {
+            entry->refs++;
+            release(&igmplock);
+            return 0;
+        }
+        if (!entry->refs && !free) {
+            free = entry;
+        }
+    }
+    if (!free) {
+        release(&igmplock);
+        return -1;
+    }
+    free->refs = 1;
+    free->netif = netif;
+    free->group = group;
+    release(&igmplock);
+    if (netif->dev->alen == ETHERNET_ADDR_LEN) {
+        ip_mcast_ha(&group, ha);
+        netdev_add_mcast(netif->dev, ha);
+    }
+    igmp_tx(netif, IGMP_TYPE_V2_REPORT, group, group);
+    return 0;
+}
+
+int
+igmp_leave (struct netif *netif, ip_addr_t group) {
+    struct igmp_group *entry;
+    uint8_t ha[ETHERNET_ADDR_LEN];
+
+    acquire(&igmplock);
+    for (entry = groups; entry < array_tailof(groups); entry++) {
+        if (entry->refs && entry->netif == netif && entry->group == group) {
+            break;
+        }
+    }
+    if (entry == array_tailof(groups)) {
+        release(&igmplock);
+        return -1;
+    }
+    if (--entry->refs) {
+        release(&igmplock);
+        return 0;
+    }
+    entry->netif = NULL;
+    release(&igmplock);
+    if (netif->dev->alen == ETHERNET_ADDR_LEN) {
+        ip_mcast_ha(&group, ha);
+        netdev_del_mcast(netif->dev, ha);
+    }
+    igmp_tx(netif, IGMP_TYPE_LEAVE, group, hton32(IGMP_ADDR_ALLROUTERS));
+    return 0;
+}
+
+static void
+igmp_rx (uint8_t *packet, size_t plen, ip_addr_t *src, ip_addr_t *dst, struct netif *netif) {
+    struct igmp_hdr *hdr;
+    struct igmp_group *entry;
+    struct netif *ifs[IGMP_GROUP_TABLE_SIZE];
+    ip_addr_t reports[IGMP_GROUP_TABLE_SIZE];
+    int num = 0, n;
+
+    (void)src;
+    (void)dst;
+    if (plen < sizeof(struct igmp_hdr)) {
+        return;
+    }
+    if (cksum16((uint16_t *)packet, plen, 0) != 0) {
+        cprintf("igmp checksum error\n");
+        return;
+    }
+#ifdef DEBUG
+    cprintf(">>> igmp_rx <<<\n");
+    igmp_dump(packet, plen);
+#endif
+    hdr = (struct igmp_hdr *)packet;
+    if (hdr->type != IGMP_TYPE_QUERY) {
+        /* reports of other members are ignored (no suppression) */
+        return;
+    }
+    // 组地址为 0 的是通用查询；发送时不持有锁，先把要报告的组取出来
+    acquire(&igmplock);
+    for (entry = groups; entry < array_tailof(groups); entry++) {
+        if (entry->refs && entry->netif->dev == netif->dev && (!hdr->group || hdr->group == entry->group)) {
+            ifs[num] = entry->netif;
+            reports[num] = entry->group;
+            num++;
+        }
+    }
+    release(&igmplock);
+    for (n = 0; n < num; n++) {
+        igmp_tx(ifs[n], IGMP_TYPE_V2_REPORT, reports[n], reports[n]);
+    }
+}
+
+int
+igmp_init (void) {
+    initlock(&igmplock, "igmp");
+    ip_add_protocol(IP_PROTOCOL_IGMP, igmp_rx, NULL);
+    return 0;
+}
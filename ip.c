@@ -3,55 +3,97 @@
 
 #include "types.h"
 #include "defs.h"
+#include "x86.h"
 #include "spinlock.h"
+#include "common.h"
 #include "net.h"
 #include "ethernet.h"
 #include "ip.h"
+#include "icmp.h"
 #define DEBUG
 
 
-#define IP_VERSION_IPV4 4
+#define IP_ROUTE_CACHE_SIZE 64 /* must be a power of 2 */
+#define IP_ID_TABLE_BITS 8
 
-#define IP_ROUTE_TABLE_SIZE 8
+#define IP_NETIF_HASH_SIZE 16 /* must be a power of 2 */
 
-struct ip_route {
-    uint8_t used;
-    ip_addr_t network;
-    ip_addr_t netmask;
-    ip_addr_t nexthop;
-    struct netif *netif;
+#define IP_PMTU_TABLE_SIZE 64 /* must be a power of 2 */
+#define IP_PMTU_TIMEOUT_SEC 600
+#define IP_PMTU_MIN 68
+#define IP_PMTU_MIN_UNVERIFIED 552 /* 未经上层协议验证的差错报文最多把路径 MTU 降到这里 */
+
+#define IP_REASS_TABLE_SIZE 4
+#define IP_REASS_TIMEOUT_SEC 30
+#define IP_REASS_NONE 0xffff
+
+// 最长前缀匹配用的二叉前缀树节点，深度即前缀长度，前缀相同的路由挂在同一个节点上
+struct ip_route_node {
+    struct ip_route_node *child[2];
+    struct ip_route *routes;
+};
+
+// 按目的地址直接映射的路径 MTU 缓存，只记录比出口接口 MTU 更小的值（RFC 1191）
+struct ip_pmtu {
+    ip_addr_t dst;
+    uint16_t mtu;
+    time_t expire;
+};
+
+// 按目的地址直接映射的路由缓存，路由表发生变化时通过 generation 使所有缓存项失效
+struct ip_route_cache {
+    ip_addr_t dst;
+    uint32_t generation;
+    struct ip_route *route;
 };
 
 struct ip_protocol {
     struct ip_protocol *next;
     uint8_t type;
     void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif);
+    void (*errhandler)(uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif);
 };
 
-struct ip_hdr {
-    uint8_t vhl; // 用于存储IP版本号和头部长度
-    uint8_t tos; // 服务类型字段，指定服务质量要求：普通、优先、立即、闪电式、比闪电还闪电式
-    uint16_t len; // 表示IP数据报的总长度
-    uint16_t id; // 标识字段，用于唯一标识一个IP数据报
-    // 分段偏移量，用于分片和重组分段。前3bit控制IP分片和重组。
-    // 第二位DF（Don't Fragment）位，指示数据包是否可以被分片。
-    // 第三位是MF（More Fragments）位，指示数据包是否是分片的最后一片
-    // 偏移量字段占据了标志字段的后13位，用于指示当前分片在原始数据包中的位置。偏移量以 8 字节为单位计算，因此乘以8可以得到实际的字节偏移量。
-    uint16_t offset;
-    uint8_t ttl; // 存活时间，指定数据包在网络中可以经过的最大路由器跳数
-    uint8_t protocol; // 协议字段，指定IP数据报中封装的协议类型
-    uint16_t sum; // 校验和字段，用于验证IP数据报的完整性
-    ip_addr_t src; //  源IP地址
-    ip_addr_t dst; //  目的IP地址
-    uint8_t options[0];
+// 分片重组的空洞描述符（RFC 815），直接存放在重组缓冲区中空洞的起始位置
+struct ip_reass_hole {
+    uint16_t first;
+    uint16_t last; // IP_REASS_NONE 表示无穷大
+    uint16_t next; // 下一个空洞的偏移，IP_REASS_NONE 表示链表结束
+};
+
+struct ip_reass {
+    uint8_t used;
+    uint8_t busy; // 已重组完成、正在锁外交付给上层协议，交付结束前不能复用
+    uint8_t protocol;
+    uint16_t id;
+    ip_addr_t src;
+    ip_addr_t dst;
+    struct netif *netif;
+    time_t timestamp; // 收到第一个分片的时间，用于重组超时
+    uint16_t holes; // 第一个空洞的偏移
+    uint16_t len; // 收到最后一个分片后才能确定的数据报总长度
+    uint8_t data[IP_PAYLOAD_SIZE_MAX];
 };
 
 const ip_addr_t IP_ADDR_ANY       = 0x00000000;
 const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff;
 
-static struct spinlock iplock;
-static struct ip_route route_table[IP_ROUTE_TABLE_SIZE];
+static struct spinlock routelock;
+static struct ip_route_node route_root;
+static struct ip_route_cache route_cache[IP_ROUTE_CACHE_SIZE];
+static uint32_t route_generation = 1;
+static struct slab_cache route_slab;
+static struct slab_cache route_node_slab;
+static struct spinlock netiflock;
+static struct netif_ip *netif_hash[IP_NETIF_HASH_SIZE];
+static int forwarding;
+static struct spinlock pmtulock;
+static struct ip_pmtu pmtu_table[IP_PMTU_TABLE_SIZE];
+static uint32_t id_secret;
+static uint32_t id_table[1 << IP_ID_TABLE_BITS];
 static struct ip_protocol *protocols;
+static struct spinlock reasslock;
+static struct ip_reass reass_table[IP_REASS_TABLE_SIZE];
 
 int
 ip_addr_pton (const char *p, ip_addr_t *n) {
@@ -116,64 +158,390 @@ ip_dump (struct netif *netif, uint8_t *packet, size_t plen) {
 /*
  * IP ROUTING
  * 新增网络接口时会新增一个路由信息，nexthop的地址为0
+ * 路由保存在以前缀长度为深度的二叉前缀树中，查找时沿目的地址的比特向下走并记住最后一个匹配的路由，
+ * 即最长前缀匹配；查找结果再缓存在一个小的按目的地址索引的缓存中。
  */
 
 static int
+ip_route_prefixlen (ip_addr_t netmask) {
+    uint32_t mask;
+    int len = 0;
+
+    mask = ntoh32(netmask);
+    while (mask & 0x80000000) {
+        mask <<= 1;
+        len++;
+    }
+    if (mask) {
+        /* non-contiguous netmask */
+        return -1;
+    }
+    return len;
+}
+
+static inline int
+ip_route_bit (uint32_t addr, int depth) {
+    return (addr >> (31 - depth)) & 0x01;
+}
+
+static void
+ip_route_invalidate (void) {
+    route_generation++;
+    if (!route_generation) {
+        memset(route_cache, 0, sizeof(route_cache));
+        route_generation = 1;
+    }
+}
+
+int
 ip_route_add (ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct netif *netif) {
-    struct ip_route *route;
+    struct ip_route_node *node, *child;
+    struct ip_route *route, **tail;
+    uint32_t addr;
+    int plen, depth;
 
-    for (route = route_table; route < array_tailof(route_table); route++) {
-        if (!route->used) {
-            route->used = 1;
-            route->network = network;
-            route->netmask = netmask;
-            route->nexthop = nexthop;
-            route->netif = netif;
-            return 0;
+    plen = ip_route_prefixlen(netmask);
+    if (plen == -1 || !netif) {
+        return -1;
+    }
+    network &= netmask;
+    addr = ntoh32(network);
+    acquire(&routelock);
+    node = &route_root;
+    for (depth = 0; depth < plen; depth++) {
+        child = node->child[ip_route_bit(addr, depth)];
+        if (!child) {
+            child = (struct ip_route_node *)slab_alloc(&route_node_slab);
+            if (!child) {
+                release(&routelock);
+                return -1;
+            }
+            node->child[ip_route_bit(addr, depth)] = child;
         }
+        node = child;
     }
-    return -1;
+    for (tail = &node->routes; *tail; tail = &(*tail)->next) {
+        if ((*tail)->nexthop == nexthop && (*tail)->netif == netif) {
+            release(&routelock);
+            return -1;
+        }
+    }
+    route = (struct ip_route *)slab_alloc(&route_slab);
+    if (!route) {
+        release(&routelock);
+        return -1;
+    }
+    route->network = network;
+    route->netmask = netmask;
+    route->nexthop = nexthop;
+    route->netif = netif;
+    // 同一前缀的多条路由中先加入的优先
+    *tail = route;
+    ip_route_invalidate();
+    release(&routelock);
+    return 0;
+}
+
+// 删除前缀完全一致的路由，nexthop 为 IP_ADDR_ANY 或 netif 为 NULL 时该条件不参与匹配
+int
+ip_route_delete (ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct netif *netif) {
+    struct ip_route_node *path[33], *node;
+    struct ip_route *route, **prev;
+    uint32_t addr;
+    int plen, depth, found = 0;
+
+    plen = ip_route_prefixlen(netmask);
+    if (plen == -1) {
+        return -1;
+    }
+    addr = ntoh32(network & netmask);
+    acquire(&routelock);
+    node = &route_root;
+    for (depth = 0; node && depth < plen; depth++) {
+        path[depth] = node;
+        node = node->child[ip_route_bit(addr, depth)];
+    }
+    if (!node) {
+        release(&routelock);
+        return -1;
+    }
+    prev = &node->routes;
+    while ((route = *prev) != NULL) {
+        if ((!nexthop || route->nexthop == nexthop) && (!netif || route->netif == netif)) {
+            *prev = route->next;
+            slab_free(&route_slab, route);
+            found = 1;
+            continue;
+        }
+        prev = &route->next;
+    }
+    // 回收不再需要的节点
+    for (depth = plen - 1; depth >= 0; depth--) {
+        if (node->routes || node->child[0] || node->child[1]) {
+            break;
+        }
+        path[depth]->child[ip_route_bit(addr, depth)] = NULL;
+        slab_free(&route_node_slab, node);
+        node = path[depth];
+    }
+    if (found) {
+        ip_route_invalidate();
+    }
+    release(&routelock);
+    return found ? 0 : -1;
 }
 
 static int
-ip_route_del (struct netif *netif) {
-    struct ip_route *route;
+ip_route_prune (struct ip_route_node *node, struct netif *netif) {
+    struct ip_route *route, **prev;
+    int n;
 
-    for (route = route_table; route < array_tailof(route_table); route++) {
-        if (route->used) {
-            if (route->netif == netif) {
-                route->used = 0;
-            }
+    prev = &node->routes;
+    while ((route = *prev) != NULL) {
+        if (route->netif == netif) {
+            *prev = route->next;
+            slab_free(&route_slab, route);
+            continue;
         }
+        prev = &route->next;
     }
+    for (n = 0; n < 2; n++) {
+        if (node->child[n] && ip_route_prune(node->child[n], netif)) {
+            slab_free(&route_node_slab, node->child[n]);
+            node->child[n] = NULL;
+        }
+    }
+    return !node->routes && !node->child[0] && !node->child[1];
+}
+
+// 删除指定网络接口的所有路由
+static int
+ip_route_del (struct netif *netif) {
+    acquire(&routelock);
+    ip_route_prune(&route_root, netif);
+    ip_route_invalidate();
+    release(&routelock);
     return 0;
 }
 
-// 在路由表中查找最匹配给定目标 IP 地址的路由条目，并返回最佳匹配的路由。借助路由表中的网络地址、掩码和接口信息，函数可以确定数据包应该通过哪个路由发送
 static struct ip_route *
-ip_route_lookup (const struct netif *netif, const ip_addr_t *dst) {
+ip_route_lookup_trie (const struct netif *netif, ip_addr_t dst) {
+    struct ip_route_node *node;
     struct ip_route *route, *candidate = NULL;
+    uint32_t addr;
+    int depth = 0;
 
-    for (route = route_table; route < array_tailof(route_table); route++) {
-        // 判断目标 IP 地址是否与当前路由的网络地址相匹配（(*dst & route->netmask) == route->network）并且如果提供了网络接口参数 netif，则还需判断路由的网络接口是否匹配
-        if (route->used && (*dst & route->netmask) == route->network && (!netif || route->netif == netif)) {
-            // 比较当前路由的掩码和候选路由的掩码大小，选择掩码更大（即子网范围更小）的路由作为候选
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
+    addr = ntoh32(dst);
+    node = &route_root;
+    while (node) {
+        for (route = node->routes; route; route = route->next) {
+            if (!netif || route->netif == netif) {
                 candidate = route;
+                break;
             }
         }
+        if (depth == 32) {
+            break;
+        }
+        node = node->child[ip_route_bit(addr, depth++)];
     }
     return candidate;
 }
 
+// 在路由表中查找最匹配给定目标 IP 地址的路由条目，找到时把它复制到 result 中，避免在锁外引用可能被删除的路由
+static int
+ip_route_lookup (const struct netif *netif, const ip_addr_t *dst, struct ip_route *result) {
+    struct ip_route_cache *cache;
+    struct ip_route *route;
+    uint32_t hash;
+
+    acquire(&routelock);
+    if (netif) {
+        route = ip_route_lookup_trie(netif, *dst);
+    } else {
+        hash = ntoh32(*dst);
+        hash ^= hash >> 16;
+        hash ^= hash >> 8;
+        cache = &route_cache[hash & (IP_ROUTE_CACHE_SIZE - 1)];
+        if (cache->generation != route_generation || cache->dst != *dst) {
+            cache->dst = *dst;
+            cache->route = ip_route_lookup_trie(NULL, *dst);
+            cache->generation = route_generation;
+        }
+        route = cache->route;
+    }
+    if (route) {
+        *result = *route;
+        result->next = NULL;
+    }
+    release(&routelock);
+    return route ? 0 : -1;
+}
+
+static int
+ip_route_walk (struct ip_route_node *node, int *index, struct ip_route *result) {
+    struct ip_route *route;
+    int n;
+
+    for (route = node->routes; route; route = route->next) {
+        if ((*index)-- == 0) {
+            *result = *route;
+            result->next = NULL;
+            return 0;
+        }
+    }
+    for (n = 0; n < 2; n++) {
+        if (node->child[n] && ip_route_walk(node->child[n], index, result) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 按前缀树的前序遍历取出第 index 条路由，用于列出路由表
+int
+ip_route_get (int index, struct ip_route *result) {
+    int ret;
+
+    if (index < 0) {
+        return -1;
+    }
+    acquire(&routelock);
+    ret = ip_route_walk(&route_root, &index, result);
+    release(&routelock);
+    return ret;
+}
+
+/*
+ * IP PATH MTU DISCOVERY
+ */
+
+static struct ip_pmtu *
+ip_pmtu_entry (const ip_addr_t *dst) {
+    uint32_t hash;
+
+    hash = *dst * 0x9e3779b1;
+    return &pmtu_table[(hash >> 16) & (IP_PMTU_TABLE_SIZE - 1)];
+}
+
+// 返回 dst 的路径 MTU 缓存值，没有缓存或者已经过期时返回 0
+static uint16_t
+ip_pmtu_lookup (const ip_addr_t *dst) {
+    struct ip_pmtu *entry;
+    uint16_t mtu = 0;
+    time_t now;
+
+    time(&now);
+    acquire(&pmtulock);
+    entry = ip_pmtu_entry(dst);
+    if (entry->mtu && entry->dst == *dst) {
+        if (now < entry->expire) {
+            mtu = entry->mtu;
+        } else {
+            /* expired: probe the interface MTU again */
+            entry->mtu = 0;
+        }
+    }
+    release(&pmtulock);
+    return mtu;
+}
+
+// 收到 Fragmentation Needed 时调用，路径 MTU 只会变小，直到缓存项过期。
+// 差错报文可以伪造，只有上层协议确认了被引用的段（verified）时才接受低于 IP_PMTU_MIN_UNVERIFIED 的值
+void
+ip_pmtu_update (const ip_addr_t *dst, uint16_t mtu, int verified) {
+    struct ip_pmtu *entry;
+    time_t now;
+
+    if (mtu < (verified ? IP_PMTU_MIN : IP_PMTU_MIN_UNVERIFIED)) {
+        mtu = verified ? IP_PMTU_MIN : IP_PMTU_MIN_UNVERIFIED;
+    }
+    time(&now);
+    acquire(&pmtulock);
+    entry = ip_pmtu_entry(dst);
+    if (!entry->mtu || entry->dst != *dst || now >= entry->expire || mtu < entry->mtu) {
+        entry->dst = *dst;
+        entry->mtu = mtu;
+        entry->expire = now + IP_PMTU_TIMEOUT_SEC;
+    }
+    release(&pmtulock);
+}
+
+// 到 dst 的路径 MTU：出口接口的 MTU 和缓存值中较小的那个，没有路由时返回 -1
+int
+ip_pmtu_get (const ip_addr_t *dst) {
+    struct ip_route route;
+    uint16_t mtu;
+
+    if (ip_route_lookup(NULL, dst, &route) == -1) {
+        return -1;
+    }
+    mtu = ip_pmtu_lookup(dst);
+    if (!mtu || mtu > route.netif->dev->mtu) {
+        mtu = route.netif->dev->mtu;
+    }
+    return mtu;
+}
+
 /*
  * IP INTERFACE
  */
 
+static struct netif_ip **
+ip_netif_hash_head (ip_addr_t addr) {
+    uint32_t hash;
+
+    hash = ntoh32(addr);
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return &netif_hash[hash & (IP_NETIF_HASH_SIZE - 1)];
+}
+
+// 调用者持有 netiflock
+static struct netif_ip *
+ip_netif_hash_lookup (ip_addr_t addr) {
+    struct netif_ip *entry;
+
+    for (entry = *ip_netif_hash_head(addr); entry; entry = entry->hnext) {
+        if (entry->unicast == addr) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void
+ip_netif_hash_del (struct netif_ip *iface) {
+    struct netif_ip **entry;
+
+    for (entry = ip_netif_hash_head(iface->unicast); *entry; entry = &(*entry)->hnext) {
+        if (*entry == iface) {
+            *entry = iface->hnext;
+            iface->hnext = NULL;
+            return;
+        }
+    }
+}
+
+static void
+ip_netif_hash_add (struct netif_ip *iface) {
+    struct netif_ip **head;
+
+    head = ip_netif_hash_head(iface->unicast);
+    iface->hnext = *head;
+    *head = iface;
+}
+
+// 路由立即删除，内存由 netif_retire() 延迟释放
+static void
+ip_netif_free (struct netif *netif) {
+    ip_route_del(netif);
+    netif_retire(netif);
+}
+
 struct netif *
 ip_netif_alloc (ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway) {
     struct netif_ip *iface;
-    ip_addr_t gw;
 
     iface = (struct netif_ip *)kalloc();
     if (!iface) {
@@ -186,19 +554,96 @@ ip_netif_alloc (ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway) {
     iface->netmask = netmask;
     iface->network = iface->unicast & iface->netmask;
     iface->broadcast = iface->network | ~iface->netmask;
+    iface->gateway = gateway;
+    iface->hnext = NULL;
     if (ip_route_add(iface->network, iface->netmask, IP_ADDR_ANY, (struct netif *)iface) == -1) {
         kfree((char*)iface);
         return NULL;
     }
     if (gateway) {
         if (ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gateway, (struct netif *)iface) == -1) {
-            kfree((char*)iface);
+            ip_netif_free((struct netif *)iface);
             return NULL;
         }
     }
     return (struct netif *)iface;
 }
 
+// 组播地址映射到 01:00:5e 开头的以太网地址，低 23 位来自组地址（RFC 1112 6.4）
+void
+ip_mcast_ha (const ip_addr_t *group, uint8_t *ha) {
+    ha[0] = 0x01;
+    ha[1] = 0x00;
+    ha[2] = 0x5e;
+    ha[3] = ((const uint8_t *)group)[1] & 0x7f;
+    ha[4] = ((const uint8_t *)group)[2];
+    ha[5] = ((const uint8_t *)group)[3];
+}
+
+// 每个 IPv4 地址都让设备接收全主机组 224.0.0.1，设备上的多个地址共享同一个过滤表项
+static void
+ip_netif_allhosts (struct netif *netif, int join) {
+    ip_addr_t group;
+    uint8_t ha[ETHERNET_ADDR_LEN];
+
+    if (netif->dev->alen != ETHERNET_ADDR_LEN) {
+        return;
+    }
+    group = hton32(0xe0000001);
+    ip_mcast_ha(&group, ha);
+    if (join) {
+        netdev_add_mcast(netif->dev, ha);
+    } else {
+        netdev_del_mcast(netif->dev, ha);
+    }
+}
+
+// 把 ip_netif_alloc() 分配的接口加到设备上，失败时释放该接口；同一地址不能重复配置
+int
+ip_netif_add (struct netdev *dev, struct netif *netif) {
+    struct netif_ip *iface;
+
+    iface = (struct netif_ip *)netif;
+    acquire(&netiflock);
+    if (ip_netif_hash_lookup(iface->unicast) || netdev_add_netif(dev, netif) == -1) {
+        release(&netiflock);
+        ip_netif_free(netif);
+        return -1;
+    }
+    ip_netif_hash_add(iface);
+    release(&netiflock);
+    ip_netif_allhosts(netif, 1);
+    return 0;
+}
+
+// 从设备上删除接口，调用者负责先让上层协议放弃对该接口的引用；
+// 其他 CPU 上可能还有短暂的引用，内存在 netif_retire() 的宽限期之后释放
+int
+ip_netif_delete (struct netif *netif) {
+    struct ip_reass *reass;
+
+    acquire(&netiflock);
+    if (netdev_del_netif(netif->dev, netif) == -1) {
+        release(&netiflock);
+        return -1;
+    }
+    ip_netif_hash_del((struct netif_ip *)netif);
+    release(&netiflock);
+    ip_netif_allhosts(netif, 0);
+    acquire(&reasslock);
+    for (reass = reass_table; reass < array_tailof(reass_table); reass++) {
+        // 正在交付的上下文由交付方释放
+        if (reass->used && !reass->busy && reass->netif == netif) {
+            reass->used = 0;
+            reass->netif = NULL;
+        }
+    }
+    release(&reasslock);
+    arp_netif_detach(netif);
+    ip_netif_free(netif);
+    return 0;
+}
+
 struct netif *
 ip_netif_register (struct netdev *dev, const char *addr, const char *netmask, const char *gateway) {
     struct netif *netif;
@@ -219,8 +664,7 @@ ip_netif_register (struct netdev *dev, const char *addr, const char *netmask, co
     if (!netif) {
         return NULL;
     }
-    if (netdev_add_netif(dev, netif) == -1) {
-        kfree((char*)netif);
+    if (ip_netif_add(dev, netif) == -1) {
         return NULL;
     }
     return netif;
@@ -228,15 +672,24 @@ ip_netif_register (struct netdev *dev, const char *addr, const char *netmask, co
 
 int
 ip_netif_reconfigure (struct netif *netif, ip_addr_t unicast, ip_addr_t netmask, ip_addr_t gateway) {
-    struct netif_ip *iface;
-    ip_addr_t gw;
+    struct netif_ip *iface, *other;
 
     iface = (struct netif_ip *)netif;
-    ip_route_del(netif);
+    acquire(&netiflock);
+    other = ip_netif_hash_lookup(unicast);
+    if (other && other != iface) {
+        release(&netiflock);
+        return -1;
+    }
+    ip_netif_hash_del(iface);
     iface->unicast = unicast;
+    ip_netif_hash_add(iface);
+    release(&netiflock);
+    ip_route_del(netif);
     iface->netmask = netmask;
     iface->network = iface->unicast & iface->netmask;
     iface->broadcast = iface->network | ~iface->netmask;
+    iface->gateway = gateway;
     if (ip_route_add(iface->network, iface->netmask, IP_ADDR_ANY, netif) == -1) {
         return -1;
     }
@@ -250,14 +703,22 @@ ip_netif_reconfigure (struct netif *netif, ip_addr_t unicast, ip_addr_t netmask,
 
 struct netif *
 ip_netif_by_addr (ip_addr_t *addr) {
-    struct netdev *dev;
+    struct netif_ip *iface;
+
+    acquire(&netiflock);
+    iface = ip_netif_hash_lookup(*addr);
+    release(&netiflock);
+    return (struct netif *)iface;
+}
+
+// 设备上以 addr 为子网广播地址的接口
+static struct netif *
+ip_netif_by_broadcast (struct netdev *dev, ip_addr_t addr) {
     struct netif *entry;
 
-    for (dev = netdev_root(); dev; dev = dev->next) {
-        for (entry = dev->ifs; entry; entry = entry->next) {
-            if (entry->family == NETIF_FAMILY_IPV4 && ((struct netif_ip *)entry)->unicast == *addr) {
-                return entry;
-            }
+    for (entry = dev->ifs; entry; entry = entry->next) {
+        if (entry->family == NETIF_FAMILY_IPV4 && ((struct netif_ip *)entry)->broadcast == addr) {
+            return entry;
         }
     }
     return NULL;
@@ -265,27 +726,353 @@ ip_netif_by_addr (ip_addr_t *addr) {
 
 struct netif *
 ip_netif_by_peer (ip_addr_t *peer) {
-    struct ip_route *route;
+    struct ip_route route;
+    struct netdev *dev;
+    struct netif *netif;
 
-    route = ip_route_lookup(NULL, peer);
-    if (!route) {
+    if (ip_route_lookup(NULL, peer, &route) == -1) {
+        // 没有组播路由时从第一个配置了 IPv4 地址的设备发出
+        if (IP_ADDR_IS_MULTICAST(peer)) {
+            for (dev = netdev_root(); dev; dev = dev->next) {
+                if ((netif = netdev_get_netif(dev, NETIF_FAMILY_IPV4)) != NULL) {
+                    return netif;
+                }
+            }
+        }
+        return NULL;
+    }
+    return route.netif;
+}
+
+/*
+ * IP REASSEMBLY
+ * 按照 RFC 815 的空洞描述符算法重组分片，空洞描述符保存在空洞自身的数据区中，不需要额外的内存。
+ * 同时进行重组的数据报数量受 IP_REASS_TABLE_SIZE 限制，表满时淘汰最旧的上下文。
+ */
+
+static void
+ip_reass_free (struct ip_reass *reass) {
+    reass->used = 0;
+    reass->busy = 0;
+    reass->netif = NULL;
+}
+
+static void
+ip_reass_patrol (time_t now) {
+    struct ip_reass *reass;
+
+    for (reass = reass_table; reass < array_tailof(reass_table); reass++) {
+        if (reass->used && !reass->busy && now - reass->timestamp > IP_REASS_TIMEOUT_SEC) {
+            cprintf("ip reassembly timeout, id=%u\n", ntoh16(reass->id));
+            ip_reass_free(reass);
+        }
+    }
+}
+
+static struct ip_reass *
+ip_reass_select (struct ip_hdr *hdr, struct netif *netif, time_t now) {
+    struct ip_reass *reass, *candidate = NULL;
+    struct ip_reass_hole *hole;
+
+    for (reass = reass_table; reass < array_tailof(reass_table); reass++) {
+        if (!reass->used) {
+            if (!candidate || candidate->used) {
+                candidate = reass;
+            }
+            continue;
+        }
+        if (reass->busy) {
+            continue;
+        }
+        if (reass->id == hdr->id && reass->src == hdr->src && reass->dst == hdr->dst && reass->protocol == hdr->protocol) {
+            return reass;
+        }
+        // 没有空闲的上下文时淘汰最旧的一个
+        if (!candidate || (candidate->used && reass->timestamp < candidate->timestamp)) {
+            candidate = reass;
+        }
+    }
+    if (!candidate) {
+        // 所有上下文都在交付中
+        return NULL;
+    }
+    reass = candidate;
+    reass->used = 1;
+    reass->protocol = hdr->protocol;
+    reass->id = hdr->id;
+    reass->src = hdr->src;
+    reass->dst = hdr->dst;
+    reass->netif = netif;
+    reass->timestamp = now;
+    reass->len = 0;
+    reass->holes = 0;
+    hole = (struct ip_reass_hole *)reass->data;
+    hole->first = 0;
+    hole->last = IP_REASS_NONE;
+    hole->next = IP_REASS_NONE;
+    return reass;
+}
+
+// 将一个分片合入重组上下文，数据报重组完成时返回该上下文（调用者负责释放），否则返回 NULL
+static struct ip_reass *
+ip_reass_process (struct ip_hdr *hdr, uint8_t *payload, size_t plen, struct netif *netif) {
+    struct ip_reass *reass;
+    struct ip_reass_hole *hole, *tmp;
+    uint16_t offset, prev, cur, next, hfirst, hlast;
+    uint32_t first, last;
+    int more;
+    time_t now;
+
+    offset = ntoh16(hdr->offset);
+    more = (offset & IP_FLAG_MF) ? 1 : 0;
+    first = (offset & IP_OFFSET_MASK) << 3;
+    last = first + plen - 1;
+    if (!plen || last >= IP_PAYLOAD_SIZE_MAX) {
+        return NULL;
+    }
+    // 除最后一个分片外，分片长度必须是 8 的倍数，这也保证了每个空洞都能容纳一个空洞描述符
+    if (more && (plen & 0x07)) {
+        return NULL;
+    }
+    if (more && last + 1 + sizeof(struct ip_reass_hole) > IP_PAYLOAD_SIZE_MAX) {
+        return NULL;
+    }
+    time(&now);
+    ip_reass_patrol(now);
+    reass = ip_reass_select(hdr, netif, now);
+    if (!reass) {
+        return NULL;
+    }
+    prev = IP_REASS_NONE;
+    cur = reass->holes;
+    while (cur != IP_REASS_NONE) {
+        hole = (struct ip_reass_hole *)(reass->data + cur);
+        hfirst = hole->first;
+        hlast = hole->last;
+        next = hole->next;
+        if (first > hlast || last < hfirst) {
+            prev = cur;
+            cur = next;
+            continue;
+        }
+        // 从链表中删除当前空洞，再按需要在分片两侧生成新的空洞
+        if (prev == IP_REASS_NONE) {
+            reass->holes = next;
+        } else {
+            ((struct ip_reass_hole *)(reass->data + prev))->next = next;
+        }
+        if (first > hfirst) {
+            tmp = (struct ip_reass_hole *)(reass->data + hfirst);
+            tmp->first = hfirst;
+            tmp->last = first - 1;
+            tmp->next = next;
+            if (prev == IP_REASS_NONE) {
+                reass->holes = hfirst;
+            } else {
+                ((struct ip_reass_hole *)(reass->data + prev))->next = hfirst;
+            }
+            prev = hfirst;
+        }
+        if (last < hlast && more) {
+            tmp = (struct ip_reass_hole *)(reass->data + last + 1);
+            tmp->first = last + 1;
+            tmp->last = hlast;
+            tmp->next = next;
+            if (prev == IP_REASS_NONE) {
+                reass->holes = last + 1;
+            } else {
+                ((struct ip_reass_hole *)(reass->data + prev))->next = last + 1;
+            }
+            prev = last + 1;
+        }
+        cur = next;
+    }
+    memcpy(reass->data + first, payload, plen);
+    if (!more) {
+        reass->len = last + 1;
+    }
+    if (reass->holes != IP_REASS_NONE || !reass->len) {
         return NULL;
     }
-    return route->netif;
+    return reass;
+}
+
+static int
+ip_tx_netdev (struct netif *netif, const struct netvec *vec, int cnt, const ip_addr_t *dst) {
+    uint8_t ha[128] = {};
+    ssize_t ret;
+    size_t plen = 0;
+    int n;
+
+    for (n = 0; n < cnt; n++) {
+        plen += vec[n].len;
+    }
+    // 判断网络接口是否需要进行ARP地址解析
+    if (!(netif->dev->flags & NETDEV_FLAG_NOARP)) {
+        if (dst && IP_ADDR_IS_MULTICAST(dst)) {
+            ip_mcast_ha(dst, ha);
+        } else if (dst) {
+            ret = arp_resolve(netif, dst, (void *)ha, NULL, 0);
+            if (ret != 1) {
+                return ret;
+            }
+        } else {
+            memcpy(ha, netif->dev->broadcast, netif->dev->alen);
+        }
+    }
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_IP, vec, cnt, (void *)ha) != (ssize_t)plen) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * IP FORWARDING
+ */
+
+int
+ip_forwarding (int enable) {
+    if (enable >= 0) {
+        forwarding = enable ? 1 : 0;
+    }
+    return forwarding;
+}
+
+// 分片头部在栈上构造，载荷直接引用接收缓冲区
+static int
+ip_forward_fragment (struct netif *netif, struct ip_hdr *hdr, size_t len, const ip_addr_t *nexthop) {
+    uint8_t buf[IP_HDR_SIZE_MAX];
+    struct netvec vec[2];
+    struct ip_hdr *fhdr;
+    uint8_t *payload;
+    uint16_t hlen, offset, more;
+    size_t plen, done, slen, max;
+
+    hlen = (hdr->vhl & 0x0f) << 2;
+    payload = (uint8_t *)hdr + hlen;
+    plen = len - hlen;
+    offset = ntoh16(hdr->offset);
+    more = offset & IP_FLAG_MF;
+    max = (netif->dev->mtu - hlen) & ~0x07;
+    fhdr = (struct ip_hdr *)buf;
+    memcpy(fhdr, hdr, hlen);
+    vec[0].base = buf;
+    vec[0].len = hlen;
+    for (done = 0; done < plen; done += slen) {
+        slen = MIN(plen - done, max);
+        fhdr->len = hton16(hlen + slen);
+        fhdr->offset = hton16(((done + slen < plen || more) ? IP_FLAG_MF : 0) | (((offset & IP_OFFSET_MASK) + (done >> 3)) & IP_OFFSET_MASK));
+        fhdr->sum = 0;
+        fhdr->sum = cksum16((uint16_t *)fhdr, hlen, 0);
+        vec[1].base = payload + done;
+        vec[1].len = slen;
+        if (ip_tx_netdev(netif, vec, 2, nexthop) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 转发不是发给本机的数据报：TTL 减一并增量更新校验和，然后直接从接收缓冲区发往出口接口
+static void
+ip_forward (uint8_t *dgram, size_t len, struct netif *iface) {
+    struct ip_hdr *hdr;
+    struct ip_route route;
+    const ip_addr_t *nexthop;
+    struct netvec vec;
+    uint16_t old;
+
+    hdr = (struct ip_hdr *)dgram;
+    if (hdr->src == IP_ADDR_ANY || hdr->src == IP_ADDR_BROADCAST || hdr->dst == IP_ADDR_ANY) {
+        return;
+    }
+    if (hdr->ttl <= 1) {
+        icmp_error(iface, ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_TTL, 0, dgram, len);
+        return;
+    }
+    if (ip_route_lookup(NULL, &hdr->dst, &route) == -1) {
+        icmp_error(iface, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_NET_UNREACH, 0, dgram, len);
+        return;
+    }
+    if (!(route.netif->dev->flags & NETDEV_FLAG_UP)) {
+        icmp_error(iface, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_HOST_UNREACH, 0, dgram, len);
+        return;
+    }
+    if (len > route.netif->dev->mtu && (ntoh16(hdr->offset) & IP_FLAG_DF)) {
+        icmp_error(iface, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAGMENT_NEEDED, hton32(route.netif->dev->mtu), dgram, len);
+        return;
+    }
+    old = *(uint16_t *)&hdr->ttl;
+    hdr->ttl--;
+    hdr->sum = cksum_adjust(hdr->sum, old, *(uint16_t *)&hdr->ttl);
+    nexthop = route.nexthop ? &route.nexthop : &hdr->dst;
+#ifdef DEBUG
+    cprintf(">>> ip_forward <<<\n");
+    ip_dump(route.netif, dgram, len);
+#endif
+    if (len > route.netif->dev->mtu) {
+        ip_forward_fragment(route.netif, hdr, len, nexthop);
+        return;
+    }
+    vec.base = dgram;
+    vec.len = len;
+    ip_tx_netdev(route.netif, &vec, 1, nexthop);
 }
 
 /*
  * IP CORE
  */
 
+static void
+ip_rx_deliver (uint8_t protocol_type, uint8_t *payload, size_t plen, ip_addr_t *src, ip_addr_t *dst, struct netif *netif) {
+    struct ip_protocol *protocol;
+
+    for (protocol = protocols; protocol; protocol = protocol->next) {
+        if (protocol->type == protocol_type) {
+            protocol->handler(payload, plen, src, dst, netif);
+            break;
+        }
+    }
+}
+
+// 把收到的 ICMP 差错报文交给被引用的数据报所属的上层协议，dgram 指向差错报文中携带的原 IP 头部，
+// 上层协议只能看到原数据报头部之后的前几个字节；src/dst 是原数据报的源（本机）和目的地址
+void
+ip_rx_error (uint8_t type, uint8_t code, uint32_t values, uint8_t *dgram, size_t dlen, struct netif *netif) {
+    struct ip_hdr *hdr;
+    struct ip_protocol *protocol;
+    uint16_t hlen;
+
+    if (dlen < IP_HDR_SIZE_MIN) {
+        return;
+    }
+    hdr = (struct ip_hdr *)dgram;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if ((hdr->vhl >> 4) != IP_VERSION_IPV4 || hlen < IP_HDR_SIZE_MIN || dlen < hlen) {
+        return;
+    }
+    if (ntoh16(hdr->offset) & IP_OFFSET_MASK) {
+        /* no transport header in non-first fragments */
+        return;
+    }
+    for (protocol = protocols; protocol; protocol = protocol->next) {
+        if (protocol->type == hdr->protocol) {
+            if (protocol->errhandler) {
+                protocol->errhandler(type, code, values, dgram + hlen, dlen - hlen, &hdr->src, &hdr->dst, netif);
+            }
+            break;
+        }
+    }
+}
+
 static void
 ip_rx (uint8_t *dgram, size_t dlen, struct netdev *dev) {
     struct ip_hdr *hdr;
     uint16_t hlen, offset;
-    struct netif_ip *iface;
+    struct netif_ip *iface, *local;
     uint8_t *payload;
     size_t plen;
-    struct ip_protocol *protocol;
+    struct ip_reass *reass;
 
     if (dlen < sizeof(struct ip_hdr)) {
         return;
@@ -313,14 +1100,27 @@ ip_rx (uint8_t *dgram, size_t dlen, struct netdev *dev) {
         cprintf("ip unknown interface.\n");
         return;
     }
-    // 首先检查数据包的目标地址是否不等于接口的单播地址
-    if (hdr->dst != iface->unicast) {
-        // 如果数据包的目标地址不等于接口的广播地址，并且数据包的目标地址不等于 IP 地址的广播地址，丢弃该数据包
-        if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
+    // 目的地址是本机的某个地址（可能属于其他设备）时交给对应的接口，上层协议据此确定本端地址
+    local = (struct netif_ip *)ip_netif_by_addr(&hdr->dst);
+    if (!local && IP_ADDR_IS_MULTICAST(&hdr->dst)) {
+        // 组播只接收本设备加入了的组，不转发
+        local = (struct netif_ip *)igmp_group_netif(dev, hdr->dst);
+        if (!local) {
+            return;
+        }
+    } else if (!local && hdr->dst != IP_ADDR_BROADCAST) {
+        local = (struct netif_ip *)ip_netif_by_broadcast(dev, hdr->dst);
+        if (!local) {
             /* for other host */
+            if (forwarding) {
+                ip_forward(dgram, ntoh16(hdr->len), (struct netif *)iface);
+            }
             return;
         }
     }
+    if (local) {
+        iface = local;
+    }
 #ifdef DEBUG
     cprintf(">>> ip_rx <<<\n");
     ip_dump((struct netif *)iface, dgram, dlen);
@@ -328,114 +1128,161 @@ ip_rx (uint8_t *dgram, size_t dlen, struct netdev *dev) {
     payload = (uint8_t *)hdr + hlen;
     plen = ntoh16(hdr->len) - hlen;
     offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
+    if (offset & IP_FLAG_MF || offset & IP_OFFSET_MASK) {
         /* fragments */
-        cprintf("don't support IP fragments\n");
-        return;
-    }
-    for (protocol = protocols; protocol; protocol = protocol->next) {
-        if (protocol->type == hdr->protocol) {
-            protocol->handler(payload, plen, &hdr->src, &hdr->dst, (struct netif *)iface);
-            break;
+        acquire(&reasslock);
+        reass = ip_reass_process(hdr, payload, plen, (struct netif *)iface);
+        if (!reass) {
+            release(&reasslock);
+            return;
         }
+        // 标记为交付中后释放锁，上层协议处理期间该缓冲区不会被其他分片复用或被超时回收
+        reass->busy = 1;
+        release(&reasslock);
+        ip_rx_deliver(reass->protocol, reass->data, reass->len, &reass->src, &reass->dst, reass->netif);
+        acquire(&reasslock);
+        ip_reass_free(reass);
+        release(&reasslock);
+        return;
     }
+    ip_rx_deliver(hdr->protocol, payload, plen, &hdr->src, &hdr->dst, (struct netif *)iface);
 }
 
+// 从 vec 描述的数据中截取 [offset, offset + len) 这一段，结果写入 out，返回片段数
 static int
-ip_tx_netdev (struct netif *netif, uint8_t *packet, size_t plen, const ip_addr_t *dst) {
-    uint8_t ha[128] = {};
-    ssize_t ret;
-    // 判断网络接口是否需要进行ARP地址解析
-    if (!(netif->dev->flags & NETDEV_FLAG_NOARP)) {
-        if (dst) {
-            ret = arp_resolve(netif, dst, (void *)ha, packet, plen);
-            if (ret != 1) {
-                return ret;
-            }
-        } else {
-            memcpy(ha, netif->dev->broadcast, netif->dev->alen);
+ip_vec_slice (const struct netvec *vec, int cnt, size_t offset, size_t len, struct netvec *out, int max) {
+    int n, num = 0;
+    size_t slen;
+
+    for (n = 0; n < cnt && len; n++) {
+        if (offset >= vec[n].len) {
+            offset -= vec[n].len;
+            continue;
         }
+        if (num == max) {
+            return -1;
+        }
+        slen = MIN(vec[n].len - offset, len);
+        out[num].base = vec[n].base + offset;
+        out[num].len = slen;
+        num++;
+        len -= slen;
+        offset = 0;
     }
-    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_IP, packet, plen, (void *)ha) != (ssize_t)plen) {
-        return -1;
-    }
-    return 1;
+    return num;
 }
 
 static int
-ip_tx_core (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id, uint16_t offset) {
-    uint8_t packet[4096];
-    struct ip_hdr *hdr;
+ip_tx_core (struct netif *netif, uint8_t protocol, const struct netvec *vec, int cnt, size_t offset, size_t len, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id, uint16_t flags) {
+    struct ip_hdr hdr;
+    struct netvec frag[NETVEC_MAX - 2];
     uint16_t hlen;
+    int num;
 
-    hdr = (struct ip_hdr *)packet;
+    // IP 头部单独作为 gather 列表的第一个片段，载荷片段直接引用调用方的缓冲区
+    num = ip_vec_slice(vec, cnt, offset, len, frag + 1, NETVEC_MAX - 3);
+    if (num == -1) {
+        return -1;
+    }
     hlen = sizeof(struct ip_hdr);
-    hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
-    hdr->tos = 0;
-    hdr->len = hton16(hlen + len);
-    hdr->id = hton16(id);
-    hdr->offset = hton16(offset);
-    hdr->ttl = 0xff;
-    hdr->protocol = protocol;
-    hdr->sum = 0;
-    hdr->src = src ? *src : ((struct netif_ip *)netif)->unicast;
-    hdr->dst = *dst;
-    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
-    memcpy(hdr + 1, buf, len);
+    hdr.vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
+    hdr.tos = 0;
+    hdr.len = hton16(hlen + len);
+    hdr.id = hton16(id);
+    hdr.offset = hton16(flags | ((offset >> 3) & IP_OFFSET_MASK));
+    // 组播默认只发到本地网络（IP_MULTICAST_TTL 的默认值）
+    hdr.ttl = IP_ADDR_IS_MULTICAST(dst) ? 1 : 0xff;
+    hdr.protocol = protocol;
+    hdr.sum = 0;
+    hdr.src = src ? *src : ((struct netif_ip *)netif)->unicast;
+    hdr.dst = *dst;
+    hdr.sum = cksum16((uint16_t *)&hdr, hlen, 0);
+    frag[0].base = (uint8_t *)&hdr;
+    frag[0].len = hlen;
 #ifdef DEBUG
     cprintf(">>> ip_tx_core <<<\n");
-    ip_dump(netif, (uint8_t *)packet, hlen + len);
+    ip_dump(netif, (uint8_t *)&hdr, hlen);
 #endif
-    return ip_tx_netdev(netif, (uint8_t *)packet, hlen + len, nexthop);
+    return ip_tx_netdev(netif, frag, num + 1, nexthop);
 }
 
+// 按目的地址和协议散列到一组计数器上，用原子加代替全局锁；计数器初值和散列的密钥都是随机的，
+// 所以不同目的地之间的 ID 没有关联，也不容易被预测
 static uint16_t
-ip_generate_id (void) {
-    static uint16_t id = 128;
-    uint16_t ret;
+ip_generate_id (const ip_addr_t *dst, uint8_t protocol) {
+    uint32_t hash;
 
-    acquire(&iplock);
-    ret = id++;
-    release(&iplock);
-    return ret;
+    hash = (*dst ^ id_secret ^ protocol) * 0x9e3779b1;
+    return (uint16_t)xadd(&id_table[hash >> (32 - IP_ID_TABLE_BITS)], 1);
 }
 
+// vec 中的数据必须位于内核直接映射的内存中（网卡直接对其 DMA），用户空间的数据需要先拷贝
 ssize_t
-ip_tx (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *dst) {
-    struct ip_route *route;
+ip_txv (struct netif *netif, uint8_t protocol, const struct netvec *vec, int cnt, const ip_addr_t *dst, uint16_t flags) {
+    struct ip_route route;
     ip_addr_t *nexthop = NULL, *src = NULL;
-    uint16_t id, flag, offset;
-    size_t done, slen;
+    uint16_t id, flag, mtu, pmtu;
+    size_t len = 0, done, slen, max;
+    int n;
 
+    for (n = 0; n < cnt; n++) {
+        len += vec[n].len;
+    }
     if (netif && *dst == IP_ADDR_BROADCAST) {
         nexthop = NULL;
+    } else if (netif && IP_ADDR_IS_MULTICAST(dst)) {
+        // 组播从调用方指定的接口直接发出，不查路由
+        nexthop = (ip_addr_t *)dst;
     } else {
-        route = ip_route_lookup(NULL, dst);
-        if (!route) {
+        if (ip_route_lookup(NULL, dst, &route) == -1) {
             cprintf("ip no route to host.\n");
             return -1;
         }
         if (netif) {
             src = &((struct netif_ip *)netif)->unicast;
         }
-        netif = route->netif;
+        netif = route.netif;
         // 如果下一跳地址为空，目的地址就是要请求的ip地址
-        nexthop = (ip_addr_t *)(route->nexthop ? &route->nexthop : dst);
+        nexthop = (ip_addr_t *)(route.nexthop ? &route.nexthop : dst);
     }
-    id = ip_generate_id();
+    mtu = netif->dev->mtu;
+    if (nexthop) {
+        // 单播按路径 MTU 分片，DF 的数据报超过路径 MTU 时由上层负责缩小
+        pmtu = ip_pmtu_lookup(dst);
+        if (pmtu && pmtu < mtu) {
+            mtu = pmtu;
+        }
+    }
+    max = (mtu - IP_HDR_SIZE_MIN) & ~0x07;
+    if (flags & IP_FLAG_DF) {
+        // DF 的数据报不会被分片，ID 没有意义（RFC 6864），不必分配
+        if (IP_HDR_SIZE_MIN + len > mtu) {
+            return -1;
+        }
+        return ip_tx_core(netif, protocol, vec, cnt, 0, len, src, dst, nexthop, 0, IP_FLAG_DF) == -1 ? -1 : (ssize_t)len;
+    }
+    id = ip_generate_id(dst, protocol);
     for (done = 0; done < len; done += slen) {
-        slen = MIN((len - done), (size_t)(netif->dev->mtu - IP_HDR_SIZE_MIN));
-        flag = ((done + slen) < len) ? 0x2000 : 0x0000;
-        offset = flag | ((done >> 3) & 0x1fff);
-        if (ip_tx_core(netif, protocol, buf + done, slen, src, dst, nexthop, id, offset) == -1) {
+        slen = MIN((len - done), max);
+        flag = ((done + slen) < len) ? IP_FLAG_MF : 0x0000;
+        if (ip_tx_core(netif, protocol, vec, cnt, done, slen, src, dst, nexthop, id, flag) == -1) {
             return -1;
         }
     }
     return len;
 }
 
+ssize_t
+ip_tx (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *dst) {
+    struct netvec vec;
+
+    vec.base = buf;
+    vec.len = len;
+    return ip_txv(netif, protocol, &vec, 1, dst, 0);
+}
+
 int
-ip_add_protocol (uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif)) {
+ip_add_protocol (uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif), void (*errhandler)(uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *netif)) {
     struct ip_protocol *p;
 
     p = (struct ip_protocol *)kalloc();
@@ -445,13 +1292,25 @@ ip_add_protocol (uint8_t type, void (*handler)(uint8_t *payload, size_t len, ip_
     p->next = protocols;
     p->type = type;
     p->handler = handler;
+    p->errhandler = errhandler;
     protocols = p;
     return 0;
 }
 
 int
 ip_init (void) {
-    initlock(&iplock, "ip");
+    uint32_t *id;
+
+    initlock(&reasslock, "ipreass");
+    id_secret = urandom();
+    for (id = id_table; id < array_tailof(id_table); id++) {
+        *id = urandom();
+    }
+    initlock(&routelock, "iproute");
+    initlock(&pmtulock, "ippmtu");
+    initlock(&netiflock, "ipnetif");
+    slab_init(&route_slab, sizeof(struct ip_route));
+    slab_init(&route_node_slab, sizeof(struct ip_route_node));
     netproto_register(NETPROTO_TYPE_IP, ip_rx);
     return 0;
 }
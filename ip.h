@@ -2,14 +2,45 @@
 #define IP_HDR_SIZE_MAX 60
 #define IP_PAYLOAD_SIZE_MAX (65535 - IP_HDR_SIZE_MIN)
 
+#define IP_VERSION_IPV4 4
+
+#define IP_FLAG_DF 0x4000 /* don't fragment */
+#define IP_FLAG_MF 0x2000 /* more fragments */
+#define IP_OFFSET_MASK 0x1fff
+
 #define IP_ADDR_LEN 4
 #define IP_ADDR_STR_LEN 16 /* "ddd.ddd.ddd.ddd\0" */
 
+extern const ip_addr_t IP_ADDR_ANY;
+extern const ip_addr_t IP_ADDR_BROADCAST;
+
+// 224.0.0.0/4，a 是指向网络字节序地址的指针
+#define IP_ADDR_IS_MULTICAST(a) ((*(const uint8_t *)(a) & 0xf0) == 0xe0)
+
 #define IP_PROTOCOL_ICMP 0x01
+#define IP_PROTOCOL_IGMP 0x02
 #define IP_PROTOCOL_TCP  0x06
 #define IP_PROTOCOL_UDP  0x11
 #define IP_PROTOCOL_RAW  0xff
 
+struct ip_hdr {
+    uint8_t vhl; // 用于存储IP版本号和头部长度
+    uint8_t tos; // 服务类型字段，指定服务质量要求：普通、优先、立即、闪电式、比闪电还闪电式
+    uint16_t len; // 表示IP数据报的总长度
+    uint16_t id; // 标识字段，用于唯一标识一个IP数据报
+    // 分段偏移量，用于分片和重组分段。前3bit控制IP分片和重组。
+    // 第二位DF（Don't Fragment）位，指示数据包是否可以被分片。
+    // 第三位是MF（More Fragments）位，指示数据包是否是分片的最后一片
+    // 偏移量字段占据了标志字段的后13位，用于指示当前分片在原始数据包中的位置。偏移量以 8 字节为单位计算，因此乘以8可以得到实际的字节偏移量。
+    uint16_t offset;
+    uint8_t ttl; // 存活时间，指定数据包在网络中可以经过的最大路由器跳数
+    uint8_t protocol; // 协议字段，指定IP数据报中封装的协议类型
+    uint16_t sum; // 校验和字段，用于验证IP数据报的完整性
+    ip_addr_t src; //  源IP地址
+    ip_addr_t dst; //  目的IP地址
+    uint8_t options[0];
+};
+
 struct netif_ip {
     struct netif netif; // 网络接口
     ip_addr_t unicast; // 单播地址，即IP地址
@@ -17,4 +48,13 @@ struct netif_ip {
     ip_addr_t network; // 网络接口所在网络的网络地址，与掩码运算后的地址
     ip_addr_t broadcast; // 广播地址，一个网络的广播地址通常是这个网络的子网的最大地址，即将网络地址中所有主机位设置为 1 的地址
     ip_addr_t gateway; // 默认网关地址
+    struct netif_ip *hnext; // 本机地址哈希表中的下一个接口
+};
+
+struct ip_route {
+    struct ip_route *next;
+    ip_addr_t network;
+    ip_addr_t netmask;
+    ip_addr_t nexthop; // 直连网络的路由为 IP_ADDR_ANY
+    struct netif *netif;
 };
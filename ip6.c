@@ -0,0 +1,829 @@
+#include "types.h"
+#include "defs.h"
+#include "spinlock.h"
+#include "common.h"
+#include "net.h"
+#include "ethernet.h"
+#include "arp.h"
+#include "ip6.h"
+
+#define DEBUG
+
+#define IP6_NETIF_HASH_SIZE 16 /* must be a power of 2 */
+#define IP6_ROUTE_CACHE_SIZE 64 /* must be a power of 2 */
+#define IP6_EXT_HDR_MAX 8
+#define IP6_PMTU_TABLE_SIZE 64 /* must be a power of 2 */
+#define IP6_PMTU_TIMEOUT_SEC 600
+
+struct ip6_protocol {
+    struct ip6_protocol *next;
+    uint8_t type;
+    void (*handler)(uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *netif);
+    void (*errhandler)(uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *netif);
+};
+
+const ip6_addr_t IP6_ADDR_ANY = {{0}};
+const ip6_addr_t IP6_ADDR_ALLNODES = {{0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01}};
+
+// 按目的地址直接映射的路由缓存，和 IPv4 的一样在接口或默认路由器变化时通过 generation 使所有缓存项失效。
+// 保存前缀最匹配的接口和第一个有默认路由器的接口，和 hint 有关的选择在查到之后再做
+struct ip6_route_cache {
+    ip6_addr_t dst;
+    uint32_t generation;
+    struct netif *prefix;
+    struct netif *router;
+};
+
+// 路径 MTU 缓存，和 IPv4 的一样按目的地址直接映射，过期后重新使用链路 MTU
+struct ip6_pmtu {
+    ip6_addr_t dst;
+    uint16_t mtu;
+    time_t expire;
+};
+
+static struct spinlock netiflock;
+static struct netif_ip6 *netif_hash[IP6_NETIF_HASH_SIZE];
+static struct spinlock routelock;
+static struct ip6_route_cache route_cache[IP6_ROUTE_CACHE_SIZE];
+static uint32_t route_generation = 1;
+static struct spinlock pmtulock;
+static struct ip6_pmtu pmtu_table[IP6_PMTU_TABLE_SIZE];
+static struct ip6_protocol *protocols;
+
+int
+ip6_addr_pton (const char *p, ip6_addr_t *n) {
+    uint16_t head[8], tail[8];
+    int nhead = 0, ntail = 0, gap = 0, idx;
+    char *sp, *ep;
+    long ret;
+
+    sp = (char *)p;
+    if (sp[0] == ':') {
+        if (sp[1] != ':') {
+            return -1;
+        }
+        gap = 1;
+        sp += 2;
+    }
+    while (*sp) {
+        ret = strtol(sp, &ep, 16);
+        if (ep == sp || ep - sp > 4 || ret < 0 || ret > 0xffff) {
+            return -1;
+        }
+        if (nhead + ntail == 8) {
+            return -1;
+        }
+        if (gap) {
+            tail[ntail++] = ret;
+        } else {
+            head[nhead++] = ret;
+        }
+        if (*ep == '\0') {
+            break;
+        }
+        if (*ep != ':') {
+            return -1;
+        }
+        if (ep[1] == ':') {
+            // "::" 只能出现一次
+            if (gap) {
+                return -1;
+            }
+            gap = 1;
+            ep++;
+        } else if (ep[1] == '\0') {
+            return -1;
+        }
+        sp = ep + 1;
+    }
+    if (gap ? nhead + ntail > 7 : nhead != 8) {
+        return -1;
+    }
+    memset(n, 0, sizeof(*n));
+    for (idx = 0; idx < nhead; idx++) {
+        n->addr16[idx] = hton16(head[idx]);
+    }
+    for (idx = 0; idx < ntail; idx++) {
+        n->addr16[8 - ntail + idx] = hton16(tail[idx]);
+    }
+    return 0;
+}
+
+// RFC 5952 的格式：小写、省略前导零、最长的连续全零组（至少两组）压缩成 "::"
+char *
+ip6_addr_ntop (const ip6_addr_t *n, char *p, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    int idx, run = 0, best = -1, bestlen = 1, shift;
+    uint16_t group;
+    char *s;
+
+    if (size < IP6_ADDR_STR_LEN) {
+        if (size) {
+            *p = '\0';
+        }
+        return p;
+    }
+    for (idx = 0; idx < 8; idx++) {
+        run = n->addr16[idx] ? 0 : run + 1;
+        if (run > bestlen) {
+            bestlen = run;
+            best = idx - run + 1;
+        }
+    }
+    s = p;
+    for (idx = 0; idx < 8; idx++) {
+        if (idx == best) {
+            *s++ = ':';
+            idx += bestlen - 1;
+            if (idx == 7) {
+                *s++ = ':';
+            }
+            continue;
+        }
+        if (idx) {
+            *s++ = ':';
+        }
+        group = ntoh16(n->addr16[idx]);
+        for (shift = 12; shift > 0 && !(group >> shift); shift -= 4);
+        for (; shift >= 0; shift -= 4) {
+            *s++ = digits[(group >> shift) & 0xf];
+        }
+    }
+    *s = '\0';
+    return p;
+}
+
+void
+ip6_dump (struct netif *netif, uint8_t *packet, size_t plen) {
+    struct ip6_hdr *hdr;
+    char addr[IP6_ADDR_STR_LEN];
+    uint32_t vtcfl;
+
+    hdr = (struct ip6_hdr *)packet;
+    cprintf("  dev: %s (%s)\n", netif->dev->name, ip6_addr_ntop(&((struct netif_ip6 *)netif)->unicast, addr, sizeof(addr)));
+    vtcfl = ntoh32(hdr->vtcfl);
+    cprintf("    v: %u, tc: 0x%02x, flow: 0x%05x\n", vtcfl >> 28, (vtcfl >> 20) & 0xff, vtcfl & 0xfffff);
+    cprintf(" plen: %u\n", ntoh16(hdr->plen));
+    cprintf("  nxt: %u\n", hdr->nxt);
+    cprintf(" hlim: %u\n", hdr->hlim);
+    cprintf("  src: %s\n", ip6_addr_ntop(&hdr->src, addr, sizeof(addr)));
+    cprintf("  dst: %s\n", ip6_addr_ntop(&hdr->dst, addr, sizeof(addr)));
+    hexdump(packet, plen);
+}
+
+static int
+ip6_prefix_match (const ip6_addr_t *a, const ip6_addr_t *b, int prefixlen) {
+    int bytes, bits;
+
+    bytes = prefixlen >> 3;
+    bits = prefixlen & 7;
+    if (memcmp(a, b, bytes) != 0) {
+        return 0;
+    }
+    if (bits && ((a->addr8[bytes] ^ b->addr8[bytes]) & (0xff << (8 - bits)))) {
+        return 0;
+    }
+    return 1;
+}
+
+// 请求节点组播地址 ff02::1:ff00:0/104 加上单播地址的低 24 位
+void
+ip6_solicited_node (const ip6_addr_t *unicast, ip6_addr_t *maddr) {
+    maddr->addr32[0] = hton32(0xff020000);
+    maddr->addr32[1] = 0;
+    maddr->addr32[2] = hton32(0x00000001);
+    maddr->addr32[3] = unicast->addr32[3];
+    maddr->addr8[12] = 0xff;
+}
+
+/*
+ * IP6 INTERFACE
+ * 本机地址保存在按地址哈希的表中，接收路径上判断目的地址只需要一次哈希查找
+ */
+
+static struct netif_ip6 **
+ip6_netif_hash_head (const ip6_addr_t *addr) {
+    uint32_t hash;
+
+    hash = addr->addr32[2] ^ addr->addr32[3];
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return &netif_hash[hash & (IP6_NETIF_HASH_SIZE - 1)];
+}
+
+// 调用者持有 netiflock
+static struct netif_ip6 *
+ip6_netif_hash_lookup (const ip6_addr_t *addr) {
+    struct netif_ip6 *entry;
+
+    for (entry = *ip6_netif_hash_head(addr); entry; entry = entry->hnext) {
+        if (IP6_ADDR_EQUAL(&entry->unicast, addr)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// 组播地址直接映射到 33:33 开头的以太网地址（RFC 2464 7）
+void
+ip6_mcast_ha (const ip6_addr_t *maddr, uint8_t *ha) {
+    ha[0] = 0x33;
+    ha[1] = 0x33;
+    memcpy(ha + 2, &maddr->addr8[12], 4);
+}
+
+// 让设备接收该地址的请求节点组播地址，链路本地地址还要接收全节点组播地址
+static void
+ip6_netif_mcast (struct netif_ip6 *iface, int join) {
+    ip6_addr_t maddr;
+    uint8_t ha[ETHERNET_ADDR_LEN];
+    struct netdev *dev;
+
+    dev = ((struct netif *)iface)->dev;
+    if (dev->alen != ETHERNET_ADDR_LEN) {
+        return;
+    }
+    ip6_solicited_node(&iface->unicast, &maddr);
+    ip6_mcast_ha(&maddr, ha);
+    if (join) {
+        netdev_add_mcast(dev, ha);
+    } else {
+        netdev_del_mcast(dev, ha);
+    }
+    if (IP6_ADDR_IS_LINKLOCAL(&iface->unicast)) {
+        ip6_mcast_ha(&IP6_ADDR_ALLNODES, ha);
+        if (join) {
+            netdev_add_mcast(dev, ha);
+        } else {
+            netdev_del_mcast(dev, ha);
+        }
+    }
+}
+
+struct netif *
+ip6_netif_alloc (const ip6_addr_t *unicast, int prefixlen, const ip6_addr_t *gateway) {
+    struct netif_ip6 *iface;
+    int n;
+
+    if (prefixlen < 0 || prefixlen > 128 || IP6_ADDR_IS_UNSPECIFIED(unicast) || IP6_ADDR_IS_MULTICAST(unicast)) {
+        return NULL;
+    }
+    iface = (struct netif_ip6 *)kalloc();
+    if (!iface) {
+        return NULL;
+    }
+    memset(iface, 0, sizeof(*iface));
+    ((struct netif *)iface)->family = NETIF_FAMILY_IPV6;
+    iface->unicast = *unicast;
+    iface->prefixlen = prefixlen;
+    for (n = 0; n < IP6_ADDR_LEN; n++) {
+        if (prefixlen >= 8) {
+            iface->prefix.addr8[n] = unicast->addr8[n];
+            prefixlen -= 8;
+        } else {
+            iface->prefix.addr8[n] = unicast->addr8[n] & (0xff << (8 - prefixlen));
+            prefixlen = 0;
+        }
+    }
+    if (gateway) {
+        iface->gateway = *gateway;
+    }
+    return (struct netif *)iface;
+}
+
+// 设备上的链路本地地址接口，发往链路本地和组播地址时使用
+struct netif *
+ip6_netif_linklocal (struct netdev *dev) {
+    struct netif *entry;
+
+    for (entry = dev->ifs; entry; entry = entry->next) {
+        if (entry->family == NETIF_FAMILY_IPV6 && IP6_ADDR_IS_LINKLOCAL(&((struct netif_ip6 *)entry)->unicast)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int
+ip6_netif_attach (struct netdev *dev, struct netif_ip6 *iface) {
+    acquire(&netiflock);
+    if (ip6_netif_hash_lookup(&iface->unicast) || netdev_add_netif(dev, (struct netif *)iface) == -1) {
+        release(&netiflock);
+        return -1;
+    }
+    iface->hnext = *ip6_netif_hash_head(&iface->unicast);
+    *ip6_netif_hash_head(&iface->unicast) = iface;
+    release(&netiflock);
+    ip6_route_invalidate();
+    ip6_netif_mcast(iface, 1);
+    return 0;
+}
+
+// 从 MAC 地址生成 EUI-64 接口标识符（RFC 4291 附录 A）
+static void
+ip6_eui64 (struct netdev *dev, ip6_addr_t *addr) {
+    addr->addr8[8] = dev->addr[0] ^ 0x02;
+    addr->addr8[9] = dev->addr[1];
+    addr->addr8[10] = dev->addr[2];
+    addr->addr8[11] = 0xff;
+    addr->addr8[12] = 0xfe;
+    addr->addr8[13] = dev->addr[3];
+    addr->addr8[14] = dev->addr[4];
+    addr->addr8[15] = dev->addr[5];
+}
+
+// 把 ip6_netif_alloc() 分配的接口加到设备上，失败时释放该接口；
+// 设备上第一次配置 IPv6 地址时自动加上 fe80::/64 的链路本地地址，邻居发现需要它
+int
+ip6_netif_add (struct netdev *dev, struct netif *netif) {
+    struct netif *ll;
+    ip6_addr_t addr;
+
+    if (!ip6_netif_linklocal(dev) && !IP6_ADDR_IS_LINKLOCAL(&((struct netif_ip6 *)netif)->unicast) && dev->alen == ETHERNET_ADDR_LEN) {
+        memset(&addr, 0, sizeof(addr));
+        addr.addr8[0] = 0xfe;
+        addr.addr8[1] = 0x80;
+        ip6_eui64(dev, &addr);
+        ll = ip6_netif_alloc(&addr, 64, NULL);
+        if (ll && ip6_netif_attach(dev, (struct netif_ip6 *)ll) == -1) {
+            kfree((char *)ll);
+        }
+    }
+    if (ip6_netif_attach(dev, (struct netif_ip6 *)netif) == -1) {
+        kfree((char *)netif);
+        return -1;
+    }
+    return 0;
+}
+
+// 从设备上删除接口，调用者负责先让上层协议放弃对该接口的引用；内存在 netif_retire() 的宽限期之后释放
+int
+ip6_netif_delete (struct netif *netif) {
+    struct netif_ip6 **entry;
+
+    acquire(&netiflock);
+    if (netdev_del_netif(netif->dev, netif) == -1) {
+        release(&netiflock);
+        return -1;
+    }
+    for (entry = ip6_netif_hash_head(&((struct netif_ip6 *)netif)->unicast); *entry; entry = &(*entry)->hnext) {
+        if (*entry == (struct netif_ip6 *)netif) {
+            *entry = (*entry)->hnext;
+            break;
+        }
+    }
+    release(&netiflock);
+    ip6_route_invalidate();
+    ip6_netif_mcast((struct netif_ip6 *)netif, 0);
+    nd6_netif_detach(netif);
+    netif_retire(netif);
+    return 0;
+}
+
+struct netif *
+ip6_netif_by_addr (const ip6_addr_t *addr) {
+    struct netif_ip6 *iface;
+
+    acquire(&netiflock);
+    iface = ip6_netif_hash_lookup(addr);
+    release(&netiflock);
+    return (struct netif *)iface;
+}
+
+/*
+ * IP6 ROUTING
+ * 没有单独的路由表：目的地址落在某个接口的前缀内就直接发送（最长前缀优先），否则交给默认路由器。
+ * 链路本地和组播地址没有前缀可以选择设备，使用 hint 所在的设备，或者第一个配置了 IPv6 的设备。
+ * 遍历所有接口的结果按目的地址缓存，发送时通常只查一次缓存。
+ */
+
+// 接口的增删和默认路由器的变化都要调用
+void
+ip6_route_invalidate (void) {
+    acquire(&routelock);
+    route_generation++;
+    if (!route_generation) {
+        memset(route_cache, 0, sizeof(route_cache));
+        route_generation = 1;
+    }
+    release(&routelock);
+}
+
+// 调用者持有 routelock
+static uint32_t
+ip6_addr_hash (const ip6_addr_t *addr) {
+    uint32_t hash;
+
+    hash = addr->addr32[0] ^ addr->addr32[1] ^ addr->addr32[2] ^ addr->addr32[3];
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return hash;
+}
+
+static void
+ip6_route_scan (const ip6_addr_t *dst, struct ip6_route_cache *cache) {
+    struct netdev *dev;
+    struct netif *entry;
+    struct netif_ip6 *iface;
+    int plen = -1;
+
+    cache->prefix = NULL;
+    cache->router = NULL;
+    for (dev = netdev_root(); dev; dev = dev->next) {
+        for (entry = dev->ifs; entry; entry = entry->next) {
+            if (entry->family != NETIF_FAMILY_IPV6) {
+                continue;
+            }
+            iface = (struct netif_ip6 *)entry;
+            if (iface->prefixlen > plen && ip6_prefix_match(&iface->prefix, dst, iface->prefixlen)) {
+                cache->prefix = entry;
+                plen = iface->prefixlen;
+            }
+            if (!IP6_ADDR_IS_UNSPECIFIED(&iface->gateway) && !cache->router) {
+                cache->router = entry;
+            }
+        }
+    }
+}
+
+static struct netif *
+ip6_route_lookup (struct netif *hint, const ip6_addr_t *dst, ip6_addr_t *nexthop) {
+    struct netdev *dev;
+    struct netif *candidate = NULL, *router;
+    struct ip6_route_cache *cache;
+    uint32_t hash;
+
+    if (IP6_ADDR_IS_LINKLOCAL(dst) || IP6_ADDR_IS_MULTICAST(dst)) {
+        if (hint) {
+            candidate = hint;
+        } else {
+            for (dev = netdev_root(); dev && !candidate; dev = dev->next) {
+                candidate = ip6_netif_linklocal(dev);
+            }
+        }
+        *nexthop = *dst;
+        return candidate;
+    }
+    hash = ip6_addr_hash(dst);
+    acquire(&routelock);
+    cache = &route_cache[hash & (IP6_ROUTE_CACHE_SIZE - 1)];
+    if (cache->generation != route_generation || !IP6_ADDR_EQUAL(&cache->dst, dst)) {
+        ip6_route_scan(dst, cache);
+        cache->dst = *dst;
+        cache->generation = route_generation;
+    }
+    candidate = cache->prefix;
+    router = cache->router;
+    release(&routelock);
+    // hint 有默认路由器时优先使用它
+    if (hint && !IP6_ADDR_IS_UNSPECIFIED(&((struct netif_ip6 *)hint)->gateway)) {
+        router = hint;
+    }
+    if (candidate) {
+        *nexthop = *dst;
+        return candidate;
+    }
+    if (router) {
+        *nexthop = ((struct netif_ip6 *)router)->gateway;
+        return router;
+    }
+    return NULL;
+}
+
+struct netif *
+ip6_netif_by_peer (const ip6_addr_t *peer) {
+    ip6_addr_t nexthop;
+    struct netif *netif;
+
+    netif = ip6_route_lookup(NULL, peer, &nexthop);
+    // 从链路本地接口学到的默认路由器出去时，使用同一设备上的全局地址作为源地址
+    if (netif && !IP6_ADDR_IS_LINKLOCAL(peer) && IP6_ADDR_IS_LINKLOCAL(&((struct netif_ip6 *)netif)->unicast)) {
+        struct netif *entry;
+
+        for (entry = netif->dev->ifs; entry; entry = entry->next) {
+            if (entry->family == NETIF_FAMILY_IPV6 && !IP6_ADDR_IS_LINKLOCAL(&((struct netif_ip6 *)entry)->unicast)) {
+                return entry;
+            }
+        }
+    }
+    return netif;
+}
+
+/*
+ * IP6 PATH MTU DISCOVERY (RFC 8201)
+ */
+
+// 收到 Packet Too Big 时调用，路径 MTU 只会变小，直到缓存项过期；不会低于 IPv6 的最小链路 MTU
+void
+ip6_pmtu_update (const ip6_addr_t *dst, uint32_t mtu) {
+    struct ip6_pmtu *entry;
+    time_t now;
+
+    if (mtu < IP6_MTU_MIN) {
+        mtu = IP6_MTU_MIN;
+    }
+    if (mtu > 0xffff) {
+        return;
+    }
+    time(&now);
+    acquire(&pmtulock);
+    entry = &pmtu_table[ip6_addr_hash(dst) & (IP6_PMTU_TABLE_SIZE - 1)];
+    if (!entry->mtu || !IP6_ADDR_EQUAL(&entry->dst, dst) || now >= entry->expire || mtu < entry->mtu) {
+        entry->dst = *dst;
+        entry->mtu = mtu;
+        entry->expire = now + IP6_PMTU_TIMEOUT_SEC;
+    }
+    release(&pmtulock);
+}
+
+// 到 dst 的路径 MTU：出口接口的 MTU 和缓存值中较小的那个，没有路由时返回 -1
+int
+ip6_pmtu_get (const ip6_addr_t *dst) {
+    struct ip6_pmtu *entry;
+    struct netif *netif;
+    ip6_addr_t nexthop;
+    uint16_t mtu = 0;
+    time_t now;
+
+    netif = ip6_route_lookup(NULL, dst, &nexthop);
+    if (!netif) {
+        return -1;
+    }
+    time(&now);
+    acquire(&pmtulock);
+    entry = &pmtu_table[ip6_addr_hash(dst) & (IP6_PMTU_TABLE_SIZE - 1)];
+    if (entry->mtu && IP6_ADDR_EQUAL(&entry->dst, dst)) {
+        if (now < entry->expire) {
+            mtu = entry->mtu;
+        } else {
+            /* expired: probe the interface MTU again */
+            entry->mtu = 0;
+        }
+    }
+    release(&pmtulock);
+    if (!mtu || mtu > netif->dev->mtu) {
+        mtu = netif->dev->mtu;
+    }
+    return mtu;
+}
+
+/*
+ * IP6 CORE
+ */
+
+static int
+ip6_tx_netdev (struct netif *netif, const struct netvec *vec, int cnt, const ip6_addr_t *nexthop) {
+    uint8_t ha[ETHERNET_ADDR_LEN];
+    ssize_t ret;
+    size_t plen = 0;
+    int n;
+
+    for (n = 0; n < cnt; n++) {
+        plen += vec[n].len;
+    }
+    ret = nd6_resolve(netif, nexthop, ha);
+    if (ret != ARP_RESOLVE_FOUND) {
+        return ret;
+    }
+    if (netif->dev->ops->xmit(netif->dev, ETHERNET_TYPE_IPV6, vec, cnt, ha) != (ssize_t)plen) {
+        return -1;
+    }
+    return 1;
+}
+
+// 伪首部（RFC 8200 8.1）的部分和，TCP/UDP/ICMPv6 的校验和都从它开始累加
+uint32_t
+ip6_pseudo_sum (const ip6_addr_t *src, const ip6_addr_t *dst, uint8_t nxt, uint32_t len) {
+    uint32_t sum;
+
+    sum = cksum_partial(src, IP6_ADDR_LEN, 0);
+    sum = cksum_partial(dst, IP6_ADDR_LEN, sum);
+    len = hton32(len);
+    sum += (len >> 16) + (len & 0xffff);
+    sum += hton16(nxt);
+    return sum;
+}
+
+// 不做分片，超过链路 MTU 的数据报由上层负责缩小；hlim 为 0 时使用默认的跳数限制
+ssize_t
+ip6_txv (struct netif *netif, uint8_t nxt, const struct netvec *vec, int cnt, const ip6_addr_t *dst, uint8_t hlim) {
+    struct ip6_hdr hdr;
+    struct netvec frame[NETVEC_MAX];
+    struct netif *route;
+    ip6_addr_t nexthop;
+    size_t len = 0;
+    int n;
+
+    if (cnt > NETVEC_MAX - 2) {
+        return -1;
+    }
+    for (n = 0; n < cnt; n++) {
+        len += vec[n].len;
+    }
+    route = ip6_route_lookup(netif, dst, &nexthop);
+    if (!route) {
+        cprintf("ip6 no route to host.\n");
+        return -1;
+    }
+    if (!netif) {
+        netif = route;
+    }
+    if (IP6_HDR_SIZE + len > route->dev->mtu) {
+        return -1;
+    }
+    hdr.vtcfl = hton32(IP6_VERSION << 28);
+    hdr.plen = hton16(len);
+    hdr.nxt = nxt;
+    hdr.hlim = hlim ? hlim : IP6_HOPLIMIT_DEFAULT;
+    hdr.src = ((struct netif_ip6 *)netif)->unicast;
+    hdr.dst = *dst;
+#ifdef DEBUG
+    cprintf(">>> ip6_tx <<<\n");
+    ip6_dump(route, (uint8_t *)&hdr, sizeof(hdr));
+#endif
+    frame[0].base = (uint8_t *)&hdr;
+    frame[0].len = sizeof(hdr);
+    for (n = 0; n < cnt; n++) {
+        frame[1 + n] = vec[n];
+    }
+    if (ip6_tx_netdev(route, frame, 1 + cnt, &nexthop) == -1) {
+        return -1;
+    }
+    return len;
+}
+
+// 目的地址是否属于本设备：本机单播地址、全节点组播地址或本设备某个地址的请求节点组播地址
+static struct netif *
+ip6_rx_local (struct netdev *dev, const ip6_addr_t *dst) {
+    struct netif *entry, *ll;
+
+    if (!IP6_ADDR_IS_MULTICAST(dst)) {
+        return ip6_netif_by_addr(dst);
+    }
+    ll = ip6_netif_linklocal(dev);
+    if (IP6_ADDR_EQUAL(dst, &IP6_ADDR_ALLNODES)) {
+        return ll;
+    }
+    if (IP6_ADDR_IS_SOLICITED(dst)) {
+        for (entry = dev->ifs; entry; entry = entry->next) {
+            if (entry->family == NETIF_FAMILY_IPV6 && memcmp(&((struct netif_ip6 *)entry)->unicast.addr8[13], &dst->addr8[13], 3) == 0) {
+                return ll ? ll : entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+// 跳过扩展头部，返回上层协议号并让 payload/plen 指向上层协议的数据，不支持的报文返回 -1。
+// 个数有上限以免构造的报文让这里循环太久
+static int
+ip6_skip_ext (uint8_t nxt, uint8_t **payload, size_t *plen) {
+    struct ip6_ext_hdr *ext;
+    struct ip6_frag_hdr *frag;
+    size_t hlen;
+    int n;
+
+    for (n = 0; n < IP6_EXT_HDR_MAX; n++) {
+        switch (nxt) {
+        case IP6_NEXTHDR_HOPOPT:
+        case IP6_NEXTHDR_DSTOPTS:
+        case IP6_NEXTHDR_ROUTING:
+            if (*plen < sizeof(struct ip6_ext_hdr)) {
+                return -1;
+            }
+            ext = (struct ip6_ext_hdr *)*payload;
+            hlen = (ext->len + 1) << 3;
+            if (*plen < hlen) {
+                return -1;
+            }
+            // 剩余段数不为 0 的路由头部要求本机转发，不支持
+            if (nxt == IP6_NEXTHDR_ROUTING && (*payload)[3]) {
+                return -1;
+            }
+            nxt = ext->nxt;
+            break;
+        case IP6_NEXTHDR_FRAGMENT:
+            if (*plen < sizeof(struct ip6_frag_hdr)) {
+                return -1;
+            }
+            frag = (struct ip6_frag_hdr *)*payload;
+            // 不做重组，只接受原子分片（RFC 6946）
+            if (ntoh16(frag->offlg) & (IP6_FRAG_OFFSET_MASK | IP6_FRAG_MF)) {
+                return -1;
+            }
+            hlen = sizeof(struct ip6_frag_hdr);
+            nxt = frag->nxt;
+            break;
+        default:
+            return nxt;
+        }
+        *payload += hlen;
+        *plen -= hlen;
+    }
+    return -1;
+}
+
+static void
+ip6_rx (uint8_t *dgram, size_t dlen, struct netdev *dev) {
+    struct ip6_hdr *hdr;
+    struct ip6_protocol *entry;
+    struct netif *iface;
+    uint8_t *payload;
+    size_t plen;
+    int nxt;
+
+    if (dlen < sizeof(struct ip6_hdr)) {
+        return;
+    }
+    hdr = (struct ip6_hdr *)dgram;
+    if ((ntoh32(hdr->vtcfl) >> 28) != IP6_VERSION) {
+        cprintf("not ipv6 packet.\n");
+        return;
+    }
+    plen = ntoh16(hdr->plen);
+    if (dlen < sizeof(struct ip6_hdr) + plen) {
+        cprintf("ip6 packet length error.\n");
+        return;
+    }
+    if (IP6_ADDR_IS_MULTICAST(&hdr->src)) {
+        return;
+    }
+    iface = ip6_rx_local(dev, &hdr->dst);
+    if (!iface) {
+        /* for other host (no forwarding) */
+        return;
+    }
+#ifdef DEBUG
+    cprintf(">>> ip6_rx <<<\n");
+    ip6_dump(iface, dgram, sizeof(struct ip6_hdr) + plen);
+#endif
+    payload = (uint8_t *)(hdr + 1);
+    nxt = ip6_skip_ext(hdr->nxt, &payload, &plen);
+    if (nxt == -1) {
+        return;
+    }
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == nxt) {
+            entry->handler(payload, plen, hdr, iface);
+            return;
+        }
+    }
+}
+
+// 把收到的 ICMPv6 差错报文交给被引用的数据报所属的上层协议，dgram 指向差错报文中携带的原 IPv6 头部，
+// 上层协议的 hdr 参数是这个原头部（源地址是本机，目的地址是对端）
+void
+ip6_rx_error (uint8_t type, uint8_t code, uint32_t values, uint8_t *dgram, size_t dlen, struct netif *netif) {
+    struct ip6_hdr *hdr;
+    struct ip6_protocol *entry;
+    uint8_t *payload;
+    size_t plen;
+    int nxt;
+
+    if (dlen < sizeof(struct ip6_hdr)) {
+        return;
+    }
+    hdr = (struct ip6_hdr *)dgram;
+    if ((ntoh32(hdr->vtcfl) >> 28) != IP6_VERSION) {
+        return;
+    }
+    payload = (uint8_t *)(hdr + 1);
+    plen = dlen - sizeof(struct ip6_hdr);
+    nxt = ip6_skip_ext(hdr->nxt, &payload, &plen);
+    if (nxt == -1) {
+        return;
+    }
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == nxt) {
+            if (entry->errhandler) {
+                entry->errhandler(type, code, values, payload, plen, hdr, netif);
+            }
+            return;
+        }
+    }
+}
+
+int
+ip6_add_protocol (uint8_t type, void (*handler)(uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *netif), void (*errhandler)(uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *netif)) {
+    struct ip6_protocol *p;
+
+    p = (struct ip6_protocol *)kalloc();
+    if (!p) {
+        return -1;
+    }
+    p->next = protocols;
+    p->type = type;
+    p->handler = handler;
+    p->errhandler = errhandler;
+    protocols = p;
+    return 0;
+}
+
+int
+ip6_init (void) {
+    initlock(&netiflock, "ip6netif");
+    initlock(&routelock, "ip6route");
+    initlock(&pmtulock, "ip6pmtu");
+    netproto_register(NETPROTO_TYPE_IPV6, ip6_rx);
+    return 0;
+}
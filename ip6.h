@@ -0,0 +1,68 @@
+#define IP6_VERSION 6
+
+#define IP6_HDR_SIZE 40
+#define IP6_MTU_MIN 1280
+#define IP6_HOPLIMIT_DEFAULT 64
+
+#define IP6_ADDR_LEN 16
+#define IP6_ADDR_STR_LEN 40 /* "xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx\0" */
+
+extern const ip6_addr_t IP6_ADDR_ANY;
+extern const ip6_addr_t IP6_ADDR_ALLNODES;
+
+#define IP6_ADDR_EQUAL(a, b) \
+    ((a)->addr32[0] == (b)->addr32[0] && (a)->addr32[1] == (b)->addr32[1] && \
+     (a)->addr32[2] == (b)->addr32[2] && (a)->addr32[3] == (b)->addr32[3])
+#define IP6_ADDR_IS_UNSPECIFIED(a) \
+    (!((a)->addr32[0] | (a)->addr32[1] | (a)->addr32[2] | (a)->addr32[3]))
+#define IP6_ADDR_IS_MULTICAST(a) ((a)->addr8[0] == 0xff)
+#define IP6_ADDR_IS_LINKLOCAL(a) ((a)->addr8[0] == 0xfe && ((a)->addr8[1] & 0xc0) == 0x80)
+// 请求节点组播地址 ff02::1:ffXX:XXXX
+#define IP6_ADDR_IS_SOLICITED(a) \
+    ((a)->addr32[0] == hton32(0xff020000) && !(a)->addr32[1] && \
+     (a)->addr32[2] == hton32(0x00000001) && (a)->addr8[12] == 0xff)
+
+// 下一个头部（Next Header）字段的取值
+#define IP6_NEXTHDR_HOPOPT   0
+#define IP6_NEXTHDR_TCP      6
+#define IP6_NEXTHDR_UDP      17
+#define IP6_NEXTHDR_ROUTING  43
+#define IP6_NEXTHDR_FRAGMENT 44
+#define IP6_NEXTHDR_ICMPV6   58
+#define IP6_NEXTHDR_NONE     59
+#define IP6_NEXTHDR_DSTOPTS  60
+
+struct ip6_hdr {
+    uint32_t vtcfl; // 版本（4 bit）、流量类别（8 bit）和流标签（20 bit）
+    uint16_t plen; // 载荷长度，包括扩展头部
+    uint8_t nxt; // 下一个头部
+    uint8_t hlim; // 跳数限制
+    ip6_addr_t src;
+    ip6_addr_t dst;
+};
+
+// 逐跳选项、路由和目的选项头部的公共部分，长度以 8 字节为单位且不含前 8 字节
+struct ip6_ext_hdr {
+    uint8_t nxt;
+    uint8_t len;
+};
+
+struct ip6_frag_hdr {
+    uint8_t nxt;
+    uint8_t reserved;
+    uint16_t offlg;
+    uint32_t ident;
+};
+
+#define IP6_FRAG_OFFSET_MASK 0xfff8
+#define IP6_FRAG_MF 0x0001
+
+// 一个 netif_ip6 对应一个地址，同一设备可以有多个（包括自动生成的链路本地地址）
+struct netif_ip6 {
+    struct netif netif;
+    ip6_addr_t unicast;
+    ip6_addr_t prefix; // unicast 与前缀长度掩码运算后的地址
+    int prefixlen;
+    ip6_addr_t gateway; // 默认路由器，未指定时为 ::，链路本地接口上保存从路由器通告中学到的路由器
+    struct netif_ip6 *hnext; // 本机地址哈希表中的下一个接口
+};
@@ -0,0 +1,266 @@
+#include "types.h"
+#include "defs.h"
+#include "spinlock.h"
+#include "net.h"
+#include "ethernet.h"
+#include "arp.h"
+#include "ip6.h"
+#include "icmp6.h"
+
+/*
+ * Neighbor Discovery (RFC 4861)，IPv6 中代替 ARP 做地址解析，同时从路由器通告中学习默认路由器。
+ * 邻居缓存按地址哈希直接映射：冲突时后来的表项覆盖原来的，最坏也只是多做一次地址解析，
+ * 查找始终只看一个表项。
+ */
+
+#define DEBUG
+
+#define ND6_TABLE_SIZE 64 /* must be a power of 2 */
+#define ND6_TABLE_TIMEOUT_SEC 300
+
+#define ND6_OPT_SOURCE_LLADDR 1
+#define ND6_OPT_TARGET_LLADDR 2
+
+#define ND6_NA_FLAG_ROUTER    0x80000000
+#define ND6_NA_FLAG_SOLICITED 0x40000000
+#define ND6_NA_FLAG_OVERRIDE  0x20000000
+
+struct nd6_opt_lladdr {
+    uint8_t type;
+    uint8_t len; /* in units of 8 octets */
+    uint8_t addr[ETHERNET_ADDR_LEN];
+};
+
+// NS/NA 中 ICMPv6 头部之后的部分
+struct nd6_neighbor {
+    ip6_addr_t target;
+    struct nd6_opt_lladdr opt;
+};
+
+// RA 中 ICMPv6 头部之后的部分（values 中是跳数限制、标志和路由器生存时间）
+struct nd6_router_adv {
+    uint32_t reachable;
+    uint32_t retrans;
+    uint8_t options[0];
+};
+
+struct nd6_entry {
+    unsigned char used;
+    unsigned char resolved;
+    ip6_addr_t addr;
+    uint8_t ha[ETHERNET_ADDR_LEN];
+    time_t timestamp;
+    struct netif *netif;
+};
+
+static struct spinlock nd6lock;
+static struct nd6_entry nd6_table[ND6_TABLE_SIZE];
+
+static struct nd6_entry *
+nd6_table_entry (const ip6_addr_t *addr) {
+    uint32_t hash;
+
+    hash = addr->addr32[2] ^ addr->addr32[3];
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return &nd6_table[hash & (ND6_TABLE_SIZE - 1)];
+}
+
+// 调用者持有 nd6lock
+static void
+nd6_table_update (struct netif *netif, const ip6_addr_t *addr, const uint8_t *ha, int create) {
+    struct nd6_entry *entry;
+
+    entry = nd6_table_entry(addr);
+    if (!entry->used || !IP6_ADDR_EQUAL(&entry->addr, addr)) {
+        if (!create) {
+            return;
+        }
+        entry->used = 1;
+        entry->addr = *addr;
+    }
+    entry->resolved = 1;
+    entry->netif = netif;
+    memcpy(entry->ha, ha, ETHERNET_ADDR_LEN);
+    time(&entry->timestamp);
+}
+
+static const uint8_t *
+nd6_find_lladdr (uint8_t *opt, size_t len, uint8_t type) {
+    struct nd6_opt_lladdr *lladdr;
+    size_t olen;
+
+    while (len >= 2) {
+        olen = opt[1] << 3;
+        if (!olen || olen > len) {
+            return NULL;
+        }
+        lladdr = (struct nd6_opt_lladdr *)opt;
+        if (lladdr->type == type && olen >= sizeof(struct nd6_opt_lladdr)) {
+            return lladdr->addr;
+        }
+        opt += olen;
+        len -= olen;
+    }
+    return NULL;
+}
+
+static int
+nd6_send_solicit (struct netif *netif, const ip6_addr_t *target) {
+    struct nd6_neighbor ns;
+    ip6_addr_t dst;
+
+    ns.target = *target;
+    ns.opt.type = ND6_OPT_SOURCE_LLADDR;
+    ns.opt.len = 1;
+    memcpy(ns.opt.addr, netif->dev->addr, ETHERNET_ADDR_LEN);
+    ip6_solicited_node(target, &dst);
+    return icmp6_tx(netif, ICMP6_TYPE_NEIGHBOR_SOLICIT, 0, 0, (uint8_t *)&ns, sizeof(ns), &dst, 255);
+}
+
+static int
+nd6_send_advert (struct netif *netif, const ip6_addr_t *target, const ip6_addr_t *dst, uint32_t flags) {
+    struct nd6_neighbor na;
+
+    na.target = *target;
+    na.opt.type = ND6_OPT_TARGET_LLADDR;
+    na.opt.len = 1;
+    memcpy(na.opt.addr, netif->dev->addr, ETHERNET_ADDR_LEN);
+    return icmp6_tx(netif, ICMP6_TYPE_NEIGHBOR_ADVERT, 0, hton32(flags), (uint8_t *)&na, sizeof(na), dst, 255);
+}
+
+void
+nd6_rx_solicit (uint8_t *msg, size_t len, struct ip6_hdr *hdr, struct netif *netif) {
+    struct nd6_neighbor *ns;
+    struct netif *target;
+    const uint8_t *lladdr;
+
+    if (len < sizeof(ip6_addr_t)) {
+        return;
+    }
+    ns = (struct nd6_neighbor *)msg;
+    if (IP6_ADDR_IS_MULTICAST(&ns->target)) {
+        return;
+    }
+    target = ip6_netif_by_addr(&ns->target);
+    if (!target || target->dev != netif->dev) {
+        return;
+    }
+    lladdr = nd6_find_lladdr(msg + sizeof(ip6_addr_t), len - sizeof(ip6_addr_t), ND6_OPT_SOURCE_LLADDR);
+    if (IP6_ADDR_IS_UNSPECIFIED(&hdr->src)) {
+        /* duplicate address detection of the peer */
+        nd6_send_advert(target, &ns->target, &IP6_ADDR_ALLNODES, ND6_NA_FLAG_OVERRIDE);
+        return;
+    }
+    if (lladdr) {
+        acquire(&nd6lock);
+        nd6_table_update(netif, &hdr->src, lladdr, 1);
+        release(&nd6lock);
+    }
+    nd6_send_advert(target, &ns->target, &hdr->src, ND6_NA_FLAG_SOLICITED | ND6_NA_FLAG_OVERRIDE);
+}
+
+void
+nd6_rx_advert (uint8_t *msg, size_t len, struct ip6_hdr *hdr, struct netif *netif) {
+    struct nd6_neighbor *na;
+    const uint8_t *lladdr;
+
+    (void)hdr;
+    if (len < sizeof(ip6_addr_t)) {
+        return;
+    }
+    na = (struct nd6_neighbor *)msg;
+    if (IP6_ADDR_IS_MULTICAST(&na->target)) {
+        return;
+    }
+    lladdr = nd6_find_lladdr(msg + sizeof(ip6_addr_t), len - sizeof(ip6_addr_t), ND6_OPT_TARGET_LLADDR);
+    if (!lladdr) {
+        return;
+    }
+    acquire(&nd6lock);
+    nd6_table_update(netif, &na->target, lladdr, 0);
+    release(&nd6lock);
+}
+
+// 只学习默认路由器，不做无状态地址自动配置
+void
+nd6_rx_router_advert (uint32_t values, uint8_t *msg, size_t len, struct ip6_hdr *hdr, struct netif *netif) {
+    struct netif *ll;
+    const uint8_t *lladdr;
+
+    if (len < sizeof(struct nd6_router_adv) || !IP6_ADDR_IS_LINKLOCAL(&hdr->src)) {
+        return;
+    }
+    lladdr = nd6_find_lladdr(msg + sizeof(struct nd6_router_adv), len - sizeof(struct nd6_router_adv), ND6_OPT_SOURCE_LLADDR);
+    if (lladdr) {
+        acquire(&nd6lock);
+        nd6_table_update(netif, &hdr->src, lladdr, 1);
+        release(&nd6lock);
+    }
+    ll = ip6_netif_linklocal(netif->dev);
+    if (!ll) {
+        return;
+    }
+    // 路由器生存时间为 0 表示它不再作为默认路由器
+    if (ntoh32(values) & 0xffff) {
+        if (!IP6_ADDR_EQUAL(&((struct netif_ip6 *)ll)->gateway, &hdr->src)) {
+            ((struct netif_ip6 *)ll)->gateway = hdr->src;
+            ip6_route_invalidate();
+        }
+    } else if (IP6_ADDR_EQUAL(&((struct netif_ip6 *)ll)->gateway, &hdr->src)) {
+        ((struct netif_ip6 *)ll)->gateway = IP6_ADDR_ANY;
+        ip6_route_invalidate();
+    }
+}
+
+// 组播地址不需要解析；和 arp_resolve() 一样，解析中的数据报直接丢弃
+int
+nd6_resolve (struct netif *netif, const ip6_addr_t *addr, uint8_t *ha) {
+    struct nd6_entry *entry;
+    time_t now;
+
+    if (IP6_ADDR_IS_MULTICAST(addr)) {
+        ip6_mcast_ha(addr, ha);
+        return ARP_RESOLVE_FOUND;
+    }
+    time(&now);
+    acquire(&nd6lock);
+    entry = nd6_table_entry(addr);
+    if (entry->used && IP6_ADDR_EQUAL(&entry->addr, addr)) {
+        if (entry->resolved && now - entry->timestamp <= ND6_TABLE_TIMEOUT_SEC) {
+            memcpy(ha, entry->ha, ETHERNET_ADDR_LEN);
+            release(&nd6lock);
+            return ARP_RESOLVE_FOUND;
+        }
+    } else {
+        entry->used = 1;
+        entry->addr = *addr;
+    }
+    entry->resolved = 0;
+    entry->netif = netif;
+    entry->timestamp = now;
+    release(&nd6lock);
+    // icmp6_tx() 会再次进入 nd6_resolve()（解析组播地址），不能持有锁
+    nd6_send_solicit(netif, addr);
+    return ARP_RESOLVE_QUERY;
+}
+
+void
+nd6_netif_detach (struct netif *netif) {
+    struct nd6_entry *entry;
+
+    acquire(&nd6lock);
+    for (entry = nd6_table; entry < array_tailof(nd6_table); entry++) {
+        if (entry->used && entry->netif == netif) {
+            entry->used = 0;
+            entry->netif = NULL;
+        }
+    }
+    release(&nd6lock);
+}
+
+int
+nd6_init (void) {
+    initlock(&nd6lock, "nd6");
+    return 0;
+}
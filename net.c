@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "defs.h"
+#include "spinlock.h"
 #include "net.h"
 #include "ip.h"
 #define DEBUG
@@ -13,8 +14,23 @@ struct netproto {
     void (*handler)(uint8_t *packet, size_t plen, struct netdev *dev);
 };
 
+// 协议的周期性处理，由 cpu0 的时钟中断驱动
+struct nettimer {
+    struct nettimer *next;
+    unsigned int interval; /* ticks */
+    unsigned int last;
+    void (*handler)(void);
+};
+
 static struct netdev *devices;
 static struct netproto *protocols;
+static struct nettimer *timers;
+static struct spinlock mcastlock;
+static struct spinlock retirelock;
+static struct netif *retired; // 等待下一个宽限期
+static struct netif *retiring; // 当前宽限期结束后释放
+
+#define NETIF_RETIRE_TICKS 10 /* 检查宽限期的间隔 */
 
 struct netdev *
 netdev_root(void)
@@ -90,25 +106,41 @@ netdev_receive(struct netdev *dev, uint16_t type, uint8_t *packet, unsigned int
 int
 netdev_add_netif(struct netdev *dev, struct netif *netif)
 {
-    struct netif *entry;
+    struct netif **tail;
 
-    for (entry = dev->ifs; entry; entry = entry->next) {
-        if (entry->family == netif->family) {
-            return -1;
-        }
-    }
 #ifdef DEBUG
     if (netif->family == NETIF_FAMILY_IPV4) {
         char addr[IP_ADDR_STR_LEN];
         cprintf("[net] Add <%s> to <%s>\n", ip_addr_ntop(&((struct netif_ip *)netif)->unicast, addr, sizeof(addr)), dev->name);
     }
 #endif
-    netif->next = dev->ifs;
+    // 同一地址族可以有多个 netif，加到末尾，第一个是主地址
+    for (tail = &dev->ifs; *tail; tail = &(*tail)->next) {
+        if (*tail == netif) {
+            return -1;
+        }
+    }
+    netif->next = NULL;
     netif->dev  = dev;
-    dev->ifs = netif;
+    *tail = netif;
     return 0;
 }
 
+int
+netdev_del_netif(struct netdev *dev, struct netif *netif)
+{
+    struct netif **entry;
+
+    for (entry = &dev->ifs; *entry; entry = &(*entry)->next) {
+        if (*entry == netif) {
+            // 被删除的 netif 的 next 保持不变，正在不加锁遍历的读者可以继续走下去
+            *entry = netif->next;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 struct netif *
 netdev_get_netif(struct netdev *dev, int family)
 {
@@ -143,12 +175,155 @@ netproto_register(unsigned short type, void (*handler)(uint8_t *packet, size_t p
     return 0;
 }
 
+// 只在 netinit() 中注册，时钟中断开启之后链表不再变化，遍历时不需要加锁
+int
+nettimer_register(unsigned int interval, void (*handler)(void))
+{
+    struct nettimer *entry;
+
+    entry = (struct nettimer *)kalloc();
+    if (!entry) {
+        return -1;
+    }
+    entry->next = timers;
+    entry->interval = interval;
+    entry->last = ticks;
+    entry->handler = handler;
+    timers = entry;
+    return 0;
+}
+
+// 在中断上下文中调用，handler 不能睡眠
+void
+nettimer_tick(void)
+{
+    struct nettimer *entry;
+    unsigned int now;
+
+    now = ticks;
+    for (entry = timers; entry; entry = entry->next) {
+        if (now - entry->last >= entry->interval) {
+            entry->last = now;
+            entry->handler();
+        }
+    }
+}
+
+// 组播过滤表：接收路径（中断上下文）和配置路径都持有 mcastlock
+int
+netdev_add_mcast(struct netdev *dev, const uint8_t *addr)
+{
+    struct netdev_mcast *entry, *free = NULL;
+
+    acquire(&mcastlock);
+    for (entry = dev->mcast; entry < array_tailof(dev->mcast); entry++) {
+        if (entry->refs && memcmp(entry->addr, addr, dev->alen) == 0) {
+            entry->refs++;
+            release(&mcastlock);
+            return 0;
+        }
+        if (!entry->refs && !free) {
+            free = entry;
+        }
+    }
+    if (!free) {
+        release(&mcastlock);
+        return -1;
+    }
+    memcpy(free->addr, addr, dev->alen);
+    free->refs = 1;
+    if (dev->ops && dev->ops->set_mcast) {
+        dev->ops->set_mcast(dev);
+    }
+    release(&mcastlock);
+    return 0;
+}
+
+int
+netdev_del_mcast(struct netdev *dev, const uint8_t *addr)
+{
+    struct netdev_mcast *entry;
+
+    acquire(&mcastlock);
+    for (entry = dev->mcast; entry < array_tailof(dev->mcast); entry++) {
+        if (entry->refs && memcmp(entry->addr, addr, dev->alen) == 0) {
+            if (!--entry->refs && dev->ops && dev->ops->set_mcast) {
+                dev->ops->set_mcast(dev);
+            }
+            release(&mcastlock);
+            return 0;
+        }
+    }
+    release(&mcastlock);
+    return -1;
+}
+
+// 硬件过滤器是散列表，会放过其他组播地址，接收时还要再精确匹配一次
+int
+netdev_has_mcast(struct netdev *dev, const uint8_t *addr)
+{
+    struct netdev_mcast *entry;
+    int ret = 0;
+
+    acquire(&mcastlock);
+    for (entry = dev->mcast; entry < array_tailof(dev->mcast); entry++) {
+        if (entry->refs && memcmp(entry->addr, addr, dev->alen) == 0) {
+            ret = 1;
+            break;
+        }
+    }
+    release(&mcastlock);
+    return ret;
+}
+
+// 删除的 netif 延迟释放：接收和发送路径不加锁地遍历 dev->ifs、使用路由查找返回的 netif，
+// 这些短期引用不能跨越 sleep() 或返回用户态。调用者先让长期持有引用的一方（套接字、ARP 表等）放弃引用，
+// 再把 netif 交给这里，等所有 CPU 和进程都经过静止状态（quiescent_passed()）之后才释放内存
+void
+netif_retire(struct netif *netif)
+{
+    acquire(&retirelock);
+    netif->retired = retired;
+    retired = netif;
+    release(&retirelock);
+}
+
+// 同一时间只跟踪一个宽限期：开始时已经在 retired 上的 netif 在它结束后释放，之后加入的等下一个
+static void
+netif_retire_timer(void)
+{
+    struct netif *netif, *list = NULL;
+
+    acquire(&retirelock);
+    if (retiring && quiescent_passed()) {
+        list = retiring;
+        retiring = NULL;
+    }
+    if (!retiring && retired) {
+        retiring = retired;
+        retired = NULL;
+        quiescent_begin();
+    }
+    release(&retirelock);
+    while ((netif = list) != NULL) {
+        list = netif->retired;
+        kfree((char *)netif);
+    }
+}
+
 void
 netinit(void)
 {
+    initlock(&mcastlock, "mcast");
+    initlock(&retirelock, "netifretire");
+    nettimer_register(NETIF_RETIRE_TICKS, netif_retire_timer);
     arp_init();
     ip_init();
     icmp_init();
+    igmp_init();
+    ip6_init();
+    icmp6_init();
+    nd6_init();
     udp_init();
     tcp_init();
 }
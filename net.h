@@ -23,19 +23,36 @@
 #define IFNAMSIZ 16
 #endif
 
+#define NETDEV_MCAST_MAX 16
+
 struct netdev;
 
+// 发送路径上的分散/聚集（gather）列表，每个元素必须位于内核直接映射的内存中，驱动直接对其做 DMA
+#define NETVEC_MAX 8
+
+struct netvec {
+    const uint8_t *base;
+    size_t len;
+};
+
 struct netif {
     struct netif *next;
     uint8_t family; // 表示网络接口的类型，例如 IPv4 或 IPv6
     struct netdev *dev;
+    struct netif *retired; // netif_retire() 之后等待释放的链表
     /* Depends on implementation of protocols. */
 };
 // 网络设备操作
 struct netdev_ops {
     int (*open)(struct netdev *dev); // 用于打开（初始化）网络设备
     int (*stop)(struct netdev *dev); // 用于停止网络设备
-    int (*xmit)(struct netdev *dev, uint16_t type, const uint8_t *packet, size_t size, const void *dst); // 用于发送数据包到网络设备
+    ssize_t (*xmit)(struct netdev *dev, uint16_t type, const struct netvec *vec, int cnt, const void *dst); // 用于发送数据包到网络设备，数据包由 vec 中的 cnt 个片段依次拼接而成
+    int (*set_mcast)(struct netdev *dev); // 按 dev->mcast 重新设置硬件的组播过滤器，不支持时为 NULL
+};
+// 设备接收的组播链路地址，多个上层（IGMP 组、IPv6 请求节点地址）可能对应同一个地址，所以带引用计数
+struct netdev_mcast {
+    uint8_t addr[16];
+    int refs;
 };
 // 网络设备
 struct netdev {
@@ -51,6 +68,7 @@ struct netdev {
     uint8_t addr[16]; // 网络设备的地址信息，即MAC（Media Access Control）地址
     uint8_t peer[16]; // 对等设备的地址信息
     uint8_t broadcast[16];
+    struct netdev_mcast mcast[NETDEV_MCAST_MAX];
     struct netdev_ops *ops; // 指向网络设备操作函数集的指针，用于实现对网络设备的操作
     void *priv; // 指向私有数据的指针，用于存储网络设备相关的私有信息
 };
@@ -0,0 +1,272 @@
+#include "types.h"
+#include "user.h"
+#include "socket.h"
+
+/*
+ * ping: send ICMP echo requests through a raw ICMP socket and report the
+ * round-trip times.  RTTs are measured with the TSC, which is calibrated
+ * against the 100Hz uptime() ticks at startup, so they have microsecond
+ * resolution.  There is no libgcc in user space, so the 64-bit divisions
+ * needed for the statistics are done by hand.
+ */
+
+#define ICMP_TYPE_ECHOREPLY 0
+#define ICMP_TYPE_DEST_UNREACH 3
+#define ICMP_TYPE_ECHO 8
+#define ICMP_TYPE_TIME_EXCEEDED 11
+
+#define PING_HDR_SIZE 8
+#define PING_DEFAULT_SIZE 56
+#define PING_DEFAULT_COUNT 4 /* no SIGINT to stop an endless run and print the summary */
+#define PING_QUEUE_HDR_SIZE 8 /* the kernel queues each reply behind this header in one page */
+#define PING_MAX_SIZE (4096 - PING_QUEUE_HDR_SIZE - PING_HDR_SIZE)
+#define PING_TIMEOUT_TICKS 100 /* 1 sec */
+#define TICKS_PER_SEC 100
+
+struct icmp_echo {
+    uint8_t type;
+    uint8_t code;
+    uint16_t sum;
+    uint16_t id;
+    uint16_t seq;
+    uint8_t data[0];
+};
+
+static uint8_t sbuf[PING_HDR_SIZE + PING_MAX_SIZE];
+static uint8_t rbuf[PING_HDR_SIZE + PING_MAX_SIZE + 64];
+static uint32_t cycles_per_us;
+
+static uint64_t
+rdtsc(void)
+{
+    uint64_t ret;
+
+    asm volatile("rdtsc" : "=A" (ret));
+    return ret;
+}
+
+// 64 bit by 32 bit division without libgcc
+static uint64_t
+udiv64(uint64_t n, uint32_t d)
+{
+    uint64_t q = 0, r = 0;
+    int i;
+
+    for (i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= (uint64_t)1 << i;
+        }
+    }
+    return q;
+}
+
+static uint32_t
+isqrt64(uint64_t n)
+{
+    uint64_t bit = (uint64_t)1 << 62, res = 0;
+
+    while (bit > n)
+        bit >>= 2;
+    while (bit) {
+        if (n >= res + bit) {
+            n -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)res;
+}
+
+static void
+calibrate(void)
+{
+    int start;
+    uint64_t tsc;
+
+    start = uptime();
+    while (uptime() == start)
+        ;
+    start = uptime();
+    tsc = rdtsc();
+    while (uptime() - start < TICKS_PER_SEC / 10)
+        ;
+    cycles_per_us = (uint32_t)udiv64(rdtsc() - tsc, 1000000 / 10);
+    if (!cycles_per_us)
+        cycles_per_us = 1;
+}
+
+static char *
+addrstr(ip_addr_t addr, char *buf)
+{
+    uint8_t *p = (uint8_t *)&addr;
+    char *s = buf;
+    int n, d;
+
+    for (n = 0; n < 4; n++) {
+        d = p[n];
+        if (d >= 100)
+            *s++ = '0' + d / 100;
+        if (d >= 10)
+            *s++ = '0' + (d / 10) % 10;
+        *s++ = '0' + d % 10;
+        if (n < 3)
+            *s++ = '.';
+    }
+    *s = 0;
+    return buf;
+}
+
+// print microseconds as milliseconds with 3 decimal places
+static void
+printms(uint32_t us)
+{
+    uint32_t frac = us % 1000;
+
+    printf(1, "%d.%d%d%d", us / 1000, frac / 100, (frac / 10) % 10, frac % 10);
+}
+
+static void
+usage(void)
+{
+    printf(2, "usage: ping [-f] [-c count] [-i interval_ms] [-s size] ADDRESS\n");
+    exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in peer, from;
+    struct icmp_echo *req, *rep;
+    ip_addr_t dst;
+    char buf[IP_ADDR_STR_LEN];
+    int fd, i, n, addrlen, opt, start, flood = 0, count = PING_DEFAULT_COUNT, interval = 1000, size = PING_DEFAULT_SIZE;
+    uint16_t id, seq;
+    uint64_t sent_at, rtt, sum = 0, sumsq = 0;
+    uint32_t us, min = 0xffffffff, max = 0, avg, transmitted = 0, received = 0, errors = 0;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            flood = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            count = atoi(argv[++i]);
+            if (count <= 0)
+                usage();
+        } else if (strcmp(argv[i], "-i") == 0) {
+            interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            size = atoi(argv[++i]);
+            if (size < 0 || size > PING_MAX_SIZE)
+                usage();
+        } else {
+            usage();
+        }
+    }
+    if (i != argc - 1 || ip_addr_pton(argv[i], &dst) == -1)
+        usage();
+    if (flood)
+        interval = 0;
+    fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (fd == -1) {
+        printf(2, "ping: socket failure\n");
+        exit();
+    }
+    opt = 1;
+    if (ioctl(fd, FIONBIO, &opt) == -1) {
+        printf(2, "ping: ioctl(FIONBIO) failure\n");
+        close(fd);
+        exit();
+    }
+    calibrate();
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_addr = dst;
+    req = (struct icmp_echo *)sbuf;
+    rep = (struct icmp_echo *)rbuf;
+    req->type = ICMP_TYPE_ECHO;
+    req->code = 0;
+    req->sum = 0;
+    id = getpid() & 0xffff;
+    req->id = hton16(id);
+    for (n = 0; n < size; n++)
+        req->data[n] = n;
+    printf(1, "PING %s: %d data bytes\n", addrstr(dst, buf), size);
+    for (seq = 1; transmitted < (uint32_t)count; seq++) {
+        req->seq = hton16(seq);
+        sent_at = rdtsc();
+        if (sendto(fd, (char *)sbuf, PING_HDR_SIZE + size, (struct sockaddr *)&peer, sizeof(peer)) == -1) {
+            printf(2, "ping: sendto failure\n");
+            break;
+        }
+        transmitted++;
+        if (flood)
+            printf(1, ".");
+        // 等待应答时忙等轮询非阻塞套接字，避免 sleep() 的 10ms 粒度影响 RTT 测量
+        start = uptime();
+        while (uptime() - start < PING_TIMEOUT_TICKS) {
+            addrlen = sizeof(from);
+            n = recvfrom(fd, (char *)rbuf, sizeof(rbuf), (struct sockaddr *)&from, &addrlen);
+            if (n == -EAGAIN)
+                continue;
+            if (n < PING_HDR_SIZE)
+                break;
+            if (rep->type == ICMP_TYPE_DEST_UNREACH || rep->type == ICMP_TYPE_TIME_EXCEEDED) {
+                // 引用的原始报文：IP 头部之后是我们发出的 echo 头部
+                i = PING_HDR_SIZE + (rbuf[PING_HDR_SIZE] & 0x0f) * 4;
+                if (n < i + PING_HDR_SIZE)
+                    continue;
+                if (((struct icmp_echo *)(rbuf + i))->id != hton16(id) || ((struct icmp_echo *)(rbuf + i))->seq != hton16(seq))
+                    continue;
+                errors++;
+                if (!flood)
+                    printf(1, "From %s icmp_seq=%d %s\n", addrstr(from.sin_addr, buf), seq,
+                        rep->type == ICMP_TYPE_DEST_UNREACH ? "Destination Unreachable" : "Time to live exceeded");
+                break;
+            }
+            if (rep->type != ICMP_TYPE_ECHOREPLY || rep->id != hton16(id) || rep->seq != hton16(seq))
+                continue;
+            rtt = rdtsc() - sent_at;
+            us = (uint32_t)udiv64(rtt, cycles_per_us);
+            received++;
+            sum += us;
+            sumsq += (uint64_t)us * us;
+            if (us < min)
+                min = us;
+            if (us > max)
+                max = us;
+            if (flood) {
+                printf(1, "\b \b");
+            } else {
+                printf(1, "%d bytes from %s: icmp_seq=%d time=", n, addrstr(from.sin_addr, buf), seq);
+                printms(us);
+                printf(1, " ms\n");
+            }
+            break;
+        }
+        if (interval && (transmitted < (uint32_t)count))
+            sleep((interval + 9) / 10);
+    }
+    close(fd);
+    printf(1, "\n--- %s ping statistics ---\n", addrstr(dst, buf));
+    printf(1, "%d packets transmitted, %d received, ", transmitted, received);
+    if (errors)
+        printf(1, "+%d errors, ", errors);
+    printf(1, "%d%% packet loss\n", transmitted ? (transmitted - received) * 100 / transmitted : 0);
+    if (received) {
+        avg = (uint32_t)udiv64(sum, received);
+        printf(1, "rtt min/avg/max/mdev = ");
+        printms(min);
+        printf(1, "/");
+        printms(avg);
+        printf(1, "/");
+        printms(max);
+        printf(1, "/");
+        // mdev = sqrt(E[x^2] - E[x]^2)
+        printms(isqrt64(udiv64(sumsq, received) - (uint64_t)avg * avg));
+        printf(1, " ms\n");
+    }
+    exit();
+}
@@ -329,6 +329,7 @@ scheduler(void)
   for(;;){
     // Enable interrupts on this processor.
     sti();
+    c->qs++;
 
     // Loop over process table looking for process to run.
     acquire(&ptable.lock);
@@ -345,6 +346,7 @@ scheduler(void)
 
       swtch(&(c->scheduler), p->context);
       switchkvm();
+      c->qs++;
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
@@ -438,6 +440,7 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->qs++;
 
   sched();
 
@@ -546,3 +549,56 @@ procdump(void)
     cprintf("\n");
   }
 }
+
+// Quiescent-state detection for lock-free readers of network
+// interfaces. A reader must not keep a pointer it looked up across
+// sleep() or a return to user space, and interrupt handlers finish
+// before their cpu gets back to the scheduler. So once every cpu has
+// passed through the scheduler and every process that was in the
+// kernel has slept or returned to user space, no reader from before
+// quiescent_begin() can still hold such a pointer. Kernel code can be
+// preempted by the timer, which is why the cpu check alone is not
+// enough. Only one grace period is tracked at a time; the caller
+// (the network timer) serializes use.
+static uint qs_cpu[NCPU];
+static uint qs_proc[NPROC];
+static char qs_need[NPROC];
+
+void
+quiescent_begin(void)
+{
+  struct proc *p;
+  int i;
+
+  acquire(&ptable.lock);
+  for(i = 0; i < ncpu; i++)
+    qs_cpu[i] = cpus[i].qs;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    i = p - ptable.proc;
+    qs_need[i] = p->state == RUNNING || p->state == RUNNABLE;
+    qs_proc[i] = p->qs;
+  }
+  release(&ptable.lock);
+}
+
+// Has the grace period started by quiescent_begin() ended?
+int
+quiescent_passed(void)
+{
+  struct proc *p;
+  int i, ret = 1;
+
+  acquire(&ptable.lock);
+  for(i = 0; i < ncpu && ret; i++)
+    if(cpus[i].qs == qs_cpu[i])
+      ret = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC] && ret; p++){
+    i = p - ptable.proc;
+    if(!qs_need[i] || p->qs != qs_proc[i])
+      continue;
+    if(p->state == RUNNING || p->state == RUNNABLE)
+      ret = 0;
+  }
+  release(&ptable.lock);
+  return ret;
+}
@@ -8,6 +8,7 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  volatile uint qs;            // Bumped each time this cpu is in the scheduler
 };
 
 extern struct cpu cpus[NCPU];
@@ -49,6 +50,7 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  volatile uint qs;            // Bumped on sleep and on return to user space
 };
 
 // Process memory is laid out contiguously, low addresses first:
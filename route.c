@@ -0,0 +1,183 @@
+#include "types.h"
+#include "user.h"
+#include "socket.h"
+
+static char *
+addrstr(ip_addr_t addr, char *buf)
+{
+    uint8_t *p = (uint8_t *)&addr;
+    char *s = buf;
+    int n, d;
+
+    for (n = 0; n < 4; n++) {
+        d = p[n];
+        if (d >= 100)
+            *s++ = '0' + d / 100;
+        if (d >= 10)
+            *s++ = '0' + (d / 10) % 10;
+        *s++ = '0' + d % 10;
+        if (n < 3)
+            *s++ = '.';
+    }
+    *s = 0;
+    return buf;
+}
+
+static void
+column(char *s, int width)
+{
+    int len = strlen(s);
+
+    printf(1, "%s", s);
+    while (len++ < width)
+        printf(1, " ");
+}
+
+static void
+display(void)
+{
+    int fd;
+    struct rtentry rt;
+    char buf[IP_ADDR_STR_LEN], flags[4], *f;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        exit();
+    printf(1, "Destination     Gateway         Genmask         Flags Iface\n");
+    for (rt.rt_index = 0; ioctl(fd, SIOCGRTENTRY, &rt) != -1; rt.rt_index++) {
+        column(addrstr(((struct sockaddr_in *)&rt.rt_dst)->sin_addr, buf), 16);
+        column(addrstr(((struct sockaddr_in *)&rt.rt_gateway)->sin_addr, buf), 16);
+        column(addrstr(((struct sockaddr_in *)&rt.rt_genmask)->sin_addr, buf), 16);
+        f = flags;
+        if (rt.rt_flags & RTF_UP)
+            *f++ = 'U';
+        if (rt.rt_flags & RTF_GATEWAY)
+            *f++ = 'G';
+        if (rt.rt_flags & RTF_HOST)
+            *f++ = 'H';
+        *f = 0;
+        column(flags, 6);
+        printf(1, "%s\n", rt.rt_dev);
+    }
+    close(fd);
+}
+
+static void
+usage(void)
+{
+    printf(2, "usage: route\n");
+    printf(2, "       route add|del [-net|-host] ADDRESS[/PREFIX] [netmask NETMASK] [gw GATEWAY] [dev IFACE]\n");
+    printf(2, "       route forward [on|off]\n");
+    exit();
+}
+
+static void
+forward(int argc, char *argv[])
+{
+    int fd, enable;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        exit();
+    if (argc == 2) {
+        if (ioctl(fd, SIOCGIPFORWARD, &enable) == -1)
+            printf(2, "route: ioctl(SIOCGIPFORWARD) failure\n");
+        else
+            printf(1, "forwarding %s\n", enable ? "on" : "off");
+    } else {
+        if (strcmp(argv[2], "on") == 0)
+            enable = 1;
+        else if (strcmp(argv[2], "off") == 0)
+            enable = 0;
+        else
+            usage();
+        if (ioctl(fd, SIOCSIPFORWARD, &enable) == -1)
+            printf(2, "route: ioctl(SIOCSIPFORWARD) failure\n");
+    }
+    close(fd);
+    exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct rtentry rt;
+    ip_addr_t addr;
+    int fd, i, req, prefix = -1;
+    char *s;
+
+    if (argc == 1) {
+        display();
+        exit();
+    }
+    if (strcmp(argv[1], "forward") == 0)
+        forward(argc, argv);
+    if (argc < 3)
+        usage();
+    if (strcmp(argv[1], "add") == 0)
+        req = SIOCADDRT;
+    else if (strcmp(argv[1], "del") == 0)
+        req = SIOCDELRT;
+    else
+        usage();
+    memset(&rt, 0, sizeof(rt));
+    rt.rt_dst.sa_family = AF_INET;
+    rt.rt_gateway.sa_family = AF_INET;
+    rt.rt_genmask.sa_family = AF_INET;
+    rt.rt_flags = RTF_UP;
+    i = 2;
+    if (strcmp(argv[i], "-net") == 0) {
+        i++;
+    } else if (strcmp(argv[i], "-host") == 0) {
+        rt.rt_flags |= RTF_HOST;
+        i++;
+    }
+    if (i >= argc)
+        usage();
+    if (strcmp(argv[i], "default") == 0) {
+        addr = INADDR_ANY;
+        prefix = 0;
+    } else {
+        s = strchr(argv[i], '/');
+        if (s) {
+            *s++ = 0;
+            prefix = atoi(s);
+            if (prefix < 0 || prefix > 32)
+                usage();
+        }
+        if (ip_addr_pton(argv[i], &addr) == -1)
+            usage();
+    }
+    ((struct sockaddr_in *)&rt.rt_dst)->sin_addr = addr;
+    if (prefix != -1)
+        ((struct sockaddr_in *)&rt.rt_genmask)->sin_addr = prefix ? hton32(0xffffffff << (32 - prefix)) : 0;
+    else if (!(rt.rt_flags & RTF_HOST))
+        ((struct sockaddr_in *)&rt.rt_genmask)->sin_addr = 0xffffffff;
+    for (i++; i < argc; i += 2) {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "netmask") == 0) {
+            if (ip_addr_pton(argv[i+1], &addr) == -1)
+                usage();
+            ((struct sockaddr_in *)&rt.rt_genmask)->sin_addr = addr;
+        } else if (strcmp(argv[i], "gw") == 0) {
+            if (ip_addr_pton(argv[i+1], &addr) == -1)
+                usage();
+            ((struct sockaddr_in *)&rt.rt_gateway)->sin_addr = addr;
+            rt.rt_flags |= RTF_GATEWAY;
+        } else if (strcmp(argv[i], "dev") == 0) {
+            if (strlen(argv[i+1]) >= sizeof(rt.rt_dev))
+                usage();
+            strcpy(rt.rt_dev, argv[i+1]);
+        } else {
+            usage();
+        }
+    }
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1)
+        exit();
+    if (ioctl(fd, req, &rt) == -1)
+        printf(2, "route: ioctl(%s) failure\n", req == SIOCADDRT ? "SIOCADDRT" : "SIOCDELRT");
+    close(fd);
+    exit();
+}
@@ -10,11 +10,13 @@
 #include "file.h"
 #include "net.h"
 #include "ip.h"
+#include "ip6.h"
 #include "socket.h"
 
 struct socket {
     int type;
     int desc;
+    int nonblock;
 };
 
 struct file*
@@ -22,7 +24,11 @@ socketalloc(int domain, int type, int protocol) {
     struct file *f;
     struct socket *s;
 
-    if (domain != AF_INET || (type != SOCK_STREAM && type != SOCK_DGRAM) || protocol != 0) {
+    if (domain != AF_INET && domain != AF_INET6) {
+        return NULL;
+    }
+    // 原始套接字只支持 IPv4 的 ICMP
+    if (type == SOCK_RAW ? (domain != AF_INET || protocol != IPPROTO_ICMP) : ((type != SOCK_STREAM && type != SOCK_DGRAM) || (protocol != 0 && protocol != (type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP)))) {
         return NULL;
     }
     f = filealloc();
@@ -35,7 +41,23 @@ socketalloc(int domain, int type, int protocol) {
         return NULL;
     }
     s->type = type;
-    s->desc = (type == SOCK_STREAM ? tcp_api_open() : udp_api_open());
+    s->nonblock = 0;
+    switch (type) {
+    case SOCK_STREAM:
+        s->desc = tcp_api_open(domain);
+        break;
+    case SOCK_DGRAM:
+        s->desc = udp_api_open(domain);
+        break;
+    default:
+        s->desc = icmp_api_open();
+        break;
+    }
+    if (s->desc == -1) {
+        kfree((char*)s);
+        fileclose(f);
+        return NULL;
+    }
     f->type = FD_SOCKET;
     f->readable = 1;
     f->writable = 1;
@@ -47,8 +69,10 @@ void
 socketclose(struct socket *s) {
     if (s->type == SOCK_STREAM)
         tcp_api_close(s->desc);
-    else
+    else if (s->type == SOCK_DGRAM)
         udp_api_close(s->desc);
+    else
+        icmp_api_close(s->desc);
 }
 
 int
@@ -97,6 +121,7 @@ socketaccept(struct socket *s, struct sockaddr *addr, int *addrlen) {
     }
     as->type = s->type;
     as->desc = adesc;
+    as->nonblock = 0;
     f->type = FD_SOCKET;
     f->readable = 1;
     f->writable = 1;
@@ -108,30 +133,195 @@ int
 socketread(struct socket *s, char *addr, int n) {
     if (s->type != SOCK_STREAM)
         return -1;
-    return tcp_api_recv(s->desc, (uint8_t *)addr, n);
+    return tcp_api_recv(s->desc, (uint8_t *)addr, n, s->nonblock);
 }
 
 int
 socketwrite(struct socket *s, char *addr, int n) {
     if (s->type != SOCK_STREAM)
         return -1;
-    return tcp_api_send(s->desc, (uint8_t *)addr, n);
+    return tcp_api_send(s->desc, (uint8_t *)addr, n, s->nonblock);
 }
 
 int
 socketrecvfrom(struct socket *s, char *buf, int n, struct sockaddr *addr, int *addrlen) {
+    if (s->type == SOCK_RAW)
+        return icmp_api_recvfrom(s->desc, (uint8_t *)buf, n, addr, addrlen, s->nonblock);
     if (s->type != SOCK_DGRAM)
         return -1;
-    return udp_api_recvfrom(s->desc, (uint8_t *)buf, n, addr, addrlen);
+    return udp_api_recvfrom(s->desc, (uint8_t *)buf, n, addr, addrlen, s->nonblock);
 }
 
 int
 socketsendto(struct socket *s, char *buf, int n, struct sockaddr *addr, int addrlen) {
+    if (s->type == SOCK_RAW)
+        return icmp_api_sendto(s->desc, (uint8_t *)buf, n, addr, addrlen);
     if (s->type != SOCK_DGRAM)
         return -1;
     return udp_api_sendto(s->desc, (uint8_t *)buf, n, addr, addrlen);
 }
 
+int
+socketsetsockopt(struct socket *s, int level, int optname, void *optval, int optlen) {
+    if (optlen < 0)
+        return -1;
+    if (s->type == SOCK_DGRAM)
+        return udp_api_setsockopt(s->desc, level, optname, optval, optlen);
+    if (s->type == SOCK_STREAM)
+        return tcp_api_setsockopt(s->desc, level, optname, optval, optlen);
+    return -1;
+}
+
+int
+socketgetsockopt(struct socket *s, int level, int optname, void *optval, int *optlen) {
+    if (*optlen < 0)
+        return -1;
+    if (s->type == SOCK_DGRAM)
+        return udp_api_getsockopt(s->desc, level, optname, optval, optlen);
+    if (s->type == SOCK_STREAM)
+        return tcp_api_getsockopt(s->desc, level, optname, optval, optlen);
+    return -1;
+}
+
+static int
+socketioctl_route(int req, struct rtentry *rt) {
+    struct netdev *dev;
+    struct netif *iface = NULL;
+    struct ip_route route;
+    ip_addr_t dst, gateway, netmask;
+
+    if (req == SIOCGRTENTRY) {
+        if (ip_route_get(rt->rt_index, &route) == -1)
+            return -1;
+        memset(&rt->rt_dst, 0, sizeof(rt->rt_dst));
+        memset(&rt->rt_gateway, 0, sizeof(rt->rt_gateway));
+        memset(&rt->rt_genmask, 0, sizeof(rt->rt_genmask));
+        rt->rt_dst.sa_family = rt->rt_gateway.sa_family = rt->rt_genmask.sa_family = AF_INET;
+        ((struct sockaddr_in *)&rt->rt_dst)->sin_addr = route.network;
+        ((struct sockaddr_in *)&rt->rt_gateway)->sin_addr = route.nexthop;
+        ((struct sockaddr_in *)&rt->rt_genmask)->sin_addr = route.netmask;
+        rt->rt_flags = RTF_UP;
+        if (route.nexthop)
+            rt->rt_flags |= RTF_GATEWAY;
+        if (route.netmask == 0xffffffff)
+            rt->rt_flags |= RTF_HOST;
+        strncpy(rt->rt_dev, route.netif->dev->name, sizeof(rt->rt_dev));
+        return 0;
+    }
+    if (rt->rt_dst.sa_family != AF_INET)
+        return -1;
+    dst = ((struct sockaddr_in *)&rt->rt_dst)->sin_addr;
+    gateway = (rt->rt_flags & RTF_GATEWAY) ? ((struct sockaddr_in *)&rt->rt_gateway)->sin_addr : IP_ADDR_ANY;
+    netmask = (rt->rt_flags & RTF_HOST) ? 0xffffffff : ((struct sockaddr_in *)&rt->rt_genmask)->sin_addr;
+    if (rt->rt_dev[0]) {
+        rt->rt_dev[sizeof(rt->rt_dev) - 1] = '\0';
+        dev = netdev_by_name(rt->rt_dev);
+        if (!dev)
+            return -1;
+        iface = netdev_get_netif(dev, NETIF_FAMILY_IPV4);
+        if (!iface)
+            return -1;
+    }
+    if (req == SIOCDELRT)
+        return ip_route_delete(dst, netmask, gateway, iface);
+    if (!iface) {
+        /* the gateway must be reachable through a connected network */
+        if (!gateway || !(iface = ip_netif_by_peer(&gateway)))
+            return -1;
+    }
+    return ip_route_add(dst, netmask, gateway, iface);
+}
+
+// 一个设备上可以有多个 IPv4 地址，第一个是主地址（SIOCGIFADDR/SIOCSIFADDR 操作的地址）
+static int
+socketioctl_alias(int req, struct ifaliasreq *ifra) {
+    struct netdev *dev;
+    struct netif *iface;
+    ip_addr_t addr, mask;
+    int index = 0;
+
+    ifra->ifra_name[sizeof(ifra->ifra_name) - 1] = '\0';
+    dev = netdev_by_name(ifra->ifra_name);
+    if (!dev)
+        return -1;
+    if (req == SIOCGIFALIAS) {
+        for (iface = dev->ifs; iface; iface = iface->next) {
+            if (iface->family != NETIF_FAMILY_IPV4 || index++ != ifra->ifra_index)
+                continue;
+            memset(&ifra->ifra_addr, 0, sizeof(ifra->ifra_addr));
+            memset(&ifra->ifra_broadaddr, 0, sizeof(ifra->ifra_broadaddr));
+            memset(&ifra->ifra_mask, 0, sizeof(ifra->ifra_mask));
+            ifra->ifra_addr.sa_family = ifra->ifra_broadaddr.sa_family = ifra->ifra_mask.sa_family = AF_INET;
+            ((struct sockaddr_in *)&ifra->ifra_addr)->sin_addr = ((struct netif_ip *)iface)->unicast;
+            ((struct sockaddr_in *)&ifra->ifra_broadaddr)->sin_addr = ((struct netif_ip *)iface)->broadcast;
+            ((struct sockaddr_in *)&ifra->ifra_mask)->sin_addr = ((struct netif_ip *)iface)->netmask;
+            return 0;
+        }
+        return -1;
+    }
+    if (ifra->ifra_addr.sa_family != AF_INET)
+        return -1;
+    addr = ((struct sockaddr_in *)&ifra->ifra_addr)->sin_addr;
+    if (req == SIOCDIFADDR) {
+        iface = ip_netif_by_addr(&addr);
+        if (!iface || iface->dev != dev)
+            return -1;
+        tcp_netif_detach(iface);
+        udp_netif_detach(iface);
+        return ip_netif_delete(iface);
+    }
+    mask = ((struct sockaddr_in *)&ifra->ifra_mask)->sin_addr;
+    if (!mask)
+        mask = 0xffffffff;
+    iface = ip_netif_alloc(addr, mask, 0);
+    if (!iface)
+        return -1;
+    return ip_netif_add(dev, iface);
+}
+
+// IPv6 地址：第一个地址加入设备时自动生成链路本地地址，它和其他地址一样可以用 SIOCGIFALIAS_IN6 列出
+static int
+socketioctl_alias6(int req, struct in6_aliasreq *ifra) {
+    struct netdev *dev;
+    struct netif *iface;
+    int index = 0;
+
+    ifra->ifra_name[sizeof(ifra->ifra_name) - 1] = '\0';
+    dev = netdev_by_name(ifra->ifra_name);
+    if (!dev)
+        return -1;
+    if (req == SIOCGIFALIAS_IN6) {
+        for (iface = dev->ifs; iface; iface = iface->next) {
+            if (iface->family != NETIF_FAMILY_IPV6 || index++ != ifra->ifra_index)
+                continue;
+            memset(&ifra->ifra_addr, 0, sizeof(ifra->ifra_addr));
+            memset(&ifra->ifra_gateway, 0, sizeof(ifra->ifra_gateway));
+            ifra->ifra_addr.sin6_family = ifra->ifra_gateway.sin6_family = AF_INET6;
+            ifra->ifra_addr.sin6_addr = ((struct netif_ip6 *)iface)->unicast;
+            ifra->ifra_gateway.sin6_addr = ((struct netif_ip6 *)iface)->gateway;
+            ifra->ifra_prefixlen = ((struct netif_ip6 *)iface)->prefixlen;
+            return 0;
+        }
+        return -1;
+    }
+    if (ifra->ifra_addr.sin6_family != AF_INET6)
+        return -1;
+    if (req == SIOCDIFADDR_IN6) {
+        iface = ip6_netif_by_addr(&ifra->ifra_addr.sin6_addr);
+        if (!iface || iface->dev != dev)
+            return -1;
+        tcp_netif_detach(iface);
+        udp_netif_detach(iface);
+        return ip6_netif_delete(iface);
+    }
+    if (ifra->ifra_prefixlen <= 0 || ifra->ifra_prefixlen > 128)
+        return -1;
+    iface = ip6_netif_alloc(&ifra->ifra_addr.sin6_addr, ifra->ifra_prefixlen, &ifra->ifra_gateway.sin6_addr);
+    if (!iface)
+        return -1;
+    return ip6_netif_add(dev, iface);
+}
+
 int
 socketioctl(struct socket *s, int req, void *arg) {
     struct ifreq *ifreq;
@@ -139,6 +329,9 @@ socketioctl(struct socket *s, int req, void *arg) {
     struct netif *iface;
 
     switch (req) {
+    case FIONBIO:
+        s->nonblock = *(int *)arg ? 1 : 0;
+        break;
     case SIOCGIFINDEX:
         ifreq = (struct ifreq *)arg;
         dev = netdev_by_name(ifreq->ifr_name);
@@ -209,7 +402,8 @@ socketioctl(struct socket *s, int req, void *arg) {
             iface = ip_netif_alloc(((struct sockaddr_in *)&ifreq->ifr_addr)->sin_addr, 0xffffffff, 0);
             if (!iface)
                 return -1;
-            netdev_add_netif(dev, iface);
+            if (ip_netif_add(dev, iface) == -1)
+                return -1;
         }
         break;
     case SIOCGIFNETMASK:
@@ -255,6 +449,24 @@ socketioctl(struct socket *s, int req, void *arg) {
         break;
     case SIOCSIFMTU:
         break;
+    case SIOCAIFADDR:
+    case SIOCDIFADDR:
+    case SIOCGIFALIAS:
+        return socketioctl_alias(req, (struct ifaliasreq *)arg);
+    case SIOCAIFADDR_IN6:
+    case SIOCDIFADDR_IN6:
+    case SIOCGIFALIAS_IN6:
+        return socketioctl_alias6(req, (struct in6_aliasreq *)arg);
+    case SIOCADDRT:
+    case SIOCDELRT:
+    case SIOCGRTENTRY:
+        return socketioctl_route(req, (struct rtentry *)arg);
+    case SIOCGIPFORWARD:
+        *(int *)arg = ip_forwarding(-1);
+        break;
+    case SIOCSIPFORWARD:
+        ip_forwarding(*(int *)arg);
+        break;
     default:
         return -1;
     }
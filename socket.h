@@ -6,21 +6,69 @@
 #define PF_LOCAL    1
 // IPv4 网络协议族
 #define PF_INET     2
+// IPv6 网络协议族
+#define PF_INET6    10
 
 #define AF_UNSPEC   PF_UNSPEC
 #define AF_LOCAL    PF_LOCAL
 // Address Family 的缩写，表示 IPv4 地址族（Address Family Internet Protocol）
 #define AF_INET     PF_INET
+#define AF_INET6    PF_INET6
 // 表示流式套接字，通常用于面向连接的可靠数据传输，采用 TCP 协议。通过流式套接字传输的数据是可靠的、有序的，并且保证无差错地到达目的地。
 #define SOCK_STREAM 1
 // 表示数据报套接字，通常用于无连接的、不可靠数据传输，采用 UDP 协议。数据报套接字传输的数据是不可靠的、无序的，可能存在丢失或重复
 #define SOCK_DGRAM  2
+// 原始套接字，目前只支持 IPPROTO_ICMP，收发的是不含 IP 头部的 ICMP 报文
+#define SOCK_RAW    3
 
-#define IPPROTO_TCP 0
-#define IPPROTO_UDP 0
+#define IPPROTO_IP  0
+#define IPPROTO_ICMP 1
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
+// 非阻塞套接字（FIONBIO）上没有数据可读时的返回值为 -EAGAIN
+#define EAGAIN 11
 
 #define INADDR_ANY ((ip_addr_t)0)
 
+// setsockopt/getsockopt 的 level 和选项
+#define SOL_SOCKET   1
+
+#define SO_REUSEADDR 2 /* int: allow several UDP sockets on one port (needed for multicast receivers) */
+#define SO_SNDBUF    7 /* int: TCP send buffer size in bytes (disables auto-tuning) */
+#define SO_RCVBUF    8 /* int: TCP receive buffer size in bytes (disables auto-tuning) */
+
+#define IP_ADD_MEMBERSHIP  35 /* struct ip_mreq */
+#define IP_DROP_MEMBERSHIP 36 /* struct ip_mreq */
+
+#define TCP_NODELAY    1  /* int: send small segments without waiting for ACKs (disables Nagle) */
+#define TCP_CORK       3  /* int: hold partial segments until uncorked or closed */
+#define TCP_INFO       11 /* struct tcp_info (getsockopt only) */
+#define TCP_CONGESTION 13 /* char[16]: "newreno" or "cubic" */
+
+// TCP_INFO 中 tcpi_ca_state 的取值
+#define TCP_CA_OPEN     0
+#define TCP_CA_RECOVERY 3 /* fast recovery */
+#define TCP_CA_LOSS     4 /* retransmission timeout */
+
+// 连接的统计信息，时间以毫秒为单位，窗口以字节为单位
+struct tcp_info {
+    uint8_t  tcpi_state;
+    uint8_t  tcpi_ca_state;
+    uint8_t  tcpi_retransmits; /* consecutive timeouts */
+    uint8_t  tcpi_pad;
+    uint32_t tcpi_rto;
+    uint32_t tcpi_rtt;
+    uint32_t tcpi_rttvar;
+    uint32_t tcpi_snd_mss;
+    uint32_t tcpi_snd_cwnd;
+    uint32_t tcpi_snd_ssthresh;
+    uint32_t tcpi_snd_wnd;
+    uint32_t tcpi_rcv_wnd;
+    uint32_t tcpi_unacked; /* bytes in flight */
+    uint32_t tcpi_total_retrans;
+};
+
 struct sockaddr {
     unsigned short sa_family;
     char sa_data[14];
@@ -32,6 +80,19 @@ struct sockaddr_in {
     ip_addr_t sin_addr;
 };
 
+struct sockaddr_in6 {
+    unsigned short sin6_family;
+    uint16_t sin6_port;
+    uint32_t sin6_flowinfo;
+    ip6_addr_t sin6_addr;
+    uint32_t sin6_scope_id;
+};
+
+struct ip_mreq {
+    ip_addr_t imr_multiaddr; /* IP multicast address of group */
+    ip_addr_t imr_interface; /* local IP address of interface, INADDR_ANY to choose by route */
+};
+
 #define IFNAMSIZ 16
 
 struct ifreq {
@@ -52,3 +113,32 @@ struct ifreq {
         char           *ifr_data;
     };
 };
+
+struct ifaliasreq {
+    char            ifra_name[IFNAMSIZ]; /* Interface name */
+    int             ifra_index;     /* SIOCGIFALIAS: position in the address list */
+    struct sockaddr ifra_addr;
+    struct sockaddr ifra_broadaddr; /* SIOCGIFALIAS only */
+    struct sockaddr ifra_mask;
+};
+
+struct in6_aliasreq {
+    char                ifra_name[IFNAMSIZ]; /* Interface name */
+    int                 ifra_index;     /* SIOCGIFALIAS_IN6: position in the address list */
+    struct sockaddr_in6 ifra_addr;
+    struct sockaddr_in6 ifra_gateway;   /* default router, :: if none */
+    int                 ifra_prefixlen;
+};
+
+#define RTF_UP      0x0001 /* route usable */
+#define RTF_GATEWAY 0x0002 /* destination is a gateway */
+#define RTF_HOST    0x0004 /* host entry (net otherwise) */
+
+struct rtentry {
+    int             rt_index;   /* SIOCGRTENTRY: position in the routing table */
+    struct sockaddr rt_dst;     /* target address */
+    struct sockaddr rt_gateway; /* gateway addr (RTF_GATEWAY) */
+    struct sockaddr rt_genmask; /* target network mask (IP) */
+    unsigned short  rt_flags;
+    char            rt_dev[IFNAMSIZ]; /* interface name, empty if not specified */
+};
@@ -1,5 +1,7 @@
 #include "ioccom.h"
 
+#define	FIONBIO         _IOW('f', 126, int) /* set/clear non-blocking i/o */
+
 #define SIOCGIFINDEX   _IOWR('i',  0, struct ifreq)
 #define SIOCGIFNAME    _IOWR('i',  1, struct ifreq)
 #define	SIOCSIFNAME     _IOW('i',  2, struct ifreq)
@@ -15,3 +17,15 @@
 #define	SIOCSIFBRDADDR  _IOW('i', 12, struct ifreq)
 #define	SIOCGIFMTU     _IOWR('i', 13, struct ifreq)
 #define	SIOCSIFMTU      _IOW('i', 14, struct ifreq)
+#define	SIOCDIFADDR     _IOW('i', 25, struct ifaliasreq)
+#define	SIOCAIFADDR     _IOW('i', 26, struct ifaliasreq)
+#define	SIOCGIFALIAS   _IOWR('i', 27, struct ifaliasreq)
+#define	SIOCAIFADDR_IN6 _IOW('i', 28, struct in6_aliasreq)
+#define	SIOCDIFADDR_IN6 _IOW('i', 29, struct in6_aliasreq)
+#define	SIOCGIFALIAS_IN6 _IOWR('i', 30, struct in6_aliasreq)
+
+#define	SIOCADDRT       _IOW('r',  0, struct rtentry)
+#define	SIOCDELRT       _IOW('r',  1, struct rtentry)
+#define	SIOCGRTENTRY   _IOWR('r',  2, struct rtentry)
+#define	SIOCGIPFORWARD _IOR('r',  3, int)
+#define	SIOCSIPFORWARD  _IOW('r',  4, int)
@@ -114,6 +114,8 @@ extern int sys_recv(void);
 extern int sys_send(void);
 extern int sys_recvfrom(void);
 extern int sys_sendto(void);
+extern int sys_setsockopt(void);
+extern int sys_getsockopt(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -148,6 +150,8 @@ static int (*syscalls[])(void) = {
 [SYS_send]     sys_send,
 [SYS_recvfrom] sys_recvfrom,
 [SYS_sendto]   sys_sendto,
+[SYS_setsockopt] sys_setsockopt,
+[SYS_getsockopt] sys_getsockopt,
 };
 
 void
@@ -13,9 +13,13 @@ sys_ifget(void)
         struct netif *iface = dev->ifs;
         if (!iface) {
             cprintf("%s: no address [%s]\n", dev->name, dev->flags & NETDEV_FLAG_UP ? "UP" : "DOWN");
-        } else {
+            continue;
+        }
+        for (; iface; iface = iface->next) {
             char unicast[IP_ADDR_STR_LEN];
-            char netmask[IP_ADDR_STR_LEN];            
+            char netmask[IP_ADDR_STR_LEN];
+            if (iface->family != NETIF_FAMILY_IPV4)
+                continue;
             cprintf("%s: %s/%s [%s]\n",
                 dev->name,
                 ip_addr_ntop(&((struct netif_ip *)iface)->unicast, unicast, sizeof(unicast)),
@@ -148,3 +148,31 @@ sys_sendto(void)
     return -1;
   return socketsendto(f->socket, p, n, addr, addrlen);
 }
+
+int
+sys_setsockopt(void)
+{
+  struct file *f;
+  int level, optname, optlen;
+  char *optval;
+
+  if (argfd(0, 0, &f) < 0 || argint(1, &level) < 0 || argint(2, &optname) < 0 || argint(4, &optlen) < 0 || argptr(3, &optval, optlen) < 0)
+    return -1;
+  if (f->type != FD_SOCKET)
+    return -1;
+  return socketsetsockopt(f->socket, level, optname, optval, optlen);
+}
+
+int
+sys_getsockopt(void)
+{
+  struct file *f;
+  int level, optname, *optlen;
+  char *optval;
+
+  if (argfd(0, 0, &f) < 0 || argint(1, &level) < 0 || argint(2, &optname) < 0 || argptr(4, (void*)&optlen, sizeof(*optlen)) < 0 || argptr(3, &optval, *optlen) < 0)
+    return -1;
+  if (f->type != FD_SOCKET)
+    return -1;
+  return socketgetsockopt(f->socket, level, optname, optval, optlen);
+}
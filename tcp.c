@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "defs.h"
+#include "x86.h"
 #include "spinlock.h"
 #include "mmu.h"
 #include "param.h"
@@ -10,13 +11,24 @@
 #include "common.h"
 #include "net.h"
 #include "ip.h"
+#include "icmp.h"
+#include "ip6.h"
+#include "icmp6.h"
 #include "socket.h"
+#include "tcp_cc.h"
 
 
 
-#define TCP_CB_TABLE_SIZE 16
+#define TCP_SOCKET_TABLE_SIZE 1024
+#define TCP_CONN_HASH_SIZE   256 /* must be a power of 2 */
+#define TCP_LISTEN_HASH_SIZE 64 /* must be a power of 2 */
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
+#define TCP_SOURCE_PORT_NUM (TCP_SOURCE_PORT_MAX - TCP_SOURCE_PORT_MIN + 1)
+
+#define TCP_CB_HASH_NONE   0
+#define TCP_CB_HASH_CONN   1 /* conn_hash: the peer is known */
+#define TCP_CB_HASH_LISTEN 2 /* listen_hash: bound to a local port only */
 
 #define TCP_CB_STATE_CLOSED      0
 #define TCP_CB_STATE_LISTEN      1
@@ -40,6 +52,61 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y))
 
+// 序列号的比较要考虑回绕
+#define TCP_SEQ_LT(x, y) ((int32_t)((x) - (y)) < 0)
+#define TCP_SEQ_LEQ(x, y) ((int32_t)((x) - (y)) <= 0)
+
+// 重传超时（RFC 6298），单位 ticks
+#define TCP_RTO_INIT 100 /* 1s */
+#define TCP_RTO_MIN  100 /* 1s */
+#define TCP_RTO_MAX  6000 /* 60s */
+#define TCP_RETRANSMIT_MAX     12
+#define TCP_SYN_RETRANSMIT_MAX 5
+#define TCP_TIMER_INTERVAL 1 /* ticks */
+#define TCP_TIMER_BATCH 16
+#define TCP_PERSIST_MIN 500 /* 5s */
+#define TCP_PERSIST_SHIFT_MAX 10
+#define TCP_PERSIST_FIN_MAX 8 /* close() 之后对端窗口一直为 0 时，探测这么多次（约 5 分钟）后中止连接 */
+#define TCP_DELACK_TIMEOUT 20 /* 200ms (RFC 1122 4.2.3.2: at most 500ms) */
+#define TCP_QUICKACK_SEGS  16
+
+#define TCP_OOO_BLOCKS 8
+
+// 发送缓冲区（SO_SNDBUF）的大小，自动调整时在 DEFAULT 和 MAX 之间增长
+#define TCP_SNDBUF_MIN     2048
+#define TCP_SNDBUF_DEFAULT (4 * PGSIZE)
+#define TCP_SNDBUF_PAGES   64 /* must be a power of 2 */
+#define TCP_SNDBUF_MAX     (TCP_SNDBUF_PAGES * PGSIZE)
+
+// 接收缓冲区（SO_RCVBUF）的大小，自动调整时在 DEFAULT 和 MAX 之间增长
+#define TCP_RCVBUF_MIN     2048
+#define TCP_RCVBUF_DEFAULT (4 * PGSIZE)
+#define TCP_RCVBUF_PAGES   64 /* must be a power of 2 */
+#define TCP_RCVBUF_MAX     (TCP_RCVBUF_PAGES * PGSIZE)
+#define TCP_WSCALE 3 /* TCP_RCVBUF_MAX >> TCP_WSCALE fits in the 16-bit window field */
+#define TCP_WSCALE_MAX 14
+
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_WS  3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TS   8
+#define TCP_OPT_MSS_LEN 4
+#define TCP_OPT_WS_LEN  3
+#define TCP_OPT_SACK_PERM_LEN 2
+#define TCP_OPT_TS_LEN 10
+#define TCP_OPT_TS_ALIGNED 12 /* NOP, NOP, TS */
+#define TCP_SACK_BLOCKS_MAX 4 /* (40 - 4) / 8, 3 with timestamps */
+#define TCP_DUPTHRESH 3
+#define TCP_OPT_LEN_MAX 40
+#define TCP_PAWS_IDLE (24 * 24 * 60 * 60 * 100) /* 24 days (RFC 7323 5.5) */
+
+// 对端没有通告 MSS 时使用的默认值（RFC 879, RFC 8200）
+#define TCP_MSS_DEFAULT  536
+#define TCP6_MSS_DEFAULT 1220
+
 struct tcp_hdr {
     uint16_t src; // 源端口
     uint16_t dst; // 目的端口
@@ -52,80 +119,210 @@ struct tcp_hdr {
     uint16_t urg; // 紧急指针，占用 16 位，表示紧急数据的位置
 };
 
+// 收到的段中的选项，没有出现的选项对应的字段为 0
+struct tcp_opts {
+    uint16_t mss;
+    uint8_t ws_ok;
+    uint8_t ws;
+    uint8_t sack_perm;
+    uint8_t *sack; // SACK 块（网络字节序的左右边界）
+    int sack_num;
+    uint8_t ts; // 带有时间戳选项
+    uint32_t tsval;
+    uint32_t tsecr;
+};
+
+// 重传队列中只有占用序列号空间的段（数据、SYN、FIN）。表项不保存段本身，
+// 重传时按 seq 从发送缓冲区中重新构造；部分被确认的段从头部裁剪掉已确认的部分
 struct tcp_txq_entry {
-    struct tcp_hdr *segment;
-    uint16_t len;
-    //struct timeval timestamp;
+    uint32_t seq;
+    uint32_t slen; // 占用的序列号空间：载荷长度加上 SYN/FIN
+    uint8_t flg; // 发送时的控制标志
+    uint32_t timestamp; // 最后一次发送时的 ticks
+    uint8_t rexmt; // 重传过的段不用于 RTT 估计（Karn 算法）
+    uint8_t lost; // 超时后或者按 SACK 信息被判定丢失，等待拥塞窗口允许时重传
+    uint8_t sacked; // 整个段被对端的 SACK 块覆盖
     struct tcp_txq_entry *next;
 };
 
+// 表项从每个连接自己的 slab 中分配，和队列一样由 cb->lock 保护
 struct tcp_txq_head {
     struct tcp_txq_entry *head;
     struct tcp_txq_entry *tail;
+    struct slab_cache slab;
 };
 
+// 控制块由 lock 保护；hnext 由所在哈希桶的锁保护；desc, dead 以及子连接的链表由 tablelock 保护；refs 用原子操作更新。
+// 加锁访问控制块的一方都持有一个引用，引用计数为 0 时才释放内存。
+// 加锁的顺序：监听的控制块 -> 子连接的控制块 -> tablelock -> 哈希桶
 struct tcp_cb {
-    uint8_t used;
+    struct spinlock lock;
+    uint refs; // 套接字或（没有被 accept() 的连接）哈希表持有一个，其余的是临时的
+    uint8_t dead; // 已经从套接字和哈希表中移除，等待最后一个引用释放
+    int desc; // 套接字描述符，还没有被 accept() 的连接为 -1
+    struct tcp_cb *hnext; // 同一个哈希桶中的下一个控制块
+    uint8_t hashed; // 在哪个哈希表中（TCP_CB_HASH_*）
+    /* tcp_cb_clear() resets the fields below */
     uint8_t state;
+    uint8_t eport; // port 占用了临时端口位图中的一位，释放时归还
+    uint8_t family; // AF_INET or AF_INET6，和 netif 的 family 取值相同
     struct netif *iface;
     uint16_t port;
     struct {
         ip_addr_t addr;
+        ip6_addr_t addr6; // AF_INET6 时使用
         uint16_t port;
     } peer;
     struct {
         uint32_t nxt; // 下一个要发送的序列号
         uint32_t una; // 未确认的序列号
         uint16_t up;
-        uint32_t wl1;
-        uint32_t wl2;
-        uint16_t wnd;
+        uint32_t wl1; // 最后一次更新窗口的段的序列号
+        uint32_t wl2; // 最后一次更新窗口的段的确认号
+        uint32_t wnd; // 对端通告的接收窗口
+        uint16_t mss; // 对端通告的 MSS
+        uint8_t wscale; // 对端的窗口缩放因子，收到的窗口（SYN 除外）左移这么多位
+        uint8_t fin; // FIN 已经发送（序列号为 nxt - 1）
     } snd;// 发送窗口相关信息，
     uint32_t iss; // 初始发送序列号
     struct {
         uint32_t nxt; // 下一个期望接收的序列号
         uint16_t up;
-        uint16_t wnd;
+        uint32_t wnd; // 接收缓冲区的空闲空间（rcvbuf.size - rcvbuf.len）
+        uint8_t wscale; // 通告的窗口右移这么多位；0 表示不使用窗口缩放（RFC 7323）
     } rcv; // 接收窗口相关信息
     uint32_t irs; // 初始接收序列号
     struct tcp_txq_head txq;
-    uint8_t window[4096];
+    // 发送缓冲区：从 snd.una 开始的未确认和未发送的数据，放在 TCP_SNDBUF_MAX 字节的环上，
+    // 和接收缓冲区一样页在写入时才分配、确认后释放。size 是 len 的上限
+    struct {
+        uint8_t *pages[TCP_SNDBUF_PAGES];
+        uint32_t head; // snd.una 对应的字节在环中的位置
+        uint32_t len;
+        uint32_t size;
+        uint8_t locked; // 设置了 SO_SNDBUF，不再自动调整
+    } sndbuf;
+    struct {
+        uint32_t srtt; // 平滑的 RTT，放大 8 倍
+        uint32_t rttvar; // RTT 的平均偏差，放大 4 倍
+        uint32_t rto;
+        uint32_t expire; // 重传定时器到期的 ticks，txq 不为空或 persist 时有效
+        int count; // 连续超时重传（或窗口探测）的次数
+        uint8_t persist; // 对端窗口为 0 时运行持续定时器代替重传定时器
+        int probes; // 这次持续定时器运行以来的探测次数，count 只用于退避，到上限后不再增加
+    } rtx;
+    // 延迟 ACK：按序到达的数据每两个整段确认一次，否则等定时器到期或者随发送的数据一起确认
+    struct {
+        uint8_t pending; // 有还没有发送的 ACK
+        uint32_t rcvd; // 上一次 ACK 之后按序收到的字节数
+        uint32_t rcv_mss; // 收到的最大的段的载荷，作为对端的 MSS 的估计
+        uint32_t expire; // pending 时有效
+        uint8_t quick; // 快速 ACK 模式：接下来还有这么多个段立即确认
+    } delack;
+    struct tcp_cc cc;
+    int dupacks;
+    uint8_t recovery; // 在快速恢复中
+    uint32_t recover; // 进入快速恢复（或超时）时的 snd.nxt
+    uint32_t total_retrans;
+    uint8_t nodelay; // TCP_NODELAY：不使用 Nagle 算法
+    uint8_t cork; // TCP_CORK：只发送完整的段，直到取消或者 close()
+    // 接收缓冲区：序列号映射到 TCP_RCVBUF_MAX 字节的环上，页在写入数据时才分配、读完后释放，
+    // 只占用实际缓存着的数据所需的内存。size 是接收窗口的上限
+    struct {
+        uint8_t *pages[TCP_RCVBUF_PAGES];
+        uint32_t head; // 应用程序下一个要读的字节在环中的位置
+        uint32_t len; // 按序到达、还没有被读走的字节数
+        uint32_t size;
+        uint8_t locked; // 设置了 SO_RCVBUF，不再自动调整
+        uint32_t copied; // 自动调整：本轮中应用程序读走的字节数
+        uint32_t epoch; // 自动调整：本轮开始的 ticks
+    } rcvbuf;
+    // 乱序到达的数据直接放在接收缓冲区中对应的位置，这里记录 rcv.nxt 之后已经收到的区间（按序列号排序，互不相邻）
+    struct {
+        struct {
+            uint32_t seq;
+            uint32_t end;
+        } blk[TCP_OOO_BLOCKS];
+        int num;
+    } ooo;
+    // SACK（RFC 2018, RFC 6675）
+    struct {
+        uint8_t ok; // 双方的 SYN 都带有 SACK-permitted 选项
+        uint32_t recent; // 最近收到的乱序段的序列号，它所在的区间作为第一个 SACK 块
+    } sack;
+    // 时间戳（RFC 7323）：TSval 是 ticks 加上每个连接随机的偏移
+    struct {
+        uint8_t ok; // 双方的 SYN 都带有时间戳选项，之后所有的段都带上
+        uint32_t offset;
+        uint32_t recent; // TS.Recent：下一个回显给对端的 TSval
+        uint32_t recent_age; // 更新 TS.Recent 时的 ticks
+        uint32_t last_ack; // Last.ACK.sent
+    } ts;
     struct tcp_cb *parent;
+    struct tcp_cb *children; // 还没有被 accept() 的子连接
+    int nchildren; // children 中的个数，由 tablelock 保护
+    int maxchildren; // listen() 的 backlog，子连接达到这个数之后新的 SYN 直接丢弃
+    struct tcp_cb *sibling;
     struct queue_head backlog;
+    int err; // 连接被 RST 或 ICMP 差错报文中止，下一次 connect/recv 返回错误
 };
 
-#define TCP_CB_LISTENER_SIZE 128
+#define TCP_CB_LISTENER_SIZE 128 /* backlog 的上限 */
 
 #define TCP_CB_STATE_RX_ISREADY(x) (x->state == TCP_CB_STATE_ESTABLISHED || x->state == TCP_CB_STATE_FIN_WAIT1 || x->state == TCP_CB_STATE_FIN_WAIT2)
 #define TCP_CB_STATE_TX_ISREADY(x) (x->state == TCP_CB_STATE_ESTABLISHED || x->state == TCP_CB_STATE_CLOSE_WAIT)
+// close() 之后发送缓冲区中的数据发送完时跟着发送 FIN
+#define TCP_CB_STATE_FIN_QUEUED(x) (x->state == TCP_CB_STATE_FIN_WAIT1 || x->state == TCP_CB_STATE_CLOSING || x->state == TCP_CB_STATE_LAST_ACK)
+
+#define TCP_SOCKET_ISINVALID(x) (x < 0 || x >= TCP_SOCKET_TABLE_SIZE)
+
+#define TCP_RST_RATELIMIT_INTERVAL 10 /* ticks */
+#define TCP_RST_RATELIMIT_BURST 10
+
+// 哈希桶各自加锁，收到段时的查找只和同一个桶上的操作互斥
+struct tcp_hash_bucket {
+    struct spinlock lock;
+    struct tcp_cb *head;
+};
 
-#define TCP_SOCKET_ISINVALID(x) (x < 0 || x >= TCP_CB_TABLE_SIZE)
+static struct spinlock tablelock; // 保护套接字表、位图和控制块的分配器，也让 bind() 的检查和加入哈希表不被打断
+static struct slab_cache cb_slab;
+static struct tcp_cb *sockets[TCP_SOCKET_TABLE_SIZE]; // 套接字描述符到控制块
+static struct tcp_hash_bucket conn_hash[TCP_CONN_HASH_SIZE]; // 连接按四元组
+static struct tcp_hash_bucket listen_hash[TCP_LISTEN_HASH_SIZE]; // 绑定了端口、还没有连接的控制块（包括监听中的）按端口
+static uint32_t port_bitmap[TCP_SOURCE_PORT_NUM / 32]; // 使用中的临时端口
+static uint32_t port_next; // 下一次从这里开始找空闲的临时端口
+static struct ratelimit rst_ratelimit = RATELIMIT_INIT(TCP_RST_RATELIMIT_INTERVAL, TCP_RST_RATELIMIT_BURST);
 
-//static pthread_t timer_thread;
-static struct spinlock tcplock;
-struct tcp_cb cb_table[TCP_CB_TABLE_SIZE];
+// 控制块清零之后 slab 也是空的，第一次分配时初始化
+static struct tcp_txq_entry *
+tcp_txq_alloc (struct tcp_cb *cb) {
+    if (!cb->txq.slab.size) {
+        slab_init(&cb->txq.slab, sizeof(struct tcp_txq_entry));
+    }
+    return (struct tcp_txq_entry *)slab_alloc(&cb->txq.slab);
+}
 
 static int
-tcp_txq_add (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
+tcp_txq_add (struct tcp_cb *cb, uint32_t seq, uint32_t slen, uint8_t flg) {
     struct tcp_txq_entry *txq;
 
-    txq = (struct tcp_txq_entry *)kalloc();
+    txq = tcp_txq_alloc(cb);
     if (!txq) {
         return -1;
     }
-    txq->segment = (struct tcp_hdr *)kalloc();
-    if (!txq->segment) {
-        kfree((char*)txq);
-        return -1;
-    }
-    memcpy(txq->segment, hdr, len);
-    txq->len = len;
-    //gettimeofday(&txq->timestamp, NULL);
-    txq->next = NULL;
+    txq->seq = seq;
+    txq->slen = slen;
+    txq->flg = flg;
+    txq->timestamp = ticks;
 
     // set txq to next of tail entry
     if (cb->txq.head == NULL) {
         cb->txq.head = txq;
+        // 定时器没有运行时启动（RFC 6298 5.1）
+        cb->rtx.expire = ticks + cb->rtx.rto;
+        cb->rtx.count = 0;
+        cb->rtx.persist = 0;
     } else {
         cb->txq.tail->next = txq;
     }
@@ -135,130 +332,1455 @@ tcp_txq_add (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     return 0;
 }
 
-static int
-tcp_cb_clear (struct tcp_cb *cb) {
+static void
+tcp_txq_flush (struct tcp_cb *cb) {
     struct tcp_txq_entry *txq;
-    struct queue_entry *entry;
-    struct tcp_cb *backlog;
 
     while (cb->txq.head) {
         txq = cb->txq.head;
         cb->txq.head = txq->next;
-        kfree((char*)txq->segment);
-        kfree((char*)txq);
+        slab_free(&cb->txq.slab, txq);
+    }
+    cb->txq.tail = NULL;
+    // 队列空了，页还给系统
+    slab_destroy(&cb->txq.slab);
+}
+
+// 用一个 RTT 样本更新 SRTT/RTTVAR 并重新计算 RTO（RFC 6298 2.2, 2.3），时钟粒度 G 为 1 tick
+static void
+tcp_rtt_update (struct tcp_cb *cb, uint32_t rtt) {
+    int32_t delta;
+
+    if (!rtt) {
+        rtt = 1;
+    }
+    if (!cb->rtx.srtt) {
+        cb->rtx.srtt = rtt << 3;
+        cb->rtx.rttvar = rtt << 1;
+    } else {
+        delta = (int32_t)rtt - (int32_t)(cb->rtx.srtt >> 3);
+        cb->rtx.srtt += delta;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        cb->rtx.rttvar += delta - (int32_t)(cb->rtx.rttvar >> 2);
+    }
+    cb->rtx.rto = (cb->rtx.srtt >> 3) + MAX(1, cb->rtx.rttvar);
+    cb->rtx.rto = MIN(MAX(cb->rtx.rto, TCP_RTO_MIN), TCP_RTO_MAX);
+    cb->cc.srtt = cb->rtx.srtt >> 3;
+}
+
+// 本端的时间戳时钟
+static uint32_t
+tcp_ts_now (struct tcp_cb *cb) {
+    return ticks + cb->ts.offset;
+}
+
+// snd.una 前进之后释放已经被确认的段、裁剪部分被确认的段，并测量 RTT：
+// 使用时间戳时每个确认了新数据的 ACK 都用回显的 TSecr 测量，重传过的段也一样（RFC 7323 4.1），否则用最后一个被确认的段测量
+static void
+tcp_txq_ack (struct tcp_cb *cb, struct tcp_opts *opts) {
+    struct tcp_txq_entry *txq;
+    uint32_t sent, trim;
+    int acked = 0, karn = 0;
+
+    while ((txq = cb->txq.head) && TCP_SEQ_LT(txq->seq, cb->snd.una)) {
+        if (txq->rexmt) {
+            karn = 1;
+        }
+        sent = txq->timestamp;
+        acked = 1;
+        if (TCP_SEQ_LT(cb->snd.una, txq->seq + txq->slen)) {
+            trim = cb->snd.una - txq->seq;
+            txq->seq += trim;
+            txq->slen -= trim;
+            txq->flg &= ~TCP_FLG_SYN;
+            break;
+        }
+        cb->txq.head = txq->next;
+        slab_free(&cb->txq.slab, txq);
+        if (!cb->txq.head) {
+            cb->txq.tail = NULL;
+        }
+    }
+    if (!acked) {
+        return;
+    }
+    // 没有时间戳时，确认了重传过的段无法区分是对哪一次发送的确认，不采样，保留退避后的 RTO
+    if (cb->ts.ok && opts->ts) {
+        if ((int32_t)(tcp_ts_now(cb) - opts->tsecr) >= 0) {
+            tcp_rtt_update(cb, tcp_ts_now(cb) - opts->tsecr);
+        }
+    } else if (!karn) {
+        tcp_rtt_update(cb, ticks - sent);
+    }
+    cb->rtx.count = 0;
+    // 确认了新数据时重启定时器，全部确认时停止（RFC 6298 5.2, 5.3）
+    if (cb->txq.head) {
+        cb->rtx.expire = ticks + cb->rtx.rto;
+    }
+}
+
+// 用户数据追加到缓冲区末尾，调用者保证不超过 size，需要的页在这里分配；返回写入的字节数，分配失败时可能少于 len
+static size_t
+tcp_sndbuf_write (struct tcp_cb *cb, const uint8_t *data, size_t len) {
+    uint32_t pos;
+    size_t done, n;
+
+    for (done = 0; done < len; done += n) {
+        pos = (cb->sndbuf.head + cb->sndbuf.len) % TCP_SNDBUF_MAX;
+        n = MIN(len - done, PGSIZE - pos % PGSIZE);
+        if (!cb->sndbuf.pages[pos / PGSIZE] && !(cb->sndbuf.pages[pos / PGSIZE] = (uint8_t *)kalloc())) {
+            break;
+        }
+        memcpy(cb->sndbuf.pages[pos / PGSIZE] + pos % PGSIZE, data + done, n);
+        cb->sndbuf.len += n;
+    }
+    return done;
+}
+
+// 从 snd.una 之后 off 字节处取 len 字节作为段的载荷：不拷贝，直接作为 gather 列表的片段（跨页时两个），同时累加校验和。
+// 发送是同步的，返回时网卡已经读完了这些数据。前一个片段的长度是奇数时，后面的片段的部分和要交换高低字节（RFC 1071）
+static int
+tcp_sndbuf_vec (struct tcp_cb *cb, uint32_t off, size_t len, struct netvec *vec, uint32_t *sum) {
+    uint32_t pos, part;
+    size_t done, n;
+    int cnt = 0;
+
+    for (done = 0; done < len; done += n) {
+        pos = (cb->sndbuf.head + off + done) % TCP_SNDBUF_MAX;
+        n = MIN(len - done, PGSIZE - pos % PGSIZE);
+        vec[cnt].base = cb->sndbuf.pages[pos / PGSIZE] + pos % PGSIZE;
+        vec[cnt].len = n;
+        if (done & 1) {
+            part = (uint16_t)~cksum_fold(cksum_partial(vec[cnt].base, n, 0));
+            part = ((part & 0xff) << 8) | (part >> 8);
+            *sum += part;
+            if (*sum < part) {
+                (*sum)++;
+            }
+        } else {
+            *sum = cksum_partial(vec[cnt].base, n, *sum);
+        }
+        cnt++;
+    }
+    return cnt;
+}
+
+// 被确认的数据从缓冲区头部移除，确认完的页不再有数据时释放；acked 可能包含 SYN/FIN 占用的序列号
+static void
+tcp_sndbuf_ack (struct tcp_cb *cb, uint32_t acked) {
+    uint32_t pos;
+    size_t n;
+
+    acked = MIN(acked, cb->sndbuf.len);
+    for (; acked; acked -= n) {
+        pos = cb->sndbuf.head;
+        n = MIN(acked, PGSIZE - pos % PGSIZE);
+        cb->sndbuf.head = (pos + n) % TCP_SNDBUF_MAX;
+        cb->sndbuf.len -= n;
+        if (cb->sndbuf.head % PGSIZE == 0 && (pos - pos % PGSIZE - cb->sndbuf.head) % TCP_SNDBUF_MAX >= cb->sndbuf.len) {
+            kfree((char*)cb->sndbuf.pages[pos / PGSIZE]);
+            cb->sndbuf.pages[pos / PGSIZE] = NULL;
+        }
+    }
+}
+
+// 自动调整：和 Linux 一样让缓冲区保持在拥塞窗口的 2 倍以上，等待确认的一个窗口之外还有下一个窗口的数据可以发送
+static void
+tcp_sndbuf_autotune (struct tcp_cb *cb) {
+    uint32_t want;
+
+    if (cb->sndbuf.locked) {
+        return;
+    }
+    want = MIN(PGROUNDUP(2 * cb->cc.cwnd), TCP_SNDBUF_MAX);
+    if (want > cb->sndbuf.size) {
+        cb->sndbuf.size = want;
+    }
+}
+
+static const void *
+tcp_cb_peer (struct tcp_cb *cb) {
+    return cb->family == AF_INET6 ? (const void *)&cb->peer.addr6 : (const void *)&cb->peer.addr;
+}
+
+static int
+tcp_cb_peer_equal (struct tcp_cb *cb, const void *addr) {
+    if (cb->family == AF_INET6) {
+        return IP6_ADDR_EQUAL(&cb->peer.addr6, (const ip6_addr_t *)addr);
+    }
+    return cb->peer.addr == *(const ip_addr_t *)addr;
+}
+
+/* the port bitmap and the socket table: the caller holds tablelock; each hash bucket has its own lock */
+
+static struct tcp_hash_bucket *
+tcp_conn_bucket (uint8_t family, uint16_t port, const void *peer, uint16_t pport) {
+    const ip6_addr_t *addr6;
+    uint32_t hash;
+
+    if (family == AF_INET6) {
+        addr6 = (const ip6_addr_t *)peer;
+        hash = addr6->addr32[0] ^ addr6->addr32[1] ^ addr6->addr32[2] ^ addr6->addr32[3];
+    } else {
+        hash = *(const ip_addr_t *)peer;
+    }
+    hash ^= ((uint32_t)port << 16) | pport;
+    hash *= 0x9e3779b1;
+    return &conn_hash[(hash >> 16) & (TCP_CONN_HASH_SIZE - 1)];
+}
+
+static struct tcp_hash_bucket *
+tcp_listen_bucket (uint16_t port) {
+    return &listen_hash[(((uint32_t)port * 0x9e3779b1) >> 16) & (TCP_LISTEN_HASH_SIZE - 1)];
+}
+
+// 调用者持有 cb->lock
+static void
+tcp_cb_unhash (struct tcp_cb *cb) {
+    struct tcp_hash_bucket *bucket;
+    struct tcp_cb **p;
+
+    if (cb->hashed == TCP_CB_HASH_NONE) {
+        return;
+    }
+    if (cb->hashed == TCP_CB_HASH_CONN) {
+        bucket = tcp_conn_bucket(cb->family, cb->port, tcp_cb_peer(cb), cb->peer.port);
+    } else {
+        bucket = tcp_listen_bucket(cb->port);
+    }
+    acquire(&bucket->lock);
+    for (p = &bucket->head; *p; p = &(*p)->hnext) {
+        if (*p == cb) {
+            *p = cb->hnext;
+            break;
+        }
+    }
+    cb->hnext = NULL;
+    release(&bucket->lock);
+    cb->hashed = TCP_CB_HASH_NONE;
+}
+
+// 对端确定之后放到连接的哈希表中，之前（bind() 之后）放到监听的哈希表中。调用者持有 cb->lock
+static void
+tcp_cb_hash (struct tcp_cb *cb) {
+    struct tcp_hash_bucket *bucket;
+
+    tcp_cb_unhash(cb);
+    if (cb->peer.port) {
+        bucket = tcp_conn_bucket(cb->family, cb->port, tcp_cb_peer(cb), cb->peer.port);
+        cb->hashed = TCP_CB_HASH_CONN;
+    } else {
+        bucket = tcp_listen_bucket(cb->port);
+        cb->hashed = TCP_CB_HASH_LISTEN;
+    }
+    acquire(&bucket->lock);
+    cb->hnext = bucket->head;
+    bucket->head = cb;
+    release(&bucket->lock);
+}
+
+// 增加一个引用：调用者已经持有一个引用，或者持有控制块所在的哈希桶的锁（控制块先从哈希表中移除，再释放表持有的引用）
+static void
+tcp_cb_ref (struct tcp_cb *cb) {
+    xadd(&cb->refs, 1);
+}
+
+// 收到的段所属的连接，持有一个引用返回：本机地址由 iface 区分
+static struct tcp_cb *
+tcp_cb_lookup (struct netif *iface, uint16_t port, const void *peer, uint16_t pport) {
+    struct tcp_hash_bucket *bucket;
+    struct tcp_cb *cb;
+
+    bucket = tcp_conn_bucket(iface->family, port, peer, pport);
+    acquire(&bucket->lock);
+    for (cb = bucket->head; cb; cb = cb->hnext) {
+        if (cb->iface == iface && cb->port == port && cb->peer.port == pport && tcp_cb_peer_equal(cb, peer)) {
+            tcp_cb_ref(cb);
+            break;
+        }
+    }
+    release(&bucket->lock);
+    return cb;
+}
+
+// 绑定到该接口地址的监听套接字优先于绑定到任意地址的，持有一个引用返回
+static struct tcp_cb *
+tcp_listener_lookup (struct netif *iface, uint16_t port) {
+    struct tcp_hash_bucket *bucket;
+    struct tcp_cb *cb, *wildcard = NULL;
+
+    bucket = tcp_listen_bucket(port);
+    acquire(&bucket->lock);
+    for (cb = bucket->head; cb; cb = cb->hnext) {
+        if (cb->state != TCP_CB_STATE_LISTEN || cb->family != iface->family || cb->port != port) {
+            continue;
+        }
+        if (cb->iface == iface) {
+            break;
+        }
+        if (!cb->iface) {
+            wildcard = cb;
+        }
+    }
+    if (!cb) {
+        cb = wildcard;
+    }
+    if (cb) {
+        tcp_cb_ref(cb);
+    }
+    release(&bucket->lock);
+    return cb;
+}
+
+// 临时端口（网络字节序）从位图中分配，从上一次分配的下一个开始找，不会马上重用刚释放的端口
+static uint16_t
+tcp_port_alloc (void) {
+    uint32_t n, p;
+
+    for (n = 0; n < TCP_SOURCE_PORT_NUM; n++) {
+        p = (port_next + n) % TCP_SOURCE_PORT_NUM;
+        if (port_bitmap[p / 32] == 0xffffffff) {
+            n += 31 - p % 32;
+            continue;
+        }
+        if (!(port_bitmap[p / 32] & (1U << (p % 32)))) {
+            port_bitmap[p / 32] |= 1U << (p % 32);
+            port_next = p + 1;
+            return hton16(TCP_SOURCE_PORT_MIN + p);
+        }
+    }
+    return 0;
+}
+
+// bind() 指定的端口在临时端口的范围内时也占用位图，返回 -1 表示已经被使用
+static int
+tcp_port_reserve (struct tcp_cb *cb, uint16_t port) {
+    uint32_t p;
+
+    if (ntoh16(port) < TCP_SOURCE_PORT_MIN) {
+        return 0;
+    }
+    p = ntoh16(port) - TCP_SOURCE_PORT_MIN;
+    if (port_bitmap[p / 32] & (1U << (p % 32))) {
+        return -1;
+    }
+    port_bitmap[p / 32] |= 1U << (p % 32);
+    cb->eport = 1;
+    return 0;
+}
+
+static void
+tcp_port_release (uint16_t port) {
+    uint32_t p;
+
+    p = ntoh16(port) - TCP_SOURCE_PORT_MIN;
+    port_bitmap[p / 32] &= ~(1U << (p % 32));
+}
+
+static int
+tcp_socket_alloc (struct tcp_cb *cb) {
+    int n;
+
+    for (n = 0; n < TCP_SOCKET_TABLE_SIZE; n++) {
+        if (!sockets[n]) {
+            sockets[n] = cb;
+            cb->desc = n;
+            return n;
+        }
+    }
+    return -1;
+}
+
+// 释放一个引用，调用者不持有 cb->lock 和 tablelock；只有释放内存时才需要 tablelock（保护分配器）
+static void
+tcp_cb_put (struct tcp_cb *cb) {
+    if (xadd(&cb->refs, -1) == 1) {
+        acquire(&tablelock);
+        slab_free(&cb_slab, cb);
+        release(&tablelock);
+    }
+}
+
+static void
+tcp_cb_unlock (struct tcp_cb *cb) {
+    release(&cb->lock);
+    tcp_cb_put(cb);
+}
+
+// 套接字对应的控制块，加锁并持有一个引用，用 tcp_cb_unlock() 释放。
+// 调用者正在使用这个套接字，sockets[soc] 只会在它关闭时清除，所以不需要 tablelock
+static struct tcp_cb *
+tcp_cb_get (int soc) {
+    struct tcp_cb *cb;
+
+    cb = sockets[soc];
+    if (cb) {
+        tcp_cb_ref(cb);
+        acquire(&cb->lock);
+    }
+    return cb;
+}
+
+// 从表中找到的控制块（调用者已经增加了引用）加锁；等锁的时候被释放了的话返回 NULL
+static struct tcp_cb *
+tcp_cb_lock (struct tcp_cb *cb) {
+    acquire(&cb->lock);
+    if (cb->dead) {
+        tcp_cb_unlock(cb);
+        return NULL;
+    }
+    return cb;
+}
+
+static void tcp_cb_free (struct tcp_cb *cb);
+
+// 控制块回到 CLOSED 状态，释放它占用的资源；套接字描述符不变。调用者持有 cb->lock
+static int
+tcp_cb_clear (struct tcp_cb *cb) {
+    struct queue_entry *entry;
+    struct tcp_cb *child, **p;
+    int n;
+
+    tcp_txq_flush(cb);
+    for (n = 0; n < TCP_SNDBUF_PAGES; n++) {
+        if (cb->sndbuf.pages[n]) {
+            kfree((char*)cb->sndbuf.pages[n]);
+        }
     }
+    for (n = 0; n < TCP_RCVBUF_PAGES; n++) {
+        if (cb->rcvbuf.pages[n]) {
+            kfree((char*)cb->rcvbuf.pages[n]);
+        }
+    }
+    // 还没有被 accept() 的子连接（backlog 中的和握手中的）随监听的控制块一起释放。
+    // 子连接在释放时把自己从链表中移除；持有 cb->lock，不会再有新的子连接
     while (1) {
-        entry = queue_pop(&cb->backlog);
-        if (!entry) {
+        acquire(&tablelock);
+        child = cb->children;
+        if (child) {
+            tcp_cb_ref(child);
+        }
+        release(&tablelock);
+        if (!child) {
             break;
         }
-        backlog = entry->data;
+        if (tcp_cb_lock(child)) {
+            tcp_cb_free(child);
+            tcp_cb_unlock(child);
+        }
+    }
+    acquire(&tablelock);
+    while ((entry = queue_pop(&cb->backlog))) {
+        child = entry->data;
+        if (xadd(&child->refs, -1) == 1) {
+            slab_free(&cb_slab, child);
+        }
         kfree((char*)entry);
-        tcp_cb_clear(backlog);
     }
-    memset(cb, 0, sizeof(*cb));
+    if (cb->parent) {
+        for (p = &cb->parent->children; *p; p = &(*p)->sibling) {
+            if (*p == cb) {
+                *p = cb->sibling;
+                cb->parent->nchildren--;
+                break;
+            }
+        }
+    }
+    tcp_cb_unhash(cb);
+    if (cb->eport) {
+        tcp_port_release(cb->port);
+    }
+    release(&tablelock);
+    memset(&cb->state, 0, sizeof(*cb) - offsetof(struct tcp_cb, state));
     return 0;
 }
 
-static ssize_t
-tcp_tx (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, uint8_t *buf, size_t len) {
-    uint8_t segment[1500];
-    struct tcp_hdr *hdr;
-    ip_addr_t self, peer;
+// 套接字关闭（或者没有被 accept() 的连接中止）时从表中移除控制块并释放套接字或哈希表持有的引用。
+// 调用者持有 cb->lock 和一个引用，内存在调用者 tcp_cb_unlock() 时释放
+static void
+tcp_cb_free (struct tcp_cb *cb) {
+    tcp_cb_clear(cb);
+    acquire(&tablelock);
+    if (cb->desc != -1) {
+        sockets[cb->desc] = NULL;
+        cb->desc = -1;
+    }
+    cb->dead = 1;
+    xadd(&cb->refs, -1); /* never the last one: the caller holds a reference */
+    wakeup(cb); /* accept() waiting on a closed listener */
+    release(&tablelock);
+}
+
+// 伪首部的部分和，peer 根据 iface 的 family 指向 ip_addr_t 或 ip6_addr_t
+static uint32_t
+tcp_pseudo_sum (struct netif *iface, const void *peer, size_t len) {
+    ip_addr_t self, dst;
     uint32_t pseudo = 0;
 
-    memset(&segment, 0, sizeof(segment));
-    hdr = (struct tcp_hdr *)segment;
-    hdr->src = cb->port;
-    hdr->dst = cb->peer.port;
-    hdr->seq = hton32(seq);
-    hdr->ack = hton32(ack);
-    hdr->off = (sizeof(struct tcp_hdr) >> 2) << 4;
-    hdr->flg = flg;
-    hdr->win = hton16(cb->rcv.wnd);
-    hdr->sum = 0;
-    hdr->urg = 0;
-    memcpy(hdr + 1, buf, len);
-    self = ((struct netif_ip *)cb->iface)->unicast;
-    peer = cb->peer.addr;
+    if (iface->family == NETIF_FAMILY_IPV6) {
+        return ip6_pseudo_sum(&((struct netif_ip6 *)iface)->unicast, peer, IP6_NEXTHDR_TCP, len);
+    }
+    self = ((struct netif_ip *)iface)->unicast;
+    dst = *(const ip_addr_t *)peer;
     pseudo += (self >> 16) & 0xffff;
     pseudo += self & 0xffff;
-    pseudo += (peer >> 16) & 0xffff;
-    pseudo += peer & 0xffff;
+    pseudo += (dst >> 16) & 0xffff;
+    pseudo += dst & 0xffff;
     pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
-    pseudo += hton16(sizeof(struct tcp_hdr) + len);
-    hdr->sum = cksum16((uint16_t *)hdr, sizeof(struct tcp_hdr) + len, pseudo);
-    ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)hdr, sizeof(struct tcp_hdr) + len, &peer);
-    tcp_txq_add(cb, hdr, sizeof(struct tcp_hdr) + len);
-    return len;
+    pseudo += hton16(len);
+    return pseudo;
 }
 
-#if 0
-static void *
-tcp_timer_thread (void *arg) {
-    struct timeval timestamp;
-    struct tcp_cb *cb;
-    struct tcp_txq_entry *txq, *prev, *tmp;
-    ip_addr_t peer;
+static void
+tcp_output (struct netif *iface, const void *peer, const struct netvec *vec, int cnt) {
+    if (iface->family == NETIF_FAMILY_IPV6) {
+        ip6_txv(iface, IP6_NEXTHDR_TCP, vec, cnt, peer, 0);
+        return;
+    }
+    // 段的大小已经按路径 MTU 限制过，设置 DF 让途中的路由器在 MTU 更小时回报 ICMP 而不是分片
+    ip_txv(iface, IP_PROTOCOL_TCP, vec, cnt, peer, IP_FLAG_DF);
+}
 
-    while (1) {
-        gettimeofday(&timestamp, NULL);
-        acquire(&tcplock);
-        for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-            prev = NULL;
-            txq = cb->txq.head;
-            while (txq) {
-                if (ntoh32(txq->segment->seq) >= cb->snd.una) {
-                    if (timestamp.tv_sec - txq->timestamp.tv_sec > 3) {
-                        peer = cb->peer.addr;
-                        ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)txq->segment, txq->len, &peer);
-                        txq->timestamp = timestamp;
-                    }
+// SYN 中通告的 MSS：链路 MTU 减去 IP 和 TCP 头部
+static uint16_t
+tcp_mss_adv (struct tcp_cb *cb) {
+    if (cb->family == AF_INET6) {
+        return cb->iface->dev->mtu - IP6_HDR_SIZE - sizeof(struct tcp_hdr);
+    }
+    return cb->iface->dev->mtu - IP_HDR_SIZE_MIN - sizeof(struct tcp_hdr);
+}
 
-                    // update previous tcp_txq_entry
-                    prev = txq;
-                    txq = txq->next;
-                } else {
-                    // remove tcp_txq_entry from list
-                    // do not change prev, just update txq by txq->next,
-                    // and free txq and txq->segment,
-                    // and update cb->txq.[head|tail] if needed
-
-                    // swap tail tcp_txq_entry
-                    if (!txq->next) {
-                        // txq is tail entry
-                        cb->txq.tail = prev;
-                    }
-                    // swap previous tcp_txq_entry
-                    if (prev) {
-                        prev->next = txq->next;
-                    } else {
-                        cb->txq.head = txq->next;
-                    }
+// 段的载荷和选项一共的上限：到对端的路径 MTU 减去 IP 和 TCP 头部，且不超过对端通告的 MSS（RFC 6691）
+static size_t
+tcp_seg_max (struct tcp_cb *cb) {
+    size_t mss;
+    int mtu;
 
-                    // free tcp_txq_entry
-                    tmp = txq->next;
-                    free(txq->segment);
-                    free(txq);
-                    // check next entry
-                    txq = tmp;
+    if (cb->family == AF_INET6) {
+        mtu = ip6_pmtu_get(&cb->peer.addr6);
+        if (mtu == -1) {
+            mtu = cb->iface->dev->mtu;
+        }
+        mss = mtu - IP6_HDR_SIZE - sizeof(struct tcp_hdr);
+    } else {
+        mtu = ip_pmtu_get(&cb->peer.addr);
+        if (mtu == -1) {
+            mtu = cb->iface->dev->mtu;
+        }
+        mss = mtu - IP_HDR_SIZE_MIN - sizeof(struct tcp_hdr);
+    }
+    return MIN(mss, cb->snd.mss);
+}
+
+// 发送段的最大载荷：每个段都带的时间戳选项也要占用空间
+static size_t
+tcp_mss (struct tcp_cb *cb) {
+    return tcp_seg_max(cb) - (cb->ts.ok ? TCP_OPT_TS_ALIGNED : 0);
+}
+
+// 解析段中的选项：长度不对的选项忽略，格式错误时不再解析后面的部分
+static void
+tcp_parse_options (struct tcp_hdr *hdr, struct tcp_opts *opts) {
+    uint8_t *opt, *end;
+
+    memset(opts, 0, sizeof(*opts));
+    opt = (uint8_t *)(hdr + 1);
+    end = (uint8_t *)hdr + ((hdr->off >> 4) << 2);
+    while (opt < end && *opt != TCP_OPT_EOL) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (end - opt < 2 || opt[1] < 2 || opt[1] > end - opt) {
+            break;
+        }
+        switch (*opt) {
+            case TCP_OPT_MSS:
+                if (opt[1] == TCP_OPT_MSS_LEN) {
+                    opts->mss = MAX(ntoh16(*(uint16_t *)(opt + 2)), 64);
                 }
-            }
+                break;
+            case TCP_OPT_WS:
+                if (opt[1] == TCP_OPT_WS_LEN) {
+                    opts->ws_ok = 1;
+                    opts->ws = MIN(opt[2], TCP_WSCALE_MAX);
+                }
+                break;
+            case TCP_OPT_SACK_PERM:
+                if (opt[1] == TCP_OPT_SACK_PERM_LEN) {
+                    opts->sack_perm = 1;
+                }
+                break;
+            case TCP_OPT_SACK:
+                opts->sack = opt + 2;
+                opts->sack_num = (opt[1] - 2) / 8;
+                break;
+            case TCP_OPT_TS:
+                if (opt[1] == TCP_OPT_TS_LEN) {
+                    opts->ts = 1;
+                    opts->tsval = ntoh32(*(uint32_t *)(opt + 2));
+                    opts->tsecr = ntoh32(*(uint32_t *)(opt + 6));
+                }
+                break;
         }
-        release(&tcplock);
-        usleep(100000);
+        opt += opt[1];
     }
-    return NULL;
 }
-#endif
 
+// SYN 中的选项：MSS 没有时使用默认值；双方的 SYN 都带有窗口缩放选项时才使用窗口缩放（RFC 7323 2.2），SACK 和时间戳也一样
 static void
-tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
-    uint32_t seq, ack;
-    size_t hlen, plen;
+tcp_syn_options (struct tcp_cb *cb, struct tcp_opts *opts) {
+    cb->snd.mss = opts->mss ? opts->mss : (cb->family == AF_INET6 ? TCP6_MSS_DEFAULT : TCP_MSS_DEFAULT);
+    if (!opts->ws_ok) {
+        cb->snd.wscale = 0;
+        cb->rcv.wscale = 0;
+    } else {
+        cb->snd.wscale = opts->ws;
+        cb->rcv.wscale = TCP_WSCALE;
+    }
+    cb->sack.ok = opts->sack_perm;
+    cb->ts.ok = opts->ts;
+    if (opts->ts) {
+        cb->ts.recent = opts->tsval;
+        cb->ts.recent_age = ticks;
+    }
+}
+
+// 通告的窗口：SYN 中的窗口不缩放（RFC 7323 2.2）
+static uint16_t
+tcp_rcv_win (struct tcp_cb *cb, uint8_t flg) {
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        return MIN(cb->rcv.wnd, 0xffff);
+    }
+    return MIN(cb->rcv.wnd >> cb->rcv.wscale, 0xffff);
+}
+
+// 收到的段中对端的窗口
+static uint32_t
+tcp_snd_win (struct tcp_cb *cb, struct tcp_hdr *hdr) {
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        return ntoh16(hdr->win);
+    }
+    return (uint32_t)ntoh16(hdr->win) << cb->snd.wscale;
+}
+
+// 发送的段带上了最新的确认号，延迟中的 ACK 不用再单独发送
+static void
+tcp_delack_clear (struct tcp_cb *cb) {
+    cb->delack.pending = 0;
+    cb->delack.rcvd = 0;
+}
+
+// 接收缓冲区中有乱序的数据时 ACK 带上 SACK 块：第一个块是包含最近收到的段的区间，其余的按序列号排列（RFC 2018 4）
+static size_t
+tcp_sack_opt (struct tcp_cb *cb, uint8_t *opt, int max) {
+    uint32_t *blk;
+    int first, n, num;
+
+    for (first = 0; first < cb->ooo.num - 1; first++) {
+        if (TCP_SEQ_LEQ(cb->ooo.blk[first].seq, cb->sack.recent) && TCP_SEQ_LT(cb->sack.recent, cb->ooo.blk[first].end)) {
+            break;
+        }
+    }
+    num = MIN(cb->ooo.num, MIN(max, TCP_SACK_BLOCKS_MAX));
+    opt[0] = TCP_OPT_NOP;
+    opt[1] = TCP_OPT_NOP;
+    opt[2] = TCP_OPT_SACK;
+    opt[3] = 2 + 8 * num;
+    blk = (uint32_t *)(opt + 4);
+    *blk++ = hton32(cb->ooo.blk[first].seq);
+    *blk++ = hton32(cb->ooo.blk[first].end);
+    for (n = 0; n < cb->ooo.num && blk < (uint32_t *)(opt + 4) + 2 * num; n++) {
+        if (n != first) {
+            *blk++ = hton32(cb->ooo.blk[n].seq);
+            *blk++ = hton32(cb->ooo.blk[n].end);
+        }
+    }
+    return 4 + 8 * num;
+}
+
+// 段的选项，返回写出的长度（4 的倍数）。SYN 总是带上 MSS 选项，主动打开的 SYN 和对端提出了窗口缩放（SACK、时间戳）的 SYN-ACK
+// 再带上对应的选项；使用时间戳时每个段都带上时间戳，有乱序数据时 ACK 在 room 字节以内带上尽可能多的 SACK 块
+static size_t
+tcp_write_options (struct tcp_cb *cb, uint8_t flg, uint8_t *opt, size_t room) {
+    uint8_t *p = opt;
+
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        p[0] = TCP_OPT_MSS;
+        p[1] = TCP_OPT_MSS_LEN;
+        *(uint16_t *)(p + 2) = hton16(tcp_mss_adv(cb));
+        p += TCP_OPT_MSS_LEN;
+        if (cb->rcv.wscale) {
+            p[0] = TCP_OPT_NOP;
+            p[1] = TCP_OPT_WS;
+            p[2] = TCP_OPT_WS_LEN;
+            p[3] = cb->rcv.wscale;
+            p += 1 + TCP_OPT_WS_LEN;
+        }
+        if (cb->sack.ok) {
+            p[0] = TCP_OPT_NOP;
+            p[1] = TCP_OPT_NOP;
+            p[2] = TCP_OPT_SACK_PERM;
+            p[3] = TCP_OPT_SACK_PERM_LEN;
+            p += 2 + TCP_OPT_SACK_PERM_LEN;
+        }
+    }
+    // 没有 ACK 的段（主动打开的 SYN）的 TSecr 为 0
+    if (cb->ts.ok) {
+        p[0] = TCP_OPT_NOP;
+        p[1] = TCP_OPT_NOP;
+        p[2] = TCP_OPT_TS;
+        p[3] = TCP_OPT_TS_LEN;
+        *(uint32_t *)(p + 4) = hton32(tcp_ts_now(cb));
+        *(uint32_t *)(p + 8) = hton32(TCP_FLG_ISSET(flg, TCP_FLG_ACK) ? cb->ts.recent : 0);
+        p += TCP_OPT_TS_ALIGNED;
+    }
+    if (!TCP_FLG_ISSET(flg, TCP_FLG_SYN) && TCP_FLG_ISSET(flg, TCP_FLG_ACK) && cb->sack.ok && cb->ooo.num) {
+        if (room >= (size_t)(p - opt) + 4 + 8) {
+            p += tcp_sack_opt(cb, p, (room - (p - opt) - 4) / 8);
+        }
+    }
+    return p - opt;
+}
+
+// 构造并发送一个段：头部在栈上，载荷是发送缓冲区中 snd.una 之后 off 字节处的 len 字节
+static void
+tcp_tx_segment (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, size_t off, size_t len) {
+    struct {
+        struct tcp_hdr hdr;
+        uint8_t opt[TCP_OPT_LEN_MAX];
+    } seg;
+    struct tcp_hdr *hdr = &seg.hdr;
+    struct netvec vec[3];
+    uint32_t pseudo;
+    size_t hlen, room, max;
+    int cnt;
+
+    // 选项和载荷一起不超过 tcp_seg_max()，数据段中放不下的 SACK 块不带
+    room = TCP_OPT_LEN_MAX;
+    if (len) {
+        max = tcp_seg_max(cb);
+        room = max > len ? MIN(room, max - len) : 0;
+    }
+    hlen = sizeof(*hdr) + tcp_write_options(cb, flg, seg.opt, room);
+    hdr->src = cb->port;
+    hdr->dst = cb->peer.port;
+    hdr->seq = hton32(seq);
+    hdr->ack = hton32(ack);
+    hdr->off = (hlen >> 2) << 4;
+    hdr->flg = flg;
+    hdr->win = hton16(tcp_rcv_win(cb, flg));
+    hdr->sum = 0;
+    hdr->urg = 0;
+    pseudo = tcp_pseudo_sum(cb->iface, tcp_cb_peer(cb), hlen + len);
+    pseudo = cksum_partial(hdr, hlen, pseudo);
+    vec[0].base = (uint8_t *)hdr;
+    vec[0].len = hlen;
+    cnt = 1 + tcp_sndbuf_vec(cb, off, len, vec + 1, &pseudo);
+    hdr->sum = cksum_fold(pseudo);
+    tcp_output(cb->iface, tcp_cb_peer(cb), vec, cnt);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+        cb->ts.last_ack = ack;
+        if (ack == cb->rcv.nxt) {
+            tcp_delack_clear(cb);
+        }
+    }
+}
+
+// 新的段：占用序列号空间的段先加入重传队列再发送，纯 ACK 和 RST 不进入队列
+static ssize_t
+tcp_tx (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, size_t off, size_t len) {
+    uint32_t slen;
+
+    if (len > PGSIZE) {
+        return -1;
+    }
+    slen = len + (TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? 1 : 0) + (TCP_FLG_ISSET(flg, TCP_FLG_FIN) ? 1 : 0);
+    if (slen && tcp_txq_add(cb, seq, slen, flg) == -1) {
+        return -1;
+    }
+    tcp_tx_segment(cb, seq, ack, flg, off, len);
+    return len;
+}
+
+// 持续定时器的间隔：RTO 按探测次数指数退避，限制在 5 秒到 60 秒之间
+static uint32_t
+tcp_persist_interval (struct tcp_cb *cb) {
+    return MIN(MAX(cb->rtx.rto << cb->rtx.count, TCP_PERSIST_MIN), TCP_RTO_MAX);
+}
+
+// RFC 793 3.9：只接受比上一次更新更新的段（先比较 seq，再比较 ack）中的窗口，避免旧段把窗口改回去
+static void
+tcp_wnd_update (struct tcp_cb *cb, struct tcp_hdr *hdr) {
+    uint32_t seq, ack;
+
+    seq = ntoh32(hdr->seq);
+    ack = ntoh32(hdr->ack);
+    if (TCP_SEQ_LT(cb->snd.wl1, seq) || (cb->snd.wl1 == seq && TCP_SEQ_LEQ(cb->snd.wl2, ack))) {
+        cb->snd.wnd = tcp_snd_win(cb, hdr);
+        cb->snd.wl1 = seq;
+        cb->snd.wl2 = ack;
+        if (cb->snd.wnd) {
+            cb->rtx.persist = 0;
+        }
+    }
+}
+
+// 路径 MTU 变小之后，重传队列中的段可能超过现在的 MSS：只保留开头的 len 字节，剩下的部分（和 FIN）分成新的表项放在后面。
+// 原来的段超过了路径 MTU，没有到达对端，剩下的部分也按丢失处理
+static int
+tcp_txq_split (struct tcp_cb *cb, struct tcp_txq_entry *txq, uint32_t len) {
+    struct tcp_txq_entry *rest;
+    uint32_t head;
+
+    rest = tcp_txq_alloc(cb);
+    if (!rest) {
+        return -1;
+    }
+    head = len + (TCP_FLG_ISSET(txq->flg, TCP_FLG_SYN) ? 1 : 0);
+    rest->seq = txq->seq + head;
+    rest->slen = txq->slen - head;
+    rest->flg = txq->flg & ~TCP_FLG_SYN;
+    rest->timestamp = txq->timestamp;
+    rest->rexmt = txq->rexmt;
+    rest->lost = 1;
+    rest->next = txq->next;
+    txq->slen = head;
+    txq->flg &= ~(TCP_FLG_FIN | TCP_FLG_PSH);
+    txq->next = rest;
+    if (cb->txq.tail == txq) {
+        cb->txq.tail = rest;
+    }
+    return 0;
+}
+
+// 重传队列中的段：按当前的确认号和窗口从发送缓冲区中重新构造，超过现在的 MSS 时先切分。
+// 数据在缓冲区中的位置和 tcp_push() 中一样，SYN 还没有被确认时要减去 SYN 占用的序列号
+static void
+tcp_retransmit (struct tcp_cb *cb, struct tcp_txq_entry *txq) {
+    uint32_t off, len, mss;
+
+    len = txq->slen - (TCP_FLG_ISSET(txq->flg, TCP_FLG_SYN) ? 1 : 0) - (TCP_FLG_ISSET(txq->flg, TCP_FLG_FIN) ? 1 : 0);
+    mss = tcp_mss(cb);
+    if (len > mss && tcp_txq_split(cb, txq, mss) == 0) {
+        len = mss;
+    }
+    off = 0;
+    if (len) {
+        off = txq->seq - cb->snd.una - (cb->snd.una == cb->iss ? 1 : 0);
+    }
+    tcp_tx_segment(cb, txq->seq, TCP_FLG_ISSET(txq->flg, TCP_FLG_ACK) ? cb->rcv.nxt : 0, txq->flg, off, len);
+    txq->timestamp = ticks;
+    txq->rexmt = 1;
+    txq->lost = 0;
+    cb->total_retrans++;
+}
+
+// 在途的数据量（RFC 6675 中的 pipe）：已发送未确认的数据减去被判定丢失、还没有重传的段和已经被 SACK 的段
+static uint32_t
+tcp_pipe (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+    uint32_t pipe;
+
+    pipe = cb->snd.nxt - cb->snd.una;
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        if (txq->lost || txq->sacked) {
+            pipe -= txq->slen;
+        }
+    }
+    return pipe;
+}
+
+// 先按拥塞窗口重传超时后被判定丢失的段（第一个总是重传），再把发送缓冲区中还没有发送的数据按 MSS 切分发送出去。
+// 在途的数据不超过对端的窗口和拥塞窗口；close() 之后数据发完时再发送 FIN
+static void
+tcp_push (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+    uint32_t off, len, inflight, pipe, rwnd, usable;
+    uint8_t flg;
+
+    pipe = tcp_pipe(cb);
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        if (!txq->lost) {
+            continue;
+        }
+        if (txq != cb->txq.head && pipe + txq->slen > cb->cc.cwnd) {
+            return;
+        }
+        tcp_retransmit(cb, txq);
+        pipe += txq->slen;
+    }
+    if (cb->state == TCP_CB_STATE_SYN_SENT || cb->state == TCP_CB_STATE_SYN_RCVD) {
+        return;
+    }
+    cb->cc.mss = tcp_mss(cb);
+    while (!cb->snd.fin) {
+        inflight = cb->snd.nxt - cb->snd.una;
+        off = inflight;
+        if (cb->snd.una == cb->iss) {
+            /* SYN not acked yet */
+            off--;
+        }
+        rwnd = cb->snd.wnd > inflight ? cb->snd.wnd - inflight : 0;
+        usable = MIN(rwnd, cb->cc.cwnd > pipe ? cb->cc.cwnd - pipe : 0);
+        len = MIN(MIN(cb->sndbuf.len - off, cb->cc.mss), usable);
+        flg = TCP_FLG_ACK;
+        if (off + len == cb->sndbuf.len) {
+            if (TCP_CB_STATE_FIN_QUEUED(cb)) {
+                flg |= TCP_FLG_FIN;
+            } else if (!len) {
+                break;
+            }
+            if (len) {
+                flg |= TCP_FLG_PSH;
+            }
+        } else if (!len) {
+            // 对端的窗口用完了：有在途数据时等待确认，没有时启动持续定时器探测窗口；拥塞窗口用完时等待确认
+            if (!rwnd && !cb->txq.head && !cb->rtx.persist) {
+                cb->rtx.persist = 1;
+                cb->rtx.count = 0;
+                cb->rtx.probes = 0;
+                cb->rtx.expire = ticks + tcp_persist_interval(cb);
+            }
+            break;
+        }
+        // 小于 MSS 的段（RFC 1122 4.2.3.4）：有未确认的数据时等确认到达再发送（Nagle 算法，TCP_NODELAY 时不等）；
+        // TCP_CORK 时缓冲区中剩下的数据凑不满一个段就不发送。带 FIN 的段总是发送
+        if (len && len < cb->cc.mss && !TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+            if ((cb->cork && off + len == cb->sndbuf.len) || (!cb->nodelay && inflight)) {
+                break;
+            }
+        }
+        if (tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, flg, off, len) == -1) {
+            break;
+        }
+        cb->snd.nxt += len;
+        pipe += len;
+        if (TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+            cb->snd.nxt++;
+            cb->snd.fin = 1;
+        }
+    }
+}
+
+// RFC 6675 IsLost()：一个段之后被 SACK 的段不少于 DupThresh 个，或者被 SACK 的字节超过 (DupThresh - 1) * SMSS 时判定丢失。
+// mark 时把判定丢失、还没有重传过的段标记为 lost；返回第一个段是否判定丢失
+static int
+tcp_sack_lost (struct tcp_cb *cb, int mark) {
+    struct tcp_txq_entry *txq;
+    uint32_t bytes = 0;
+    int segs = 0, lost, head = 0;
+
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        if (txq->sacked) {
+            segs++;
+            bytes += txq->slen;
+        }
+    }
+    for (txq = cb->txq.head; txq && segs; txq = txq->next) {
+        if (txq->sacked) {
+            segs--;
+            bytes -= txq->slen;
+            continue;
+        }
+        lost = segs >= TCP_DUPTHRESH || bytes > (TCP_DUPTHRESH - 1) * cb->cc.mss;
+        if (txq == cb->txq.head) {
+            head = lost;
+        }
+        if (lost && mark && !txq->rexmt) {
+            txq->lost = 1;
+        }
+    }
+    return head;
+}
+
+// 进入快速恢复。使用 SACK 时窗口不膨胀，直接降到 ssthresh，判定丢失的段由 tcp_push() 在 pipe 允许时重传（RFC 6675 5）；
+// 否则立即重传第一个段，窗口膨胀三个 MSS（RFC 6582 3.2）
+static void
+tcp_recovery_enter (struct tcp_cb *cb) {
+    cb->cc.ssthresh = cb->cc.ops->ssthresh(&cb->cc, cb->snd.nxt - cb->snd.una);
+    cb->recover = cb->snd.nxt;
+    cb->recovery = 1;
+    if (cb->sack.ok) {
+        cb->cc.cwnd = cb->cc.ssthresh;
+        cb->txq.head->lost = 1;
+        tcp_sack_lost(cb, 1);
+        return;
+    }
+    tcp_retransmit(cb, cb->txq.head);
+    cb->cc.cwnd = cb->cc.ssthresh + 3 * cb->cc.mss;
+}
+
+// 确认了新数据：不在快速恢复中时由算法增长窗口；快速恢复中的部分确认立即重传下一个段并收缩窗口，
+// 完全确认时退出快速恢复（RFC 6582 3.2）。使用 SACK 时部分确认只把下一个段标记为丢失，由 tcp_push() 重传
+static void
+tcp_newack (struct tcp_cb *cb, uint32_t acked) {
+    cb->dupacks = 0;
+    if (!cb->cc.mss) {
+        return;
+    }
+    if (!cb->recovery) {
+        cb->cc.ops->cong_avoid(&cb->cc, acked);
+        return;
+    }
+    if (TCP_SEQ_LEQ(cb->recover, cb->snd.una)) {
+        cb->cc.cwnd = MIN(cb->cc.ssthresh, MAX(cb->snd.nxt - cb->snd.una, cb->cc.mss) + cb->cc.mss);
+        cb->recovery = 0;
+        return;
+    }
+    if (cb->sack.ok) {
+        if (cb->txq.head && !cb->txq.head->rexmt && !cb->txq.head->sacked) {
+            cb->txq.head->lost = 1;
+        }
+        return;
+    }
+    if (cb->txq.head) {
+        tcp_retransmit(cb, cb->txq.head);
+    }
+    cb->cc.cwnd = cb->cc.cwnd > acked ? cb->cc.cwnd - acked : 0;
+    if (acked >= cb->cc.mss) {
+        cb->cc.cwnd += cb->cc.mss;
+    }
+    cb->cc.cwnd = MAX(cb->cc.cwnd, cb->cc.mss);
+}
+
+// 第三个重复 ACK 触发快速重传并进入快速恢复，之后每个重复 ACK 表示有一个段离开了网络，窗口膨胀一个 MSS
+// （使用 SACK 时由 pipe 计算在途的数据，不膨胀）。上一次快速恢复或超时覆盖的范围内不再重复进入（RFC 6582 3.2 step 2）
+static void
+tcp_dupack (struct tcp_cb *cb) {
+    if (!cb->cc.mss || !cb->txq.head) {
+        return;
+    }
+    if (cb->dupacks < 255) {
+        cb->dupacks++;
+    }
+    if (cb->recovery) {
+        if (cb->dupacks > 3 && !cb->sack.ok) {
+            cb->cc.cwnd += cb->cc.mss;
+        }
+        return;
+    }
+    if (cb->dupacks != TCP_DUPTHRESH || !TCP_SEQ_LT(cb->recover, cb->snd.una)) {
+        return;
+    }
+    tcp_recovery_enter(cb);
+}
+
+// ACK 中的 SACK 块（只看 snd.una 和 snd.nxt 之间的）完全覆盖的段标记为 sacked
+static void
+tcp_sack_rx (struct tcp_cb *cb, struct tcp_opts *opts) {
+    struct tcp_txq_entry *txq;
+    uint32_t left, right;
+    int n;
+
+    if (!cb->cc.mss || !cb->txq.head) {
+        return;
+    }
+    for (n = 0; n < opts->sack_num; n++) {
+        left = ntoh32(*(uint32_t *)(opts->sack + 8 * n));
+        right = ntoh32(*(uint32_t *)(opts->sack + 8 * n + 4));
+        if (!TCP_SEQ_LT(left, right) || TCP_SEQ_LT(left, cb->snd.una) || TCP_SEQ_LT(cb->snd.nxt, right)) {
+            continue;
+        }
+        for (txq = cb->txq.head; txq; txq = txq->next) {
+            if (TCP_SEQ_LEQ(left, txq->seq) && TCP_SEQ_LEQ(txq->seq + txq->slen, right)) {
+                txq->sacked = 1;
+                txq->lost = 0;
+            }
+        }
+    }
+}
+
+// 处理完 ACK 之后：快速恢复中按新的 SACK 信息判定丢失的段；
+// 不在快速恢复中时第一个段判定丢失也进入快速恢复，不用等到第三个重复 ACK（RFC 6675 5 step 4）
+static void
+tcp_sack_recover (struct tcp_cb *cb) {
+    if (!cb->cc.mss || !cb->txq.head) {
+        return;
+    }
+    if (cb->recovery) {
+        tcp_sack_lost(cb, 1);
+    } else if (TCP_SEQ_LT(cb->recover, cb->snd.una) && tcp_sack_lost(cb, 0)) {
+        tcp_recovery_enter(cb);
+    }
+}
+
+// 连接建立、MSS 确定之后开始拥塞控制
+static void
+tcp_cc_establish (struct tcp_cb *cb) {
+    tcp_cc_start(&cb->cc, tcp_mss(cb));
+    cb->recover = cb->iss;
+}
+
+// 回复没有对应控制块的段（RFC 793 3.4 Reset Generation），不占用控制块也不进入重传队列
+static void
+tcp_tx_reset (struct netif *iface, const void *peer, struct tcp_hdr *in, size_t len) {
+    struct tcp_hdr hdr;
+    struct netvec vec;
+    uint32_t ack;
+
+    if (TCP_FLG_ISSET(in->flg, TCP_FLG_RST)) {
+        return;
+    }
+    if (!ratelimit_check(&rst_ratelimit)) {
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.src = in->dst;
+    hdr.dst = in->src;
+    hdr.off = (sizeof(struct tcp_hdr) >> 2) << 4;
+    if (TCP_FLG_ISSET(in->flg, TCP_FLG_ACK)) {
+        hdr.seq = in->ack;
+        hdr.flg = TCP_FLG_RST;
+    } else {
+        ack = ntoh32(in->seq) + (len - ((in->off >> 4) << 2));
+        if (TCP_FLG_ISSET(in->flg, TCP_FLG_SYN)) {
+            ack++;
+        }
+        if (TCP_FLG_ISSET(in->flg, TCP_FLG_FIN)) {
+            ack++;
+        }
+        hdr.ack = hton32(ack);
+        hdr.flg = TCP_FLG_RST | TCP_FLG_ACK;
+    }
+    hdr.sum = cksum16((uint16_t *)&hdr, sizeof(struct tcp_hdr), tcp_pseudo_sum(iface, peer, sizeof(struct tcp_hdr)));
+    vec.base = (uint8_t *)&hdr;
+    vec.len = sizeof(struct tcp_hdr);
+    tcp_output(iface, peer, &vec, 1);
+}
+
+// 连接被对端或网络中止：唤醒阻塞在 connect/recv/close 上的进程，由它们返回错误
+static void
+tcp_cb_abort (struct tcp_cb *cb) {
+    if (cb->state == TCP_CB_STATE_SYN_RCVD && cb->parent) {
+        /* not accepted yet */
+        tcp_cb_free(cb);
+        return;
+    }
+    tcp_txq_flush(cb);
+    cb->rtx.persist = 0;
+    tcp_delack_clear(cb);
+    cb->state = TCP_CB_STATE_CLOSED;
+    cb->err = 1;
+    wakeup(cb);
+}
+
+// 超过现在的 MSS 的段（没有被 SACK 的）判定丢失，按拥塞窗口切分后重传
+static void
+tcp_mtu_reduced (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+    uint32_t mss, len;
+    int lost = 0;
+
+    if (!cb->iface || cb->state == TCP_CB_STATE_SYN_SENT || cb->state == TCP_CB_STATE_SYN_RCVD) {
+        return;
+    }
+    mss = tcp_mss(cb);
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        len = txq->slen - (TCP_FLG_ISSET(txq->flg, TCP_FLG_SYN) ? 1 : 0) - (TCP_FLG_ISSET(txq->flg, TCP_FLG_FIN) ? 1 : 0);
+        if (len > mss && !txq->sacked) {
+            txq->lost = 1;
+            lost = 1;
+        }
+    }
+    if (lost) {
+        tcp_push(cb);
+    }
+}
+
+// 时钟中断中调用：超时后重传最早的未确认段并把 RTO 加倍（RFC 6298 5.4 - 5.6），重传次数用完时中止连接。
+// 持续定时器到期时发送序列号为 snd.una - 1 的空段，对端会用携带当前窗口的 ACK 回应；
+// 对端一直在回应，所以探测不计入重传次数，也不会中止连接（RFC 1122 4.2.2.17）
+static void
+tcp_timer_expire (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+    int max;
+
+    if (cb->rtx.persist) {
+        // 应用程序已经 close()，对端一直不打开窗口的话 FIN 永远发不出去，探测一定次数后放弃
+        if (TCP_CB_STATE_FIN_QUEUED(cb) && ++cb->rtx.probes > TCP_PERSIST_FIN_MAX) {
+            tcp_cb_abort(cb);
+            return;
+        }
+        tcp_tx(cb, cb->snd.una - 1, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+        if (cb->rtx.count < TCP_PERSIST_SHIFT_MAX) {
+            cb->rtx.count++;
+        }
+        cb->rtx.expire = ticks + tcp_persist_interval(cb);
+        return;
+    }
+    if (!cb->txq.head) {
+        return;
+    }
+    max = (cb->state == TCP_CB_STATE_SYN_SENT || cb->state == TCP_CB_STATE_SYN_RCVD) ? TCP_SYN_RETRANSMIT_MAX : TCP_RETRANSMIT_MAX;
+    if (cb->rtx.count >= max || !cb->iface) {
+        tcp_cb_abort(cb);
+        return;
+    }
+    // 超时表示在途的段都丢失了：窗口降到一个 MSS，按慢启动依次重传（go-back-N）。
+    // 同一个段连续超时时 ssthresh 保持不变（RFC 5681 3.1）
+    if (cb->cc.mss) {
+        if (!cb->rtx.count) {
+            cb->cc.ssthresh = cb->cc.ops->ssthresh(&cb->cc, cb->snd.nxt - cb->snd.una);
+        }
+        cb->cc.cwnd = cb->cc.mss;
+    }
+    cb->recovery = 0;
+    cb->dupacks = 0;
+    cb->recover = cb->snd.nxt;
+    // 对端可能丢弃已经 SACK 的数据，超时后不再相信之前的 SACK 信息（RFC 2018 8）
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        txq->lost = 1;
+        txq->sacked = 0;
+    }
+    cb->rtx.count++;
+    cb->rtx.rto = MIN(cb->rtx.rto << 1, TCP_RTO_MAX);
+    tcp_push(cb);
+    cb->rtx.expire = ticks + cb->rtx.rto;
+}
+
+// 重传（持续）定时器或者延迟 ACK 定时器到期
+static int
+tcp_timer_due (struct tcp_cb *cb) {
+    if ((cb->txq.head || cb->rtx.persist) && (int32_t)(ticks - cb->rtx.expire) >= 0) {
+        return 1;
+    }
+    return cb->delack.pending && (int32_t)(ticks - cb->delack.expire) >= 0;
+}
+
+// 定时器只对连接有意义，监听和只绑定了端口的控制块不在 conn_hash 中。
+// 每个桶中到期的控制块先取出来（持有引用）再逐个加锁处理，一次处理不完的留到下一个 tick
+static void
+tcp_timer (void) {
+    struct tcp_cb *cb, *expired[TCP_TIMER_BATCH];
+    int n, num, i;
+
+    for (n = 0; n < TCP_CONN_HASH_SIZE; n++) {
+        // 空桶不加锁：刚加入的控制块的定时器还没有到期，下一个 tick 再看
+        if (!conn_hash[n].head) {
+            continue;
+        }
+        num = 0;
+        acquire(&conn_hash[n].lock);
+        for (cb = conn_hash[n].head; cb && num < TCP_TIMER_BATCH; cb = cb->hnext) {
+            if (tcp_timer_due(cb)) {
+                tcp_cb_ref(cb);
+                expired[num++] = cb;
+            }
+        }
+        release(&conn_hash[n].lock);
+        for (i = 0; i < num; i++) {
+            cb = tcp_cb_lock(expired[i]);
+            if (!cb) {
+                continue;
+            }
+            // 中止的连接（tcp_netif_detach() 之后没有接口）不再发送任何段
+            if (cb->state == TCP_CB_STATE_CLOSED || !cb->iface) {
+                tcp_cb_unlock(cb);
+                continue;
+            }
+            if (cb->delack.pending && (int32_t)(ticks - cb->delack.expire) >= 0) {
+                tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+            }
+            if ((int32_t)(ticks - cb->rtx.expire) >= 0) {
+                tcp_timer_expire(cb);
+            }
+            tcp_cb_unlock(cb);
+        }
+    }
+}
+
+// 接收缓冲区中从 head 开始 off 字节处写入 len 字节，需要的页在这里分配；分配失败时什么也不写
+static int
+tcp_rcvbuf_write (struct tcp_cb *cb, uint32_t off, const uint8_t *data, size_t len) {
+    uint32_t pos;
+    size_t done, n;
+
+    for (done = 0; done < len; done += n) {
+        pos = (cb->rcvbuf.head + off + done) % TCP_RCVBUF_MAX;
+        n = MIN(len - done, PGSIZE - pos % PGSIZE);
+        if (!cb->rcvbuf.pages[pos / PGSIZE] && !(cb->rcvbuf.pages[pos / PGSIZE] = (uint8_t *)kalloc())) {
+            return -1;
+        }
+    }
+    for (done = 0; done < len; done += n) {
+        pos = (cb->rcvbuf.head + off + done) % TCP_RCVBUF_MAX;
+        n = MIN(len - done, PGSIZE - pos % PGSIZE);
+        memcpy(cb->rcvbuf.pages[pos / PGSIZE] + pos % PGSIZE, data + done, n);
+    }
+    return 0;
+}
+
+// 应用程序读走开头的 len 字节；读完的页不再有数据（包括乱序数据）时释放
+static void
+tcp_rcvbuf_read (struct tcp_cb *cb, uint8_t *buf, size_t len, uint32_t ooo) {
+    uint32_t pos, extent;
+    size_t done, n;
+
+    for (done = 0; done < len; done += n) {
+        pos = cb->rcvbuf.head;
+        n = MIN(len - done, PGSIZE - pos % PGSIZE);
+        memcpy(buf + done, cb->rcvbuf.pages[pos / PGSIZE] + pos % PGSIZE, n);
+        cb->rcvbuf.head = (pos + n) % TCP_RCVBUF_MAX;
+        cb->rcvbuf.len -= n;
+        extent = cb->rcvbuf.len + ooo;
+        if (cb->rcvbuf.head % PGSIZE == 0 && (pos - pos % PGSIZE - cb->rcvbuf.head) % TCP_RCVBUF_MAX >= extent) {
+            kfree((char*)cb->rcvbuf.pages[pos / PGSIZE]);
+            cb->rcvbuf.pages[pos / PGSIZE] = NULL;
+        }
+    }
+}
+
+// 接收缓冲区的上限改为 size。窗口不能收缩（RFC 793 3.7），已经缓存的数据也要放得下，所以只在不小于已经通告的部分时缩小
+static void
+tcp_rcvbuf_resize (struct tcp_cb *cb, uint32_t size) {
+    if (cb->state != TCP_CB_STATE_CLOSED && cb->state != TCP_CB_STATE_LISTEN && size < cb->rcvbuf.size) {
+        return;
+    }
+    cb->rcvbuf.size = size;
+    cb->rcv.wnd = size - cb->rcvbuf.len;
+}
+
+// 自动调整（类似 Linux 的 DRS）：每个 RTT 统计应用程序读走的数据量，缓冲区小于它的 2 倍时扩大，
+// 让接收窗口跟上带宽时延积。只有接收数据的一端没有新的 RTT 样本，使用握手时测得的 RTT
+static void
+tcp_rcvbuf_autotune (struct tcp_cb *cb, size_t copied) {
+    uint32_t rtt, want, cap;
+
+    if (cb->rcvbuf.locked) {
+        return;
+    }
+    cb->rcvbuf.copied += copied;
+    rtt = MAX(cb->rtx.srtt >> 3, 1);
+    if (ticks - cb->rcvbuf.epoch < rtt) {
+        return;
+    }
+    // 不使用窗口缩放时通告的窗口最大 64KB，更大的缓冲区没有意义
+    cap = cb->rcv.wscale ? TCP_RCVBUF_MAX : 0xffff;
+    want = MIN(PGROUNDUP(2 * cb->rcvbuf.copied), cap);
+    if (want > cb->rcvbuf.size) {
+        tcp_rcvbuf_resize(cb, want);
+    }
+    cb->rcvbuf.copied = 0;
+    cb->rcvbuf.epoch = ticks;
+}
+
+// 段是否有一部分落在接收窗口内（RFC 793 3.9）。窗口为 0 时序列号正好是 rcv.nxt 的段也受理，以便处理其中的 ACK 和 RST
+static int
+tcp_seq_acceptable (struct tcp_cb *cb, uint32_t seq, uint32_t slen) {
+    if (!cb->rcv.wnd) {
+        return seq == cb->rcv.nxt;
+    }
+    if (!slen) {
+        return TCP_SEQ_LEQ(cb->rcv.nxt, seq) && TCP_SEQ_LT(seq, cb->rcv.nxt + cb->rcv.wnd);
+    }
+    return TCP_SEQ_LT(seq, cb->rcv.nxt + cb->rcv.wnd) && TCP_SEQ_LT(cb->rcv.nxt, seq + slen);
+}
+
+// 乱序数据占用的接收缓冲区（从 rcv.nxt 到最后一个区间的末尾）
+static uint32_t
+tcp_ooo_len (struct tcp_cb *cb) {
+    if (!cb->ooo.num) {
+        return 0;
+    }
+    return cb->ooo.blk[cb->ooo.num - 1].end - cb->rcv.nxt;
+}
+
+// 记录收到的区间 [seq, end)，和已有的区间重叠或相邻时合并。区间表满时不记录，数据等对端重传
+static void
+tcp_ooo_add (struct tcp_cb *cb, uint32_t seq, uint32_t end) {
+    int i, j;
+
+    for (i = 0; i < cb->ooo.num && TCP_SEQ_LT(cb->ooo.blk[i].end, seq); i++);
+    if (i < cb->ooo.num && TCP_SEQ_LEQ(cb->ooo.blk[i].seq, end)) {
+        if (TCP_SEQ_LT(seq, cb->ooo.blk[i].seq)) {
+            cb->ooo.blk[i].seq = seq;
+        }
+        if (TCP_SEQ_LT(cb->ooo.blk[i].end, end)) {
+            cb->ooo.blk[i].end = end;
+        }
+        // 新的区间可能填上了后面几个区间之间的空洞
+        for (j = i + 1; j < cb->ooo.num && TCP_SEQ_LEQ(cb->ooo.blk[j].seq, cb->ooo.blk[i].end); j++) {
+            if (TCP_SEQ_LT(cb->ooo.blk[i].end, cb->ooo.blk[j].end)) {
+                cb->ooo.blk[i].end = cb->ooo.blk[j].end;
+            }
+        }
+        memmove(&cb->ooo.blk[i + 1], &cb->ooo.blk[j], (cb->ooo.num - j) * sizeof(cb->ooo.blk[0]));
+        cb->ooo.num -= j - (i + 1);
+        return;
+    }
+    if (cb->ooo.num == TCP_OOO_BLOCKS) {
+        return;
+    }
+    memmove(&cb->ooo.blk[i + 1], &cb->ooo.blk[i], (cb->ooo.num - i) * sizeof(cb->ooo.blk[0]));
+    cb->ooo.blk[i].seq = seq;
+    cb->ooo.blk[i].end = end;
+    cb->ooo.num++;
+}
+
+// 数据拷贝到接收缓冲区中 seq 对应的位置，调用者保证在窗口内。
+// 按序到达时 rcv.nxt 前进，并把因此变得连续的乱序区间一起交给应用程序
+static int
+tcp_rcv_data (struct tcp_cb *cb, uint32_t seq, const uint8_t *data, size_t len) {
+    uint32_t nxt;
+
+    if (tcp_rcvbuf_write(cb, cb->rcvbuf.len + (seq - cb->rcv.nxt), data, len) == -1) {
+        return -1;
+    }
+    if (seq != cb->rcv.nxt) {
+        tcp_ooo_add(cb, seq, seq + len);
+        cb->sack.recent = seq;
+        return 0;
+    }
+    nxt = seq + len;
+    while (cb->ooo.num && TCP_SEQ_LEQ(cb->ooo.blk[0].seq, nxt)) {
+        if (TCP_SEQ_LT(nxt, cb->ooo.blk[0].end)) {
+            nxt = cb->ooo.blk[0].end;
+        }
+        cb->ooo.num--;
+        memmove(&cb->ooo.blk[0], &cb->ooo.blk[1], cb->ooo.num * sizeof(cb->ooo.blk[0]));
+    }
+    cb->rcv.wnd -= nxt - cb->rcv.nxt;
+    cb->rcvbuf.len += nxt - cb->rcv.nxt;
+    cb->rcv.nxt = nxt;
+    return 0;
+}
+
+// 按序收到了 len 字节的数据（RFC 1122 4.2.3.2）：快速 ACK 模式中、累计到两个整段、填补了乱序的空洞（RFC 5681 4.2）
+// 或者剩下的窗口不到两个段时立即确认，否则等延迟 ACK 定时器
+static void
+tcp_ack_schedule (struct tcp_cb *cb, uint32_t len, int filled) {
+    int now = filled;
+
+    cb->delack.rcv_mss = MAX(cb->delack.rcv_mss, len);
+    cb->delack.rcvd += len;
+    if (cb->delack.quick) {
+        cb->delack.quick--;
+        now = 1;
+    }
+    if (now || cb->delack.rcvd >= 2 * cb->delack.rcv_mss || cb->rcv.wnd < 2 * cb->delack.rcv_mss) {
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+        return;
+    }
+    if (!cb->delack.pending) {
+        cb->delack.pending = 1;
+        cb->delack.expire = ticks + TCP_DELACK_TIMEOUT;
+    }
+}
+
+static void
+tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
+    struct tcp_opts opts;
+    uint32_t seq, ack, acked, off;
+    size_t hlen, plen, dlen;
+    uint8_t *data;
+    int filled;
 
     hlen = ((hdr->off >> 4) << 2);
     plen = len - hlen;
+    tcp_parse_options(hdr, &opts);
     switch (cb->state) {
         case TCP_CB_STATE_CLOSED:
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
@@ -280,7 +1802,7 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
                     ack++;
                 }
             }
-            tcp_tx(cb, seq, ack, TCP_FLG_RST, NULL, 0);
+            tcp_tx(cb, seq, ack, TCP_FLG_RST, 0, 0);
             return;
         case TCP_CB_STATE_LISTEN:
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
@@ -289,16 +1811,20 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
                 seq = ntoh32(hdr->ack);
                 ack = 0;
-                tcp_tx(cb, seq, ack, TCP_FLG_RST, NULL, 0);
+                tcp_tx(cb, seq, ack, TCP_FLG_RST, 0, 0);
                 return;
             }
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
                 cb->rcv.nxt = ntoh32(hdr->seq) + 1;
                 cb->irs = ntoh32(hdr->seq);
-                cb->iss = (uint32_t)random();
+                tcp_syn_options(cb, &opts);
+                cb->snd.wnd = tcp_snd_win(cb, hdr);
+                cb->snd.wl1 = ntoh32(hdr->seq);
+                cb->iss = urandom();
+                cb->ts.offset = urandom();
                 seq = cb->iss;
                 ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                tcp_tx(cb, seq, ack, TCP_FLG_SYN | TCP_FLG_ACK, 0, 0);
                 cb->snd.nxt = cb->iss + 1;
                 cb->snd.una = cb->iss;
                 cb->state = TCP_CB_STATE_SYN_RCVD;
@@ -306,49 +1832,94 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
             return;
         case TCP_CB_STATE_SYN_SENT:
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-                if (ntoh32(hdr->ack) <= cb->iss || ntoh32(hdr->ack) > cb->snd.nxt) {
+                if (TCP_SEQ_LEQ(ntoh32(hdr->ack), cb->iss) || TCP_SEQ_LT(cb->snd.nxt, ntoh32(hdr->ack))) {
                     if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
                         seq = ntoh32(hdr->ack);
                         ack = 0;
-                        tcp_tx(cb, seq, ack, TCP_FLG_RST, NULL, 0);
+                        tcp_tx(cb, seq, ack, TCP_FLG_RST, 0, 0);
                     }
                     return;
                 }
             }
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
                 if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-                    // TCB close
+                    /* connection refused */
+                    tcp_cb_abort(cb);
                 }
                 return;
             }
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
                 cb->rcv.nxt = ntoh32(hdr->seq) + 1;
                 cb->irs = ntoh32(hdr->seq);
+                tcp_syn_options(cb, &opts);
                 if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
                     cb->snd.una = ntoh32(hdr->ack);
-                    // delete TX queue
-                    if (cb->snd.una > cb->iss) {
+                    cb->snd.wnd = tcp_snd_win(cb, hdr);
+                    cb->snd.wl1 = ntoh32(hdr->seq);
+                    cb->snd.wl2 = ntoh32(hdr->ack);
+                    tcp_txq_ack(cb, &opts);
+                    if (TCP_SEQ_LT(cb->iss, cb->snd.una)) {
                         cb->state = TCP_CB_STATE_ESTABLISHED;
+                        tcp_cc_establish(cb);
+                        cb->delack.quick = TCP_QUICKACK_SEGS;
                         seq = cb->snd.nxt;
                         ack = cb->rcv.nxt;
-                        tcp_tx(cb, seq, ack, TCP_FLG_ACK, NULL, 0);
+                        tcp_tx(cb, seq, ack, TCP_FLG_ACK, 0, 0);
                         wakeup(cb);
                     }
                     return;
                 }
                 seq = cb->iss;
                 ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_ACK, NULL, 0);
+                tcp_tx(cb, seq, ack, TCP_FLG_ACK, 0, 0);
             }
             return;
         default:
             break;
     }
-    if (ntoh32(hdr->seq) != cb->rcv.nxt) {
-        // TODO
+    seq = ntoh32(hdr->seq);
+    // PAWS（RFC 7323 5.3）：TSval 比 TS.Recent 旧的段是序列号回绕之前的旧段，和窗口外的段一样回复 ACK 后丢弃。
+    // 超过 24 天没有更新的 TS.Recent 不再可信，不做检查
+    if (cb->ts.ok && opts.ts && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST) && (int32_t)(opts.tsval - cb->ts.recent) < 0 &&
+        (int32_t)(ticks - cb->ts.recent_age) < TCP_PAWS_IDLE) {
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+        return;
+    }
+    if (!tcp_seq_acceptable(cb, seq, plen + (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN) ? 1 : 0))) {
+        if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+        }
+        return;
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+        if (seq != cb->rcv.nxt) {
+            /* challenge ACK (RFC 5961 3.2) */
+            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+            return;
+        }
+        /* connection reset */
+        tcp_cb_abort(cb);
         return;
     }
-    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST | TCP_FLG_SYN)) {
+    // 回显的 TSval 只从覆盖了 Last.ACK.sent 的段中取，对端延迟 ACK 或者有丢包时回显的是较早的时间，RTT 不会被低估（RFC 7323 4.3）
+    if (cb->ts.ok && opts.ts && TCP_SEQ_LEQ(seq, cb->ts.last_ack) && (int32_t)(opts.tsval - cb->ts.recent) >= 0) {
+        cb->ts.recent = opts.tsval;
+        cb->ts.recent_age = ticks;
+    }
+    // 去掉已经收到过的开头部分和超出窗口的末尾部分（超出窗口时 FIN 也不受理）
+    data = (uint8_t *)hdr + hlen;
+    dlen = plen;
+    if (TCP_SEQ_LT(seq, cb->rcv.nxt)) {
+        off = cb->rcv.nxt - seq;
+        data += off;
+        dlen -= off;
+        seq = cb->rcv.nxt;
+    }
+    if (dlen > cb->rcv.wnd - (seq - cb->rcv.nxt)) {
+        dlen = cb->rcv.wnd - (seq - cb->rcv.nxt);
+        hdr->flg &= ~TCP_FLG_FIN;
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
         // TODO
         return;
     }
@@ -358,12 +1929,22 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     }
     switch (cb->state) {
         case TCP_CB_STATE_SYN_RCVD:
-            if (cb->snd.una <= ntoh32(hdr->ack) && ntoh32(hdr->ack) <= cb->snd.nxt) {
+            if (TCP_SEQ_LEQ(cb->snd.una, ntoh32(hdr->ack)) && TCP_SEQ_LEQ(ntoh32(hdr->ack), cb->snd.nxt)) {
                 cb->state = TCP_CB_STATE_ESTABLISHED;
-                queue_push(&cb->parent->backlog, cb, sizeof(*cb));
-                wakeup(cb->parent);
+                tcp_cc_establish(cb);
+                cb->delack.quick = TCP_QUICKACK_SEGS;
+                cb->snd.wnd = tcp_snd_win(cb, hdr);
+                cb->snd.wl1 = ntoh32(hdr->seq);
+                cb->snd.wl2 = ntoh32(hdr->ack);
+                // backlog 中的表项持有一个引用，accept() 之前连接被中止的话在那里跳过
+                acquire(&tablelock);
+                if (queue_push(&cb->parent->backlog, cb, sizeof(*cb))) {
+                    tcp_cb_ref(cb);
+                    wakeup(cb->parent);
+                }
+                release(&tablelock);
             } else {
-                tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
+                tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, 0, 0);
                 break;
             }
         case TCP_CB_STATE_ESTABLISHED:
@@ -371,15 +1952,36 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         case TCP_CB_STATE_FIN_WAIT2:
         case TCP_CB_STATE_CLOSE_WAIT:
         case TCP_CB_STATE_CLOSING:
-            if (cb->snd.una < ntoh32(hdr->ack) && ntoh32(hdr->ack) <= cb->snd.nxt) {
+        case TCP_CB_STATE_LAST_ACK:
+            if (cb->sack.ok && TCP_SEQ_LEQ(ntoh32(hdr->ack), cb->snd.nxt)) {
+                tcp_sack_rx(cb, &opts);
+            }
+            if (TCP_SEQ_LT(cb->snd.una, ntoh32(hdr->ack)) && TCP_SEQ_LEQ(ntoh32(hdr->ack), cb->snd.nxt)) {
+                acked = ntoh32(hdr->ack) - cb->snd.una;
+                tcp_sndbuf_ack(cb, acked);
                 cb->snd.una = ntoh32(hdr->ack);
-            } else if (ntoh32(hdr->ack) > cb->snd.nxt) {
-                tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+                tcp_txq_ack(cb, &opts);
+                tcp_newack(cb, acked);
+                // 发送缓冲区有了空间
+                wakeup(cb);
+            } else if (TCP_SEQ_LT(cb->snd.nxt, ntoh32(hdr->ack))) {
+                tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
                 return;
+            } else if (ntoh32(hdr->ack) == cb->snd.una && cb->snd.nxt != cb->snd.una && !plen &&
+                       !TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN | TCP_FLG_FIN) && tcp_snd_win(cb, hdr) == cb->snd.wnd) {
+                tcp_dupack(cb);
+            }
+            if (cb->sack.ok) {
+                tcp_sack_recover(cb);
             }
+            if (TCP_SEQ_LEQ(cb->snd.una, ntoh32(hdr->ack))) {
+                tcp_wnd_update(cb, hdr);
+            }
+            // 确认和窗口更新都可能让更多的数据进入窗口
+            tcp_push(cb);
             // send window update
             if (cb->state == TCP_CB_STATE_FIN_WAIT1) {
-                if (ntoh32(hdr->ack) == cb->snd.nxt) {
+                if (cb->snd.fin && ntoh32(hdr->ack) == cb->snd.nxt) {
                     cb->state = TCP_CB_STATE_FIN_WAIT2;
                 }
             } else if (cb->state == TCP_CB_STATE_CLOSING) {
@@ -388,24 +1990,41 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
                     wakeup(cb);
                 }
                 return;
+            } else if (cb->state == TCP_CB_STATE_LAST_ACK) {
+                if (cb->snd.fin && ntoh32(hdr->ack) == cb->snd.nxt) {
+                    wakeup(cb);
+                    tcp_cb_clear(cb); /* TCP_CB_STATE_CLOSED */
+                }
+                return;
             }
             break;
-        case TCP_CB_STATE_LAST_ACK:
-            wakeup(cb);
-            tcp_cb_clear(cb); /* TCP_CB_STATE_CLOSED */
-            return;
     }
-    if (plen) {
+    if (seq != cb->rcv.nxt) {
+        /* out of order */
+        if (dlen && TCP_CB_STATE_RX_ISREADY(cb)) {
+            tcp_rcv_data(cb, seq, data, dlen);
+        }
+        // 立即发送重复 ACK，让对端尽早快速重传（RFC 5681 4.2）；乱序段中的 FIN 等对端重传。
+        // 对端恢复期间（慢启动）的段也都立即确认
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+        cb->delack.quick = TCP_QUICKACK_SEGS;
+        return;
+    }
+    if (dlen) {
         switch (cb->state) {
             case TCP_CB_STATE_ESTABLISHED:
             case TCP_CB_STATE_FIN_WAIT1:
             case TCP_CB_STATE_FIN_WAIT2:
-                memcpy(cb->window + (sizeof(cb->window) - cb->rcv.wnd), (uint8_t *)hdr + hlen, plen);
-                cb->rcv.nxt = ntoh32(hdr->seq) + plen;
-                cb->rcv.wnd -= plen;
-                seq = cb->snd.nxt;
-                ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_ACK, NULL, 0);
+                filled = cb->ooo.num;
+                if (tcp_rcv_data(cb, seq, data, dlen) == -1) {
+                    /* out of memory: the peer will retransmit */
+                    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+                    return;
+                }
+                // FIN 在下面立即确认，数据一起确认
+                if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+                    tcp_ack_schedule(cb, dlen, filled);
+                }
                 wakeup(cb);
                 break;
             default:
@@ -414,7 +2033,7 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     }
     if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
         cb->rcv.nxt++;
-        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
         switch (cb->state) {
             case TCP_CB_STATE_SYN_RCVD:
             case TCP_CB_STATE_ESTABLISHED:
@@ -436,81 +2055,252 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     return;
 }
 
+// IPv4/IPv6 共用的接收处理，pseudo 是伪首部的部分和，src 根据 iface 的 family 指向 ip_addr_t 或 ip6_addr_t
 static void
-tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+tcp_input (uint8_t *segment, size_t len, uint32_t pseudo, const void *src, struct netif *iface) {
     struct tcp_hdr *hdr;
-    uint32_t pseudo = 0;
-    struct tcp_cb *cb, *fcb = NULL, *lcb = NULL; // fcb 监听状态的 TCP 控制块的指针，lcb 是指向监听状态的 TCP 控制块的指针
+    struct tcp_cb *cb, *lcb; // lcb 是收到 SYN 的监听状态的 TCP 控制块
 
-    if (*dst != ((struct netif_ip *)iface)->unicast) {
-        return;
-    }
     if (len < sizeof(struct tcp_hdr)) {
         return;
     }
     hdr = (struct tcp_hdr *)segment;
+    if (cksum16((uint16_t *)hdr, len, pseudo) != 0) {
+        cprintf("tcp checksum error!\n");
+        return;
+    }
+    cb = tcp_cb_lookup(iface, hdr->dst, src, hdr->src);
+    if (cb) {
+        // 等锁的时候连接被释放了就丢弃这个段，对端会重传
+        if (tcp_cb_lock(cb)) {
+            tcp_incoming_event(cb, hdr, len);
+            tcp_cb_unlock(cb);
+        }
+        return;
+    }
+    if (!TCP_FLG_IS(hdr->flg, TCP_FLG_SYN) || !(lcb = tcp_listener_lookup(iface, hdr->dst))) {
+        tcp_tx_reset(iface, src, hdr, len);
+        return;
+    }
+    if (!tcp_cb_lock(lcb)) {
+        return;
+    }
+    if (lcb->state != TCP_CB_STATE_LISTEN) {
+        tcp_cb_unlock(lcb);
+        return;
+    }
+    // 同一个连接的 SYN 同时在另一个 CPU 上处理时，两边都持有 lcb->lock，只有先加入哈希表的一方建立子连接
+    cb = tcp_cb_lookup(iface, hdr->dst, src, hdr->src);
+    if (cb) {
+        tcp_cb_put(cb);
+        tcp_cb_unlock(lcb);
+        return;
+    }
+    acquire(&tablelock);
+    // 握手中和等待 accept() 的子连接达到 backlog 时丢弃 SYN，防止 SYN flood 耗尽内存，对端会重传
+    cb = lcb->nchildren < lcb->maxchildren ? (struct tcp_cb *)slab_alloc(&cb_slab) : NULL;
+    release(&tablelock);
+    if (!cb) {
+        // 监听套接字收到 SYN 但内存不足时直接丢弃，让对端重传
+        tcp_cb_unlock(lcb);
+        return;
+    }
+    initlock(&cb->lock, "tcpcb");
+    cb->refs = 2; /* the hash table and us */
+    cb->desc = -1;
+    cb->state = lcb->state;
+    cb->family = lcb->family;
+    cb->iface = iface;
+    cb->port = lcb->port;
+    if (cb->family == AF_INET6) {
+        cb->peer.addr6 = *(const ip6_addr_t *)src;
+    } else {
+        cb->peer.addr = *(const ip_addr_t *)src;
+    }
+    cb->peer.port = hdr->src;
+    cb->rcvbuf.size = lcb->rcvbuf.size;
+    cb->rcvbuf.locked = lcb->rcvbuf.locked;
+    cb->sndbuf.size = lcb->sndbuf.size;
+    cb->sndbuf.locked = lcb->sndbuf.locked;
+    cb->rcv.wnd = cb->rcvbuf.size;
+    cb->rtx.rto = TCP_RTO_INIT;
+    cb->cc.ops = lcb->cc.ops;
+    cb->nodelay = lcb->nodelay;
+    cb->cork = lcb->cork;
+    cb->parent = lcb;
+    acquire(&cb->lock);
+    acquire(&tablelock);
+    tcp_cb_hash(cb);
+    cb->sibling = lcb->children;
+    lcb->children = cb;
+    lcb->nchildren++;
+    release(&tablelock);
+    tcp_cb_unlock(lcb);
+    tcp_incoming_event(cb, hdr, len);
+    tcp_cb_unlock(cb);
+}
+
+static void
+tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+    uint32_t pseudo = 0;
+
+    if (*dst != ((struct netif_ip *)iface)->unicast) {
+        return;
+    }
     pseudo += *src >> 16;
     pseudo += *src & 0xffff;
     pseudo += *dst >> 16;
     pseudo += *dst & 0xffff;
     pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
     pseudo += hton16(len);
-    if (cksum16((uint16_t *)hdr, len, pseudo) != 0) {
-        cprintf("tcp checksum error!\n");
+    tcp_input(segment, len, pseudo, src, iface);
+}
+
+static void
+tcp6_rx (uint8_t *segment, size_t len, struct ip6_hdr *hdr, struct netif *iface) {
+    if (IP6_ADDR_IS_MULTICAST(&hdr->dst)) {
         return;
     }
-    acquire(&tcplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            if (!fcb) {
-                fcb = cb;
-            }
-        }
-        else if ((!cb->iface || cb->iface == iface) && cb->port == hdr->dst) {
-            // 找到了与当前 TCP 报文匹配的 TCP 控制块
-            if (cb->peer.addr == *src && cb->peer.port == hdr->src) {
-                break;
-            }
-            if (cb->state == TCP_CB_STATE_LISTEN && !lcb) {
-                lcb = cb;
-            }
+    tcp_input(segment, len, ip6_pseudo_sum(&hdr->src, &hdr->dst, IP6_NEXTHDR_TCP, len), &hdr->src, iface);
+}
+
+// 差错报文引用的段所属的连接，加锁后返回；payload 是本机发出的段的开头，peer 是对端的地址。
+// 被引用的段必须仍在发送窗口内，防止伪造的差错报文影响连接（RFC 5927）
+static struct tcp_cb *
+tcp_error_cb (uint8_t *payload, size_t len, const void *peer, struct netif *iface) {
+    struct tcp_hdr *hdr;
+    struct tcp_cb *cb;
+    uint32_t seq;
+
+    if (len < 8) {
+        return NULL;
+    }
+    hdr = (struct tcp_hdr *)payload;
+    seq = ntoh32(hdr->seq);
+    cb = tcp_cb_lookup(iface, hdr->src, peer, hdr->dst);
+    if (!cb || !tcp_cb_lock(cb)) {
+        return NULL;
+    }
+    if (TCP_SEQ_LT(seq, cb->snd.una) || TCP_SEQ_LEQ(cb->snd.nxt, seq)) {
+        tcp_cb_unlock(cb);
+        return NULL;
+    }
+    return cb;
+}
+
+// ICMP 差错报文：payload 是本机发出的段的开头，src/dst 是本机和对端的地址
+static void
+tcp_rx_error (uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+    struct tcp_cb *cb;
+    uint16_t mtu;
+
+    (void)src;
+    // 非 Destination Unreachable 都按软错误忽略
+    if (type != ICMP_TYPE_DEST_UNREACH) {
+        return;
+    }
+    cb = tcp_error_cb(payload, len, dst, iface);
+    if (!cb) {
+        return;
+    }
+    // 被引用的段已确认，按报文给出的 MTU 更新路径 MTU：超过新的 MSS 的段不会到达对端，不等超时，
+    // 立即切分后重传（RFC 1191 6.5）。这不是拥塞造成的丢包，拥塞窗口不变
+    if (code == ICMP_CODE_FRAGMENT_NEEDED) {
+        mtu = ntoh32(values) & 0xffff;
+        if (mtu) {
+            ip_pmtu_update(dst, mtu, 1);
         }
+        tcp_mtu_reduced(cb);
+        tcp_cb_unlock(cb);
+        return;
     }
-    if (cb == array_tailof(cb_table)) {
-        if (!lcb || !fcb || !TCP_FLG_IS(hdr->flg, TCP_FLG_SYN)) {
-            // send RST
-            release(&tcplock);
-            return;
+    // 连接建立中任何不可达都中止连接，已建立的连接只对端口/协议不可达这样的硬错误中止
+    if (cb->state == TCP_CB_STATE_SYN_SENT || code == ICMP_CODE_PROTO_UNREACH || code == ICMP_CODE_PORT_UNREACH) {
+        tcp_cb_abort(cb);
+    }
+    tcp_cb_unlock(cb);
+}
+
+// ICMPv6 差错报文：hdr 是本机发出的数据报的头部
+static void
+tcp6_rx_error (uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, struct ip6_hdr *hdr, struct netif *iface) {
+    struct tcp_cb *cb;
+
+    (void)values;
+    if (type != ICMP6_TYPE_DEST_UNREACH && type != ICMP6_TYPE_PACKET_TOO_BIG) {
+        return;
+    }
+    cb = tcp_error_cb(payload, len, &hdr->dst, iface);
+    if (!cb) {
+        return;
+    }
+    // 路径 MTU 已经由 ICMPv6 层更新（不会低于 1280），和 IPv4 一样立即切分后重传
+    if (type == ICMP6_TYPE_PACKET_TOO_BIG) {
+        tcp_mtu_reduced(cb);
+        tcp_cb_unlock(cb);
+        return;
+    }
+    if (cb->state == TCP_CB_STATE_SYN_SENT || code == ICMP6_CODE_PORT_UNREACH) {
+        tcp_cb_abort(cb);
+    }
+    tcp_cb_unlock(cb);
+}
+
+// 本机地址被删除时中止使用该地址的连接
+void
+tcp_netif_detach (struct netif *iface) {
+    struct tcp_hash_bucket *table[] = {conn_hash, listen_hash};
+    int size[] = {TCP_CONN_HASH_SIZE, TCP_LISTEN_HASH_SIZE};
+    struct tcp_cb *cb;
+    int t, n;
+
+    // 中止的连接会从表中移除，每次都从桶的开头重新找
+    for (t = 0; t < 2; t++) {
+        for (n = 0; n < size[t]; n++) {
+            while (1) {
+                acquire(&table[t][n].lock);
+                for (cb = table[t][n].head; cb && cb->iface != iface; cb = cb->hnext);
+                if (cb) {
+                    tcp_cb_ref(cb);
+                }
+                release(&table[t][n].lock);
+                if (!cb) {
+                    break;
+                }
+                if (tcp_cb_lock(cb)) {
+                    cb->iface = NULL;
+                    tcp_cb_abort(cb);
+                    tcp_cb_unlock(cb);
+                }
+            }
         }
-        cb = fcb;
-        cb->used = 1;
-        cb->state = lcb->state;
-        cb->iface = iface;
-        cb->port = lcb->port;
-        cb->peer.addr = *src;
-        cb->peer.port = hdr->src;
-        cb->rcv.wnd = sizeof(cb->window);
-        cb->parent = lcb;
     }
-    tcp_incoming_event(cb, hdr, len);
-    release(&tcplock);
-    return;
 }
 
 int
-tcp_api_open (void) {
+tcp_api_open (int family) {
     struct tcp_cb *cb;
 
-    acquire(&tcplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            cb->used = 1;
-            release(&tcplock);
-            return array_offset(cb_table, cb);
-        }
+    int desc;
+
+    acquire(&tablelock);
+    cb = (struct tcp_cb *)slab_alloc(&cb_slab);
+    if (!cb) {
+        release(&tablelock);
+        return -1;
     }
-    release(&tcplock);
-    return -1;
+    initlock(&cb->lock, "tcpcb");
+    cb->refs = 1;
+    cb->family = family;
+    cb->cc.ops = &tcp_cc_newreno;
+    cb->rcvbuf.size = TCP_RCVBUF_DEFAULT;
+    cb->sndbuf.size = TCP_SNDBUF_DEFAULT;
+    desc = tcp_socket_alloc(cb);
+    if (desc == -1) {
+        slab_free(&cb_slab, cb);
+    }
+    release(&tablelock);
+    return desc;
 }
 
 int
@@ -520,111 +2310,206 @@ tcp_api_close (int soc) {
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
+    // 发送缓冲区中剩下的数据发送完之后跟着发送 FIN
     switch (cb->state) {
         case TCP_CB_STATE_SYN_RCVD:
         case TCP_CB_STATE_ESTABLISHED:
-            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, NULL, 0);
             cb->state = TCP_CB_STATE_FIN_WAIT1;
-            cb->snd.nxt++;
-            sleep(cb, &tcplock);
+            tcp_push(cb);
             break;
         case TCP_CB_STATE_CLOSE_WAIT:
-            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, NULL, 0);
             cb->state = TCP_CB_STATE_LAST_ACK;
-            cb->snd.nxt++;
-            sleep(cb, &tcplock);
+            tcp_push(cb);
             break;
         default:
             break;
     }
-    tcp_cb_clear(cb); /* TCP_CB_STATE_CLOSED */
-    release(&tcplock);
+    // 确认和收到的数据也会唤醒这里，要等到 FIN 被确认（FIN_WAIT2, TIME_WAIT, CLOSED）或者连接被中止，
+    // 否则释放控制块时还没有发送的数据就丢失了
+    while (TCP_CB_STATE_FIN_QUEUED(cb) && !cb->err) {
+        if (myproc()->killed) {
+            break;
+        }
+        sleep(cb, &cb->lock);
+    }
+    tcp_cb_free(cb);
+    tcp_cb_unlock(cb);
     return 0;
 }
 
 int
 tcp_api_connect (int soc, struct sockaddr *addr, int addrlen) {
     struct sockaddr_in *sin;
-    struct tcp_cb *cb, *tmp;
-    uint32_t p;
+    struct sockaddr_in6 *sin6;
+    struct tcp_cb *cb;
+    uint32_t rcvbuf, sndbuf;
+    uint8_t family, locked, sndlocked, nodelay, cork;
+    const struct tcp_cc_ops *ops;
 
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    if (addr->sa_family != AF_INET) {
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
+    }
+    if (cb->state != TCP_CB_STATE_CLOSED || addr->sa_family != cb->family) {
+        tcp_cb_unlock(cb);
         return -1;
     }
-    sin = (struct sockaddr_in *)addr;
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-        release(&tcplock);
+    if (cb->family == AF_INET6 && addrlen < sizeof(struct sockaddr_in6)) {
+        tcp_cb_unlock(cb);
         return -1;
     }
     if (!cb->port) {
-        int offset = time(NULL) % 1024;
-        for (p = TCP_SOURCE_PORT_MIN + offset; p <= TCP_SOURCE_PORT_MAX; p++) {
-            for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
-                if (tmp->used && tmp->port == hton16((uint16_t)p)) {
-                    break;
-                }
-            }
-            if (tmp == array_tailof(cb_table)) {
-                cb->port = hton16((uint16_t)p);
-                break;
-            }
-        }
+        acquire(&tablelock);
+        cb->port = tcp_port_alloc();
+        release(&tablelock);
         if (!cb->port) {
-            release(&tcplock);
+            tcp_cb_unlock(cb);
+            return -1;
+        }
+        cb->eport = 1;
+    }
+    if (cb->family == AF_INET6) {
+        sin6 = (struct sockaddr_in6 *)addr;
+        cb->peer.addr6 = sin6->sin6_addr;
+        cb->peer.port = sin6->sin6_port;
+    } else {
+        sin = (struct sockaddr_in *)addr;
+        cb->peer.addr = sin->sin_addr;
+        cb->peer.port = sin->sin_port;
+    }
+    if (!cb->iface) {
+        // 没有绑定本机地址时使用到对端的路由所在接口的地址
+        cb->iface = cb->family == AF_INET6 ? ip6_netif_by_peer(&cb->peer.addr6) : ip_netif_by_peer(&cb->peer.addr);
+        if (!cb->iface) {
+            tcp_cb_unlock(cb);
             return -1;
         }
     }
-    cb->peer.addr = sin->sin_addr;
-    cb->peer.port = sin->sin_port;
-    cb->rcv.wnd = sizeof(cb->window);
-    cb->iss = (uint32_t)random(); //  Initial Sequence Number（初始序列号）是 TCP 协议中用于建立连接时的一个重要参数。TCP 连接的建立需要双方交换一些控制信息，其中包括序列号。iss 即是 TCP 发起连接时选择的初始序列号
-    tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, NULL, 0);
+    tcp_cb_hash(cb);
+    cb->rcv.wnd = cb->rcvbuf.size;
+    cb->rcv.wscale = TCP_WSCALE;
+    cb->sack.ok = 1;
+    cb->ts.ok = 1;
+    cb->ts.offset = urandom();
+    cb->rtx.rto = TCP_RTO_INIT;
+    cb->iss = urandom(); //  Initial Sequence Number（初始序列号）是 TCP 协议中用于建立连接时的一个重要参数。TCP 连接的建立需要双方交换一些控制信息，其中包括序列号。iss 即是 TCP 发起连接时选择的初始序列号
+    cb->snd.una = cb->iss;
+    tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, 0, 0);
     cb->snd.nxt = cb->iss + 1;
     cb->state = TCP_CB_STATE_SYN_SENT;
     while (cb->state == TCP_CB_STATE_SYN_SENT) {
-        sleep(&cb_table[soc], &tcplock);
+        if(myproc()->killed){
+            break;
+        }
+        sleep(cb, &cb->lock);
+    }
+    if (cb->state != TCP_CB_STATE_ESTABLISHED) {
+        // 被拒绝或者不可达，控制块回到初始状态，套接字仍然有效
+        family = cb->family;
+        ops = cb->cc.ops;
+        rcvbuf = cb->rcvbuf.size;
+        locked = cb->rcvbuf.locked;
+        sndbuf = cb->sndbuf.size;
+        sndlocked = cb->sndbuf.locked;
+        nodelay = cb->nodelay;
+        cork = cb->cork;
+        tcp_cb_clear(cb);
+        cb->family = family;
+        cb->cc.ops = ops;
+        cb->rcvbuf.size = rcvbuf;
+        cb->rcvbuf.locked = locked;
+        cb->sndbuf.size = sndbuf;
+        cb->sndbuf.locked = sndlocked;
+        cb->nodelay = nodelay;
+        cb->cork = cork;
+        tcp_cb_unlock(cb);
+        return -1;
     }
-    release(&tcplock);
+    tcp_cb_unlock(cb);
     return 0;
 }
 
 int
 tcp_api_bind (int soc, struct sockaddr *addr, int addrlen) {
     struct sockaddr_in *sin;
-    struct tcp_cb *cb;
+    struct sockaddr_in6 *sin6;
+    struct tcp_cb *cb, *tmp;
+    struct tcp_hash_bucket *bucket;
+    struct netif *iface = NULL;
+    uint16_t port;
 
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    if (addr->sa_family != AF_INET) {
+    if (addr->sa_family == AF_INET6) {
+        if (addrlen < sizeof(struct sockaddr_in6)) {
+            return -1;
+        }
+        sin6 = (struct sockaddr_in6 *)addr;
+        if (!IP6_ADDR_IS_UNSPECIFIED(&sin6->sin6_addr)) {
+            iface = ip6_netif_by_addr(&sin6->sin6_addr);
+            if (!iface) {
+                return -1;
+            }
+        }
+        port = sin6->sin6_port;
+    } else if (addr->sa_family == AF_INET) {
+        sin = (struct sockaddr_in *)addr;
+        if (sin->sin_addr) {
+            iface = ip_netif_by_addr(&sin->sin_addr);
+            if (!iface) {
+                return -1;
+            }
+        }
+        port = sin->sin_port;
+    } else {
+        return -1;
+    }
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
+    }
+    if (cb->state != TCP_CB_STATE_CLOSED || cb->family != addr->sa_family || cb->port) {
+        tcp_cb_unlock(cb);
         return -1;
     }
-    sin = (struct sockaddr_in *)addr;
-    acquire(&tcplock);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (cb->port == sin->sin_port) {
-            release(&tcplock);
+    // 加入监听的哈希表只在这里，持有 tablelock 期间检查的结果不会变
+    acquire(&tablelock);
+    if (port) {
+        // 绑定到不同本机地址的套接字可以使用相同的端口
+        bucket = tcp_listen_bucket(port);
+        acquire(&bucket->lock);
+        for (tmp = bucket->head; tmp; tmp = tmp->hnext) {
+            if (tmp->family == cb->family && tmp->port == port && (!iface || !tmp->iface || tmp->iface == iface)) {
+                break;
+            }
+        }
+        release(&bucket->lock);
+        if (tmp) {
+            release(&tablelock);
+            tcp_cb_unlock(cb);
+            return -1;
+        }
+        if (tcp_port_reserve(cb, port) == -1) {
+            release(&tablelock);
+            tcp_cb_unlock(cb);
             return -1;
         }
     }
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-        release(&tcplock);
-        return -1;
+    cb->iface = iface;
+    cb->port = port;
+    if (port) {
+        tcp_cb_hash(cb);
     }
-    cb->port = sin->sin_port;
-    release(&tcplock);
+    release(&tablelock);
+    tcp_cb_unlock(cb);
     return 0;
 }
 
@@ -635,125 +2520,356 @@ tcp_api_listen (int soc, int backlog) {
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED || !cb->port) {
-        release(&tcplock);
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
+    }
+    if (cb->state != TCP_CB_STATE_CLOSED || !cb->port) {
+        tcp_cb_unlock(cb);
         return -1;
     }
+    // backlog 为 0 时也允许一个连接，和 Linux 一样
+    cb->maxchildren = MIN(MAX(backlog, 1), TCP_CB_LISTENER_SIZE);
     cb->state = TCP_CB_STATE_LISTEN;
-    release(&tcplock);
+    tcp_cb_unlock(cb);
     return 0;
 }
 
 int
 tcp_api_accept (int soc, struct sockaddr *addr, int *addrlen) {
-    struct tcp_cb *cb, *backlog;
+    struct tcp_cb *cb, *backlog, **p;
     struct queue_entry *entry;
-    struct sockaddr_in *sin = NULL;
+    int desc;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
 
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    if (addr) {
-        if (!addrlen) {
-            return -1;
-        }
-        if (*addrlen < sizeof(struct sockaddr_in)) {
-            return -1;
-        }
-        *addrlen = sizeof(struct sockaddr_in);
-        sin = (struct sockaddr_in *)addr;
+    if (addr && !addrlen) {
+        return -1;
+    }
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
+    if (addr && *addrlen < (cb->family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in))) {
+        tcp_cb_unlock(cb);
         return -1;
     }
     if (cb->state != TCP_CB_STATE_LISTEN) {
-        release(&tcplock);
+        tcp_cb_unlock(cb);
         return -1;
     }
-    while ((entry = queue_pop(&cb->backlog)) == NULL) {
-        if(myproc()->killed){
-            release(&tcplock);
-            return -1;
+    // 完成握手的连接由子连接自己放入 backlog，等待时只持有 tablelock（保留监听控制块的引用）
+    release(&cb->lock);
+    while (1) {
+        acquire(&tablelock);
+        while ((entry = queue_pop(&cb->backlog)) == NULL) {
+            if (myproc()->killed || cb->dead) {
+                release(&tablelock);
+                tcp_cb_put(cb);
+                return -1;
+            }
+            sleep(cb, &tablelock);
+        }
+        release(&tablelock);
+        backlog = entry->data;
+        kfree((char*)entry);
+        if (tcp_cb_lock(backlog)) {
+            break;
+        }
+    }
+    acquire(&tablelock);
+    desc = tcp_socket_alloc(backlog);
+    release(&tablelock);
+    if (desc == -1) {
+        tcp_tx(backlog, backlog->snd.nxt, 0, TCP_FLG_RST, 0, 0);
+        tcp_cb_free(backlog);
+        tcp_cb_unlock(backlog);
+        tcp_cb_put(cb);
+        return -1;
+    }
+    acquire(&tablelock);
+    for (p = &cb->children; *p; p = &(*p)->sibling) {
+        if (*p == backlog) {
+            *p = backlog->sibling;
+            cb->nchildren--;
+            break;
         }
-        sleep(cb, &tcplock);
     }
-    backlog = entry->data;
-    kfree((char*)entry);
-    if (sin) {
+    backlog->parent = NULL;
+    release(&tablelock);
+    if (addr && backlog->family == AF_INET6) {
+      sin6 = (struct sockaddr_in6 *)addr;
+      memset(sin6, 0, sizeof(*sin6));
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_addr = backlog->peer.addr6;
+      sin6->sin6_port = backlog->peer.port;
+      *addrlen = sizeof(struct sockaddr_in6);
+    } else if (addr) {
+      sin = (struct sockaddr_in *)addr;
       sin->sin_family = AF_INET;
       sin->sin_addr = backlog->peer.addr;
       sin->sin_port = backlog->peer.port;
+      *addrlen = sizeof(struct sockaddr_in);
     }
-    release(&tcplock);
-    return array_offset(cb_table, backlog);
+    tcp_cb_unlock(backlog);
+    tcp_cb_put(cb);
+    return desc;
 }
 
 ssize_t
-tcp_api_recv (int soc, uint8_t *buf, size_t size) {
+tcp_api_recv (int soc, uint8_t *buf, size_t size, int nonblock) {
     struct tcp_cb *cb;
-    size_t total, len;
+    size_t len, thresh;
+    uint32_t old;
 
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    while (!(total = sizeof(cb->window) - cb->rcv.wnd)) {
+    while (!cb->rcvbuf.len) {
+        if (cb->err) {
+            cb->err = 0;
+            tcp_cb_unlock(cb);
+            return -1;
+        }
         if (!TCP_CB_STATE_RX_ISREADY(cb)) {
-            release(&tcplock);
+            tcp_cb_unlock(cb);
             return 0;
         }
+        if (nonblock) {
+            tcp_cb_unlock(cb);
+            return -EAGAIN;
+        }
         if(myproc()->killed){
-            release(&tcplock);
+            tcp_cb_unlock(cb);
             return -1;
         }
-        sleep(cb, &tcplock);
+        sleep(cb, &cb->lock);
     }
-    len = size < total ? size : total;
-    memcpy(buf, cb->window, len);
-    memmove(cb->window, cb->window + len, total - len);
+    len = MIN(size, cb->rcvbuf.len);
+    tcp_rcvbuf_read(cb, buf, len, tcp_ooo_len(cb));
+    old = cb->rcv.wnd;
     cb->rcv.wnd += len;
-    release(&tcplock);
+    tcp_rcvbuf_autotune(cb, len);
+    // 窗口从小于一个 MSS（或缓冲区的一半）重新打开时主动通告，不用等对端的窗口探测（RFC 1122 4.2.3.3）
+    if (TCP_CB_STATE_RX_ISREADY(cb)) {
+        thresh = MIN(cb->rcvbuf.size / 2, tcp_mss(cb));
+        if (old < thresh && cb->rcv.wnd >= thresh) {
+            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, 0, 0);
+        }
+    }
+    tcp_cb_unlock(cb);
     return len;
 }
 
+// 数据拷贝到发送缓冲区后立即返回，缓冲区满时阻塞（非阻塞套接字返回 -EAGAIN）；返回写入的字节数
 ssize_t
-tcp_api_send (int soc, uint8_t *buf, size_t len) {
+tcp_api_send (int soc, uint8_t *buf, size_t len, int nonblock) {
     struct tcp_cb *cb;
+    size_t done = 0, n;
 
     if (TCP_SOCKET_ISINVALID(soc)) {
         return -1;
     }
-    acquire(&tcplock);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        release(&tcplock);
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
     if (!TCP_CB_STATE_TX_ISREADY(cb)) {
-        release(&tcplock);
+        tcp_cb_unlock(cb);
+        return -1;
+    }
+    while (done < len) {
+        tcp_sndbuf_autotune(cb);
+        while (cb->sndbuf.len >= cb->sndbuf.size) {
+            if (done) {
+                tcp_cb_unlock(cb);
+                return done;
+            }
+            if (nonblock) {
+                tcp_cb_unlock(cb);
+                return -EAGAIN;
+            }
+            if (myproc()->killed) {
+                tcp_cb_unlock(cb);
+                return -1;
+            }
+            sleep(cb, &cb->lock);
+            if (!TCP_CB_STATE_TX_ISREADY(cb)) {
+                tcp_cb_unlock(cb);
+                return -1;
+            }
+        }
+        n = tcp_sndbuf_write(cb, buf + done, MIN(len - done, cb->sndbuf.size - cb->sndbuf.len));
+        if (!n) {
+            // 内存不足
+            tcp_cb_unlock(cb);
+            return done ? (ssize_t)done : -1;
+        }
+        done += n;
+        tcp_push(cb);
+    }
+    tcp_cb_unlock(cb);
+    return done;
+}
+
+int
+tcp_api_setsockopt (int soc, int level, int optname, void *optval, int optlen) {
+    struct tcp_cb *cb;
+    const struct tcp_cc_ops *ops;
+    char name[TCP_CC_NAME_MAX];
+    int val;
+
+    if (TCP_SOCKET_ISINVALID(soc)) {
+        return -1;
+    }
+    if (level == SOL_SOCKET && optname == SO_RCVBUF && optlen >= sizeof(int)) {
+        val = *(int *)optval;
+        cb = tcp_cb_get(soc);
+        if (!cb) {
+            return -1;
+        }
+        tcp_rcvbuf_resize(cb, MIN(MAX(val, TCP_RCVBUF_MIN), TCP_RCVBUF_MAX));
+        cb->rcvbuf.locked = 1;
+        tcp_cb_unlock(cb);
+        return 0;
+    }
+    // 缩小到已经缓存的数据量以下时，send() 等待数据被确认到新的上限以下
+    if (level == SOL_SOCKET && optname == SO_SNDBUF && optlen >= sizeof(int)) {
+        val = *(int *)optval;
+        cb = tcp_cb_get(soc);
+        if (!cb) {
+            return -1;
+        }
+        cb->sndbuf.size = MIN(MAX(val, TCP_SNDBUF_MIN), TCP_SNDBUF_MAX);
+        cb->sndbuf.locked = 1;
+        tcp_cb_unlock(cb);
+        return 0;
+    }
+    if (level == IPPROTO_TCP && (optname == TCP_NODELAY || optname == TCP_CORK) && optlen >= sizeof(int)) {
+        val = *(int *)optval;
+        cb = tcp_cb_get(soc);
+        if (!cb) {
+            return -1;
+        }
+        if (optname == TCP_NODELAY) {
+            cb->nodelay = val ? 1 : 0;
+        } else {
+            cb->cork = val ? 1 : 0;
+        }
+        // 打开 NODELAY 或者取消 CORK 时发送积攒着的数据
+        if (TCP_CB_STATE_TX_ISREADY(cb)) {
+            tcp_push(cb);
+        }
+        tcp_cb_unlock(cb);
+        return 0;
+    }
+    if (level != IPPROTO_TCP || optname != TCP_CONGESTION || optlen <= 0) {
+        return -1;
+    }
+    memset(name, 0, sizeof(name));
+    memmove(name, optval, MIN(optlen, (int)sizeof(name) - 1));
+    ops = tcp_cc_find(name);
+    if (!ops) {
+        return -1;
+    }
+    cb = tcp_cb_get(soc);
+    if (!cb) {
         return -1;
     }
-    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK | TCP_FLG_PSH, buf, len);
-    cb->snd.nxt += len;
-    release(&tcplock);
+    cb->cc.ops = ops;
+    // 连接中途切换算法时保留 cwnd 和 ssthresh，只重新初始化算法的私有状态
+    if (cb->cc.mss) {
+        ops->init(&cb->cc);
+    }
+    tcp_cb_unlock(cb);
     return 0;
 }
 
 int
-tcp_init (void) {
+tcp_api_getsockopt (int soc, int level, int optname, void *optval, int *optlen) {
     struct tcp_cb *cb;
+    struct tcp_info info;
+
+    if (TCP_SOCKET_ISINVALID(soc)) {
+        return -1;
+    }
+    if (level == SOL_SOCKET) {
+        if ((optname != SO_RCVBUF && optname != SO_SNDBUF) || *optlen < sizeof(int)) {
+            return -1;
+        }
+    } else if (level != IPPROTO_TCP || *optlen <= 0) {
+        return -1;
+    } else if (optname == TCP_NODELAY || optname == TCP_CORK) {
+        if (*optlen < sizeof(int)) {
+            return -1;
+        }
+    } else if (optname != TCP_CONGESTION && optname != TCP_INFO) {
+        return -1;
+    }
+    cb = tcp_cb_get(soc);
+    if (!cb) {
+        return -1;
+    }
+    if (level == SOL_SOCKET) {
+        *(int *)optval = optname == SO_SNDBUF ? cb->sndbuf.size : cb->rcvbuf.size;
+        *optlen = sizeof(int);
+        tcp_cb_unlock(cb);
+        return 0;
+    }
+    if (optname == TCP_NODELAY || optname == TCP_CORK) {
+        *(int *)optval = optname == TCP_NODELAY ? cb->nodelay : cb->cork;
+        *optlen = sizeof(int);
+        tcp_cb_unlock(cb);
+        return 0;
+    }
+    if (optname == TCP_CONGESTION) {
+        safestrcpy(optval, cb->cc.ops->name, MIN(*optlen, TCP_CC_NAME_MAX));
+        *optlen = MIN(*optlen, TCP_CC_NAME_MAX);
+        tcp_cb_unlock(cb);
+        return 0;
+    }
+    memset(&info, 0, sizeof(info));
+    info.tcpi_state = cb->state;
+    info.tcpi_ca_state = cb->recovery ? TCP_CA_RECOVERY : (cb->rtx.count && cb->txq.head && !cb->rtx.persist) ? TCP_CA_LOSS : TCP_CA_OPEN;
+    info.tcpi_retransmits = cb->rtx.count;
+    info.tcpi_rto = cb->rtx.rto * 10;
+    info.tcpi_rtt = (cb->rtx.srtt >> 3) * 10;
+    info.tcpi_rttvar = (cb->rtx.rttvar >> 2) * 10;
+    info.tcpi_snd_mss = cb->cc.mss;
+    info.tcpi_snd_cwnd = cb->cc.cwnd;
+    info.tcpi_snd_ssthresh = cb->cc.ssthresh;
+    info.tcpi_snd_wnd = cb->snd.wnd;
+    info.tcpi_rcv_wnd = cb->rcv.wnd;
+    info.tcpi_unacked = cb->snd.nxt - cb->snd.una;
+    info.tcpi_total_retrans = cb->total_retrans;
+    tcp_cb_unlock(cb);
+    *optlen = MIN(*optlen, (int)sizeof(info));
+    memmove(optval, &info, *optlen);
+    return 0;
+}
+
+int
+tcp_init (void) {
+    int n;
 
-    initlock(&tcplock, "tcplock");
-    ip_add_protocol(IP_PROTOCOL_TCP, tcp_rx);
+    initlock(&tablelock, "tcptable");
+    slab_init(&cb_slab, sizeof(struct tcp_cb));
+    for (n = 0; n < TCP_CONN_HASH_SIZE; n++) {
+        initlock(&conn_hash[n].lock, "tcpconn");
+    }
+    for (n = 0; n < TCP_LISTEN_HASH_SIZE; n++) {
+        initlock(&listen_hash[n].lock, "tcplisten");
+    }
+    port_next = urandom() % TCP_SOURCE_PORT_NUM;
+    ip_add_protocol(IP_PROTOCOL_TCP, tcp_rx, tcp_rx_error);
+    ip6_add_protocol(IP6_NEXTHDR_TCP, tcp6_rx, tcp6_rx_error);
+    nettimer_register(TCP_TIMER_INTERVAL, tcp_timer);
     return 0;
 }
@@ -0,0 +1,168 @@
+#include "types.h"
+#include "defs.h"
+#include "tcp_cc.h"
+
+/*
+ * 拥塞控制算法：NewReno（RFC 5681, RFC 6582）和 CUBIC（RFC 9438）。
+ * 内核不能使用浮点数，也没有链接 libgcc 的 64 位除法，
+ * CUBIC 的时间以 1/1024 秒为单位、系数放大 1024 倍，除法都是 32 位的或者除以 2 的幂。
+ */
+
+#define TCP_CC_INFINITE_SSTHRESH 0x7fffffff
+
+// 慢启动：每个 ACK 最多增加一个 MSS（RFC 3465 中 L = 1 SMSS）
+static void
+tcp_cc_slow_start (struct tcp_cc *cc, uint32_t acked) {
+    cc->cwnd += MIN(acked, cc->mss);
+}
+
+static void
+newreno_init (struct tcp_cc *cc) {
+    (void)cc;
+}
+
+static void
+newreno_cong_avoid (struct tcp_cc *cc, uint32_t acked) {
+    if (cc->cwnd < cc->ssthresh) {
+        tcp_cc_slow_start(cc, acked);
+        return;
+    }
+    // 拥塞避免：每个 RTT 大约增加一个 MSS（RFC 5681 式 3）
+    cc->cwnd += MAX(cc->mss * cc->mss / cc->cwnd, 1);
+}
+
+static uint32_t
+newreno_ssthresh (struct tcp_cc *cc, uint32_t flight) {
+    return MAX(flight / 2, 2 * cc->mss);
+}
+
+const struct tcp_cc_ops tcp_cc_newreno = {
+    .name = "newreno",
+    .init = newreno_init,
+    .cong_avoid = newreno_cong_avoid,
+    .ssthresh = newreno_ssthresh,
+};
+
+#define CUBIC_BETA  717 /* 0.7 * 1024 */
+#define CUBIC_C     410 /* 0.4 * 1024 */
+#define CUBIC_ALPHA 542 /* 3 * (1 - beta) / (1 + beta) * 1024 */
+#define CUBIC_CUBE_FACTOR ((1ULL << 40) / CUBIC_C) /* K^3 = (w_max - cwnd) / C，时间单位 1/1024 秒 */
+#define CUBIC_TIME_MAX (1 << 16) /* 64s，防止三次方溢出 */
+
+// 64 位整数的立方根，逐位计算，只用移位、乘法和比较
+static uint32_t
+cubic_root (uint64_t a) {
+    uint64_t y = 0, b;
+    int s;
+
+    for (s = 63; s >= 0; s -= 3) {
+        y <<= 1;
+        b = 3 * y * (y + 1) + 1;
+        if ((a >> s) >= b) {
+            a -= b << s;
+            y++;
+        }
+    }
+    return (uint32_t)y;
+}
+
+static void
+cubic_init (struct tcp_cc *cc) {
+    memset(&cc->priv.cubic, 0, sizeof(cc->priv.cubic));
+}
+
+static void
+cubic_cong_avoid (struct tcp_cc *cc, uint32_t acked) {
+    uint32_t segs, t, d, target, inc;
+    uint64_t offs;
+
+    if (cc->cwnd < cc->ssthresh) {
+        tcp_cc_slow_start(cc, acked);
+        return;
+    }
+    segs = MAX(cc->cwnd / cc->mss, 1);
+    if (!cc->priv.cubic.started) {
+        cc->priv.cubic.started = 1;
+        cc->priv.cubic.epoch = ticks;
+        if (segs < cc->priv.cubic.w_max) {
+            cc->priv.cubic.k = cubic_root((uint64_t)(cc->priv.cubic.w_max - segs) * CUBIC_CUBE_FACTOR);
+            cc->priv.cubic.origin = cc->priv.cubic.w_max;
+        } else {
+            cc->priv.cubic.k = 0;
+            cc->priv.cubic.origin = segs;
+        }
+        cc->priv.cubic.w_est = cc->cwnd;
+    }
+    // 按一个 RTT 之后的时间计算目标窗口 W(t + RTT) = C * (t - K)^3 + origin
+    t = (ticks - cc->priv.cubic.epoch + cc->srtt) * 1024 / 100;
+    d = t < cc->priv.cubic.k ? cc->priv.cubic.k - t : t - cc->priv.cubic.k;
+    d = MIN(d, CUBIC_TIME_MAX);
+    offs = ((uint64_t)d * d * d * CUBIC_C) >> 40;
+    if (t < cc->priv.cubic.k) {
+        target = offs < cc->priv.cubic.origin ? cc->priv.cubic.origin - (uint32_t)offs : 1;
+    } else {
+        target = cc->priv.cubic.origin + (uint32_t)MIN(offs, segs);
+    }
+    // 每个 RTT 最多增长到目标窗口，也最多增长一半
+    if (target > segs) {
+        inc = MIN(target - segs, segs / 2 + 1) * MIN(acked, 16 * cc->mss) / segs;
+        cc->cwnd += MAX(inc, 1);
+    }
+    // TCP 友好区域：Reno 在同样的时间里能达到的窗口更大时使用 Reno 的窗口
+    cc->priv.cubic.w_est += ((acked * CUBIC_ALPHA) >> 10) * cc->mss / cc->cwnd;
+    if (cc->priv.cubic.w_est > cc->cwnd) {
+        cc->cwnd = cc->priv.cubic.w_est;
+    }
+}
+
+static uint32_t
+cubic_ssthresh (struct tcp_cc *cc, uint32_t flight) {
+    uint32_t segs;
+
+    (void)flight;
+    segs = cc->cwnd / cc->mss;
+    // 快速收敛：窗口在上一次丢包的位置之前又丢包了，说明有新的流加入，让出更多带宽
+    if (segs < cc->priv.cubic.w_max) {
+        cc->priv.cubic.w_max = segs * (1024 + CUBIC_BETA) / 2048;
+    } else {
+        cc->priv.cubic.w_max = segs;
+    }
+    cc->priv.cubic.started = 0;
+    return MAX((uint32_t)(((uint64_t)cc->cwnd * CUBIC_BETA) >> 10), 2 * cc->mss);
+}
+
+const struct tcp_cc_ops tcp_cc_cubic = {
+    .name = "cubic",
+    .init = cubic_init,
+    .cong_avoid = cubic_cong_avoid,
+    .ssthresh = cubic_ssthresh,
+};
+
+static const struct tcp_cc_ops *algorithms[] = {
+    &tcp_cc_newreno,
+    &tcp_cc_cubic,
+};
+
+const struct tcp_cc_ops *
+tcp_cc_find (const char *name) {
+    const struct tcp_cc_ops **ops;
+
+    for (ops = algorithms; ops < array_tailof(algorithms); ops++) {
+        if (strncmp((*ops)->name, name, TCP_CC_NAME_MAX) == 0) {
+            return *ops;
+        }
+    }
+    return NULL;
+}
+
+// 连接建立时（MSS 确定之后）调用：初始窗口按 RFC 5681 3.1，ssthresh 任意大
+void
+tcp_cc_start (struct tcp_cc *cc, uint32_t mss) {
+    if (!cc->ops) {
+        cc->ops = &tcp_cc_newreno;
+    }
+    cc->mss = mss;
+    cc->cwnd = MIN(4 * mss, MAX(2 * mss, 4380));
+    cc->ssthresh = TCP_CC_INFINITE_SSTHRESH;
+    cc->ops->init(cc);
+}
@@ -0,0 +1,34 @@
+// TCP 拥塞控制算法，cwnd 和 ssthresh 以字节为单位。
+// 丢包检测、快速重传/快速恢复和超时处理在 tcp.c 中，算法只决定窗口怎样增长以及丢包后的阈值
+
+#define TCP_CC_NAME_MAX 16
+
+struct tcp_cc;
+
+struct tcp_cc_ops {
+    const char *name;
+    void (*init)(struct tcp_cc *cc); // 初始化算法的私有状态，不改变 cwnd 和 ssthresh
+    void (*cong_avoid)(struct tcp_cc *cc, uint32_t acked); // 确认了新数据且不在快速恢复中时增长 cwnd
+    uint32_t (*ssthresh)(struct tcp_cc *cc, uint32_t flight); // 检测到丢包时返回新的 ssthresh
+};
+
+struct tcp_cc {
+    const struct tcp_cc_ops *ops;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t mss;
+    uint32_t srtt; // 平滑的 RTT（ticks），由 tcp.c 在每个 RTT 样本之后更新
+    union {
+        struct {
+            uint32_t w_max; // 上一次丢包前的窗口（段）
+            uint32_t origin; // 本轮三次函数的中心点（段）
+            uint32_t k; // 从本轮开始到回到 origin 的时间（1/1024 秒）
+            uint32_t epoch; // 本轮开始的 ticks
+            uint32_t w_est; // 按 Reno 估计的窗口（字节），用于 TCP 友好区域
+            uint8_t started;
+        } cubic;
+    } priv;
+};
+
+extern const struct tcp_cc_ops tcp_cc_newreno;
+extern const struct tcp_cc_ops tcp_cc_cubic;
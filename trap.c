@@ -47,6 +47,7 @@ trap(struct trapframe *tf)
         cprintf("trapno: %d, pid: %d, name: %s be killed\n", tf->trapno, myproc()->pid, myproc()->name);
         exit();
     }
+    myproc()->qs++;
     return;
   }
 
@@ -57,6 +58,7 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      nettimer_tick();
     }
     lapiceoi();
     break;
@@ -121,4 +123,8 @@ trap(struct trapframe *tf)
       cprintf("trapno: %d, pid: %d, name: %s be killed\n", tf->trapno, myproc()->pid, myproc()->name);
       exit();
   }
+
+  // Going back to user space is a quiescent state (see quiescent_begin).
+  if(myproc() && (tf->cs&3) == DPL_USER)
+    myproc()->qs++;
 }
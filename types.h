@@ -123,6 +123,11 @@ typedef __builtin_va_list va_list;
 /* for Protocol Stack */
 
 typedef uint32_t ip_addr_t;
+typedef union {
+    uint8_t addr8[16];
+    uint16_t addr16[8];
+    uint32_t addr32[4];
+} ip6_addr_t;
 
 typedef int32_t time_t;
 
@@ -7,6 +7,9 @@
 #include "common.h"
 #include "net.h"
 #include "ip.h"
+#include "icmp.h"
+#include "ip6.h"
+#include "icmp6.h"
 #include "socket.h"
 #include "mmu.h"
 #include "param.h"
@@ -15,6 +18,7 @@
 #define UDP_CB_TABLE_SIZE 16
 #define UDP_SOURCE_PORT_MIN 49152
 #define UDP_SOURCE_PORT_MAX 65535
+#define UDP_CB_MSHIP_MAX 8
 
 struct udp_hdr {
     uint16_t sport;
@@ -23,8 +27,11 @@ struct udp_hdr {
     uint16_t sum;
 };
 
+// 组播和广播数据报只拷贝一次，同一份数据挂到所有接收它的套接字队列上，refs 为 0 时释放
 struct udp_queue_hdr {
+    int refs;
     ip_addr_t addr;
+    ip6_addr_t addr6; // AF_INET6 套接字的对端地址
     uint16_t port;
     uint16_t len;
     uint8_t data[0];
@@ -32,9 +39,20 @@ struct udp_queue_hdr {
 
 struct udp_cb {
     int used;
+    uint8_t family; // AF_INET or AF_INET6，和 netif 的 family 取值相同
     struct netif *iface;
     uint16_t port;
     struct queue_head queue;
+    int err; // 收到了 ICMP 差错报文，下一次 recvfrom 返回错误
+    struct {
+        ip_addr_t addr;
+        uint16_t port;
+    } peer; // 最后一次 sendto 的对端（AF_INET），只有引用了发给它的数据报的差错报文才报告
+    int reuse; // SO_REUSEADDR
+    struct {
+        ip_addr_t group;
+        struct netif *iface; // NULL 表示未使用
+    } mship[UDP_CB_MSHIP_MAX]; // IP_ADD_MEMBERSHIP 加入的组
 };
 
 static struct spinlock udplock;
@@ -47,7 +65,11 @@ udp_dump (struct netif *netif, uint8_t *packet, size_t plen) {
     char addr[IP_ADDR_STR_LEN];
 
     iface = (struct netif_ip *)netif;
-    cprintf("   dev: %s (%s)\n", netif->dev->name, ip_addr_ntop(&iface->unicast, addr, sizeof(addr)));
+    if (netif->family == NETIF_FAMILY_IPV4) {
+        cprintf("   dev: %s (%s)\n", netif->dev->name, ip_addr_ntop(&iface->unicast, addr, sizeof(addr)));
+    } else {
+        cprintf("   dev: %s\n", netif->dev->name);
+    }
     hdr = (struct udp_hdr *)packet;
     cprintf(" sport: %u\n", ntoh16(hdr->sport));
     cprintf(" dport: %u\n", ntoh16(hdr->dport));
@@ -56,91 +78,260 @@ udp_dump (struct netif *netif, uint8_t *packet, size_t plen) {
     hexdump(packet, plen);
 }
 
+#define UDP_TX_PAGES ((IP_PAYLOAD_SIZE_MAX + PGSIZE - 1) / PGSIZE)
+
+// buf 可能位于用户空间，网卡不能直接对其 DMA，所以在拷贝到内核页的同时计算校验和，
+// 再把 UDP 头部和这些页组成 gather 列表交给 IP 层
+// peer 根据 iface 的 family 指向 ip_addr_t 或 ip6_addr_t
 static ssize_t
-udp_tx (struct netif *iface, uint16_t sport, uint8_t *buf, size_t len, ip_addr_t *peer, uint16_t port) {
-    char packet[65536];
-    struct udp_hdr *hdr;
-    ip_addr_t self;
+udp_tx (struct netif *iface, uint16_t sport, uint8_t *buf, size_t len, const void *peer, uint16_t port) {
+    struct udp_hdr hdr;
+    struct netvec vec[1 + UDP_TX_PAGES];
+    char *pages[UDP_TX_PAGES];
+    ip_addr_t self, dst;
     uint32_t pseudo = 0;
+    size_t done, slen;
+    int num = 0, n;
+    ssize_t ret;
 
-    hdr = (struct udp_hdr *)packet;
-    hdr->sport = sport;
-    hdr->dport = port;
-    hdr->len = hton16(sizeof(struct udp_hdr) + len);
-    hdr->sum = 0;
-    memcpy(hdr + 1, buf, len);
-    self = ((struct netif_ip *)iface)->unicast;
-    pseudo += (self >> 16) & 0xffff;
-    pseudo += self & 0xffff;
-    pseudo += (*peer >> 16) & 0xffff;
-    pseudo += *peer & 0xffff;
-    pseudo += hton16((uint16_t)IP_PROTOCOL_UDP);
-    pseudo += hton16(sizeof(struct udp_hdr) + len);
-    hdr->sum = cksum16((uint16_t *)hdr, sizeof(struct udp_hdr) + len, pseudo);
+    if (sizeof(struct udp_hdr) + len > IP_PAYLOAD_SIZE_MAX) {
+        return -1;
+    }
+    hdr.sport = sport;
+    hdr.dport = port;
+    hdr.len = hton16(sizeof(struct udp_hdr) + len);
+    hdr.sum = 0;
+    if (iface->family == NETIF_FAMILY_IPV6) {
+        pseudo = ip6_pseudo_sum(&((struct netif_ip6 *)iface)->unicast, peer, IP6_NEXTHDR_UDP, sizeof(struct udp_hdr) + len);
+    } else {
+        self = ((struct netif_ip *)iface)->unicast;
+        dst = *(const ip_addr_t *)peer;
+        pseudo += (self >> 16) & 0xffff;
+        pseudo += self & 0xffff;
+        pseudo += (dst >> 16) & 0xffff;
+        pseudo += dst & 0xffff;
+        pseudo += hton16((uint16_t)IP_PROTOCOL_UDP);
+        pseudo += hton16(sizeof(struct udp_hdr) + len);
+    }
+    pseudo = cksum_partial(&hdr, sizeof(struct udp_hdr), pseudo);
+    vec[0].base = (uint8_t *)&hdr;
+    vec[0].len = sizeof(struct udp_hdr);
+    for (done = 0; done < len; done += slen) {
+        pages[num] = kalloc();
+        if (!pages[num]) {
+            ret = -1;
+            goto out;
+        }
+        slen = MIN(len - done, PGSIZE);
+        pseudo = cksum_copy(pages[num], buf + done, slen, pseudo);
+        vec[1 + num].base = (uint8_t *)pages[num];
+        vec[1 + num].len = slen;
+        num++;
+    }
+    hdr.sum = cksum_fold(pseudo);
+    if (iface->family == NETIF_FAMILY_IPV6 && !hdr.sum) {
+        hdr.sum = 0xffff; /* IPv6 不允许省略校验和（RFC 8200 8.1） */
+    }
 #ifdef DEBUG
     cprintf(">>> udp_tx <<<\n");
-    udp_dump((struct netif *)iface, (uint8_t *)packet, sizeof(struct udp_hdr) + len);
+    udp_dump((struct netif *)iface, (uint8_t *)&hdr, sizeof(struct udp_hdr));
 #endif
-    return ip_tx(iface, IP_PROTOCOL_UDP, (uint8_t *)packet, sizeof(struct udp_hdr) + len, peer);
+    if (iface->family == NETIF_FAMILY_IPV6) {
+        ret = ip6_txv(iface, IP6_NEXTHDR_UDP, vec, 1 + num, peer, 0);
+    } else {
+        ret = ip_txv(iface, IP_PROTOCOL_UDP, vec, 1 + num, peer, 0);
+    }
+out:
+    for (n = 0; n < num; n++) {
+        kfree(pages[n]);
+    }
+    return ret;
 }
 
+static int
+udp_cb_joined (struct udp_cb *cb, ip_addr_t group, struct netif *iface) {
+    int n;
+
+    for (n = 0; n < UDP_CB_MSHIP_MAX; n++) {
+        if (cb->mship[n].iface && cb->mship[n].group == group && cb->mship[n].iface->dev == iface->dev) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 队列中的数据可能被多个套接字共享，调用者持有 udplock
 static void
-udp_rx (uint8_t *buf, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+udp_queue_entry_free (struct queue_entry *entry) {
+    struct udp_queue_hdr *queue_hdr;
+
+    queue_hdr = (struct udp_queue_hdr *)entry->data;
+    if (!--queue_hdr->refs) {
+        kfree((char*)queue_hdr);
+    }
+    kfree((char*)entry);
+}
+
+// IPv4/IPv6 共用的接收处理，pseudo 是伪首部的部分和；没有套接字绑定该端口时返回 1。
+// all 为真（组播、广播）时交给所有匹配的套接字，group 不为 NULL 时只交给加入了该组的套接字
+static int
+udp_input (uint8_t *buf, size_t len, uint32_t pseudo, const void *src, struct netif *iface, int all, const ip_addr_t *group) {
     struct udp_hdr *hdr;
-    uint32_t pseudo = 0;
     struct udp_cb *cb;
     void *data;
     struct udp_queue_hdr *queue_hdr;
+    int matched = 0;
 
     if (len < sizeof(struct udp_hdr)) {
-        return;
+        return -1;
     }
     hdr = (struct udp_hdr *)buf;
+    // 接收队列的每个元素占用一个物理页，放不下的（重组后的大）数据报只能丢弃
+    if (sizeof(struct udp_queue_hdr) + (len - sizeof(struct udp_hdr)) > PGSIZE) {
+        cprintf("udp datagram too large (%u bytes)\n", len);
+        return -1;
+    }
+    data = (void*)kalloc();
+    if (!data) {
+        return -1;
+    }
+    // 载荷在拷贝到接收队列的同时校验，不再单独遍历一遍
+    queue_hdr = data;
+    pseudo = cksum_partial(hdr, sizeof(struct udp_hdr), pseudo);
+    pseudo = cksum_copy(queue_hdr + 1, hdr + 1, len - sizeof(struct udp_hdr), pseudo);
+    if (cksum_fold(pseudo) != 0) {
+        cprintf("udp checksum error\n");
+        kfree(data);
+        return -1;
+    }
+#ifdef DEBUG
+    cprintf(">>> udp_rx <<<\n");
+    udp_dump((struct netif *)iface, buf, len);
+#endif
+    if (iface->family == NETIF_FAMILY_IPV6) {
+        queue_hdr->addr6 = *(const ip6_addr_t *)src;
+    } else {
+        queue_hdr->addr = *(const ip_addr_t *)src;
+    }
+    queue_hdr->port = hdr->sport;
+    queue_hdr->len = len - sizeof(struct udp_hdr);
+    queue_hdr->refs = 0;
+    acquire(&udplock);
+    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
+        if (!cb->used || cb->family != iface->family || (cb->iface && cb->iface != iface) || cb->port != hdr->dport) {
+            continue;
+        }
+        if (group && !udp_cb_joined(cb, *group, iface)) {
+            continue;
+        }
+        matched = 1;
+        if (queue_push(&cb->queue, data, sizeof(struct udp_queue_hdr) + (len - sizeof(struct udp_hdr)))) {
+            queue_hdr->refs++;
+            wakeup(cb);
+        }
+        if (!all) {
+            break;
+        }
+    }
+    if (!queue_hdr->refs) {
+        kfree(data);
+    }
+    release(&udplock);
+    return matched ? 0 : 1;
+}
+
+static void
+udp_rx (uint8_t *buf, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+    uint32_t pseudo = 0;
+    int unicast;
+
     pseudo += *src >> 16;
     pseudo += *src & 0xffff;
     pseudo += *dst >> 16;
     pseudo += *dst & 0xffff;
     pseudo += hton16((uint16_t)IP_PROTOCOL_UDP);
     pseudo += hton16(len);
-    if (cksum16((uint16_t *)hdr, len, pseudo) != 0) {
-        cprintf("udp checksum error\n");
+    unicast = (*dst == ((struct netif_ip *)iface)->unicast);
+    // 广播和组播的数据报没有对应的端口时不回复差错报文
+    if (udp_input(buf, len, pseudo, src, iface, !unicast, IP_ADDR_IS_MULTICAST(dst) ? dst : NULL) == 1 && unicast) {
+        icmp_unreach(iface, ICMP_CODE_PORT_UNREACH, IP_PROTOCOL_UDP, src, dst, buf, len);
+    }
+}
+
+static void
+udp6_rx (uint8_t *buf, size_t len, struct ip6_hdr *hdr, struct netif *iface) {
+    size_t dlen;
+
+    if (udp_input(buf, len, ip6_pseudo_sum(&hdr->src, &hdr->dst, IP6_NEXTHDR_UDP, len), &hdr->src, iface, IP6_ADDR_IS_MULTICAST(&hdr->dst), NULL) == 1 && !IP6_ADDR_IS_MULTICAST(&hdr->dst)) {
+        // 引用原始数据报，整个差错报文不超过最小 MTU（RFC 4443 2.4）
+        dlen = MIN((size_t)(buf + len - (uint8_t *)hdr), IP6_MTU_MIN - IP6_HDR_SIZE - sizeof(struct icmp6_hdr));
+        icmp6_tx(iface, ICMP6_TYPE_DEST_UNREACH, ICMP6_CODE_PORT_UNREACH, 0, (uint8_t *)hdr, dlen, &hdr->src, 0);
+    }
+}
+
+static void
+udp_rx_error (uint8_t type, uint8_t code, uint32_t values, uint8_t *payload, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
+    struct udp_hdr *hdr;
+    struct udp_cb *cb;
+
+    (void)values;
+    (void)src;
+    if (len < sizeof(struct udp_hdr)) {
         return;
     }
-#ifdef DEBUG
-    cprintf(">>> udp_rx <<<\n");
-    udp_dump((struct netif *)iface, buf, len);
-#endif
+    if (type != ICMP_TYPE_DEST_UNREACH || code == ICMP_CODE_FRAGMENT_NEEDED) {
+        return;
+    }
+    hdr = (struct udp_hdr *)payload;
     acquire(&udplock);
     for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (cb->used && (!cb->iface || cb->iface == iface) && cb->port == hdr->dport) {
-            data = (void*)kalloc();
-            if (!data) {
-                release(&udplock);
-                return;
+        // 没有连接的概念，只看端口的话伪造的或者发给已经离开的客户端的差错报文也会让套接字报错，
+        // 所以被引用的数据报必须是发给最后一次 sendto 的对端的
+        if (cb->used && cb->family == AF_INET && (!cb->iface || cb->iface == iface) && cb->port == hdr->sport &&
+            cb->peer.port == hdr->dport && cb->peer.addr == *dst) {
+            cb->err = 1;
+            wakeup(cb);
+            break;
+        }
+    }
+    release(&udplock);
+}
+
+// 本机地址被删除时，绑定到该地址的套接字报告一次错误并变为绑定到任意地址，通过该地址加入的组也一并离开
+void
+udp_netif_detach (struct netif *iface) {
+    struct udp_cb *cb;
+    int n;
+
+    acquire(&udplock);
+    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
+        if (!cb->used) {
+            continue;
+        }
+        for (n = 0; n < UDP_CB_MSHIP_MAX; n++) {
+            if (cb->mship[n].iface == iface) {
+                igmp_leave(iface, cb->mship[n].group);
+                cb->mship[n].iface = NULL;
             }
-            queue_hdr = data;
-            queue_hdr->addr = *src;
-            queue_hdr->port = hdr->sport;
-            queue_hdr->len = len - sizeof(struct udp_hdr);
-            memcpy(queue_hdr + 1, hdr + 1, len - sizeof(struct udp_hdr));
-            queue_push(&cb->queue, data, sizeof(struct udp_queue_hdr) + (len - sizeof(struct udp_hdr)));
+        }
+        if (cb->iface == iface) {
+            cb->iface = NULL;
+            cb->err = 1;
             wakeup(cb);
-            release(&udplock);
-            return;
         }
     }
     release(&udplock);
-    // icmp_send_destination_unreachable();
 }
 
 int
-udp_api_open (void) {
+udp_api_open (int family) {
     struct udp_cb *cb;
 
     acquire(&udplock);
     for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
         if (!cb->used) {
             cb->used = 1;
+            cb->family = family;
             release(&udplock);
             return array_offset(cb_table, cb);
         }
@@ -153,6 +344,7 @@ int
 udp_api_close (int soc) {
     struct udp_cb *cb;
     struct queue_entry *entry;
+    int n;
 
     if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
         return -1;
@@ -163,12 +355,21 @@ udp_api_close (int soc) {
         release(&udplock);
         return -1;
     }
+    for (n = 0; n < UDP_CB_MSHIP_MAX; n++) {
+        if (cb->mship[n].iface) {
+            igmp_leave(cb->mship[n].iface, cb->mship[n].group);
+            cb->mship[n].iface = NULL;
+        }
+    }
     cb->used = 0;
     cb->iface = NULL;
     cb->port = 0;
+    cb->err = 0;
+    cb->reuse = 0;
+    cb->peer.addr = 0;
+    cb->peer.port = 0;
     while ((entry = queue_pop(&cb->queue)) != NULL) {
-        kfree((char*)entry->data);
-        kfree((char*)entry);
+        udp_queue_entry_free(entry);
     }
     cb->queue.next = cb->queue.tail = NULL;
     release(&udplock);
@@ -178,38 +379,54 @@ udp_api_close (int soc) {
 int
 udp_api_bind (int soc, struct sockaddr *addr, int addrlen) {
     struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
     struct udp_cb *cb, *tmp;
     struct netif *iface = NULL;
+    uint16_t port;
 
     if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
         return -1;
     }
-    if (addr->sa_family != AF_INET) {
-        return -1;
-    }
-    sin = (struct sockaddr_in *)addr;
     acquire(&udplock);
     cb = &cb_table[soc];
-    if (!cb->used) {
+    if (!cb->used || addr->sa_family != cb->family) {
         release(&udplock);
         return -1;
     }
-    if (sin->sin_addr) {
-        iface = ip_netif_by_addr(&sin->sin_addr);
-        if (!iface) {
+    if (cb->family == AF_INET6) {
+        if (addrlen < sizeof(struct sockaddr_in6)) {
             release(&udplock);
             return -1;
         }
+        sin6 = (struct sockaddr_in6 *)addr;
+        if (!IP6_ADDR_IS_UNSPECIFIED(&sin6->sin6_addr)) {
+            iface = ip6_netif_by_addr(&sin6->sin6_addr);
+            if (!iface) {
+                release(&udplock);
+                return -1;
+            }
+        }
+        port = sin6->sin6_port;
+    } else {
+        sin = (struct sockaddr_in *)addr;
+        if (sin->sin_addr) {
+            iface = ip_netif_by_addr(&sin->sin_addr);
+            if (!iface) {
+                release(&udplock);
+                return -1;
+            }
+        }
+        port = sin->sin_port;
     }
-    // 检查重复的UDP连接，以确保不会重复使用相同的端口号和接口
+    // 检查重复的UDP连接，以确保不会重复使用相同的端口号和接口；双方都设置了 SO_REUSEADDR 时允许共用
     for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
-        if (tmp->used && tmp != cb && (!iface || !tmp->iface || tmp->iface == iface) && tmp->port == sin->sin_port) {
+        if (tmp->used && tmp != cb && tmp->family == cb->family && (!iface || !tmp->iface || tmp->iface == iface) && tmp->port == port && !(cb->reuse && tmp->reuse)) {
             release(&udplock);
             return -1;
         }
     }
     cb->iface = iface;
-    cb->port = sin->sin_port;
+    cb->port = port;
     release(&udplock);
     return 0;
 }
@@ -240,8 +457,9 @@ udp_api_bind_iface (int soc, struct netif *iface, uint16_t port) {
 }
 
 ssize_t
-udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int *addrlen) {
-    struct sockaddr_in *peer = NULL;
+udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int *addrlen, int nonblock) {
+    struct sockaddr_in *peer;
+    struct sockaddr_in6 *peer6;
     struct udp_cb *cb;
     struct queue_entry *entry;
     int ret = 0;
@@ -251,20 +469,26 @@ udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int
     if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
         return -1;
     }
-    if (addr) {
-        if (*addrlen < sizeof(struct sockaddr_in)) {
-            return -1;
-        }
-        *addrlen = sizeof(struct sockaddr_in);
-        peer = (struct sockaddr_in *)addr;
-    }
     acquire(&udplock);
     cb = &cb_table[soc];
     if (!cb->used) {
         release(&udplock);
         return -1;
     }
+    if (addr && *addrlen < (cb->family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in))) {
+        release(&udplock);
+        return -1;
+    }
     while (!(entry = queue_pop(&cb->queue))) {
+        if (cb->err) {
+            cb->err = 0;
+            release(&udplock);
+            return -1;
+        }
+        if (nonblock) {
+            release(&udplock);
+            return -EAGAIN;
+        }
         if(myproc()->killed){
             release(&udplock);
             return -1;
@@ -272,43 +496,68 @@ udp_api_recvfrom (int soc, uint8_t *buf, size_t size, struct sockaddr *addr, int
         sleep(cb, &udplock);
     }
     release(&udplock);
+    // 数据在出队之后仍然可能被其他套接字引用，只读不写，拷贝完再释放引用
     queue_hdr = (struct udp_queue_hdr *)entry->data;
-    if (peer) {
+    if (addr && cb->family == AF_INET6) {
+        peer6 = (struct sockaddr_in6 *)addr;
+        memset(peer6, 0, sizeof(*peer6));
+        peer6->sin6_family = AF_INET6;
+        peer6->sin6_addr = queue_hdr->addr6;
+        peer6->sin6_port = queue_hdr->port;
+        *addrlen = sizeof(struct sockaddr_in6);
+    } else if (addr) {
+        peer = (struct sockaddr_in *)addr;
         peer->sin_family = AF_INET;
         peer->sin_addr = queue_hdr->addr;
         peer->sin_port = queue_hdr->port;
+        *addrlen = sizeof(struct sockaddr_in);
     }
     len = MIN(size, queue_hdr->len);
     memcpy(buf, queue_hdr + 1, len);
-    kfree((char*)entry->data);
-    kfree((char*)entry);
+    acquire(&udplock);
+    udp_queue_entry_free(entry);
+    release(&udplock);
     return len;
 }
 
 ssize_t
 udp_api_sendto (int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int addrlen) {
-    struct sockaddr_in *peer;
     struct udp_cb *cb, *tmp;
     struct netif *iface;
+    const void *dst;
     uint32_t p;
-    uint16_t sport;
+    uint16_t sport, dport;
 
     if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
         return -1;
     }
-    if (!addr || addr->sa_family != AF_INET || addrlen < sizeof(struct sockaddr_in)) {
+    if (!addr) {
         return -1;
     }
-    peer = (struct sockaddr_in *)addr;
     acquire(&udplock);
     cb = &cb_table[soc];
-    if (!cb->used) {
+    if (!cb->used || addr->sa_family != cb->family) {
         release(&udplock);
         return -1;
     }
+    if (cb->family == AF_INET6) {
+        if (addrlen < sizeof(struct sockaddr_in6)) {
+            release(&udplock);
+            return -1;
+        }
+        dst = &((struct sockaddr_in6 *)addr)->sin6_addr;
+        dport = ((struct sockaddr_in6 *)addr)->sin6_port;
+    } else {
+        if (addrlen < sizeof(struct sockaddr_in)) {
+            release(&udplock);
+            return -1;
+        }
+        dst = &((struct sockaddr_in *)addr)->sin_addr;
+        dport = ((struct sockaddr_in *)addr)->sin_port;
+    }
     iface = cb->iface;
     if (!iface) {
-        iface = ip_netif_by_peer(&peer->sin_addr);
+        iface = cb->family == AF_INET6 ? ip6_netif_by_peer(dst) : ip_netif_by_peer((ip_addr_t *)dst);
         if (!iface) {
             release(&udplock);
             return -1;
@@ -333,13 +582,106 @@ udp_api_sendto (int soc, uint8_t *buf, size_t len, struct sockaddr *addr, int ad
         }
     }
     sport = cb->port;
+    if (cb->family == AF_INET) {
+        cb->peer.addr = *(const ip_addr_t *)dst;
+        cb->peer.port = dport;
+    }
+    release(&udplock);
+    return udp_tx(iface, sport, buf, len, dst, dport);
+}
+
+static int
+udp_cb_membership (struct udp_cb *cb, int optname, struct ip_mreq *mreq) {
+    struct netif *iface;
+    int n, free = -1;
+
+    if (cb->family != AF_INET || !IP_ADDR_IS_MULTICAST(&mreq->imr_multiaddr)) {
+        return -1;
+    }
+    if (mreq->imr_interface) {
+        iface = ip_netif_by_addr(&mreq->imr_interface);
+    } else {
+        iface = ip_netif_by_peer(&mreq->imr_multiaddr);
+    }
+    if (!iface) {
+        return -1;
+    }
+    for (n = 0; n < UDP_CB_MSHIP_MAX; n++) {
+        if (cb->mship[n].iface == iface && cb->mship[n].group == mreq->imr_multiaddr) {
+            break;
+        }
+        if (!cb->mship[n].iface && free == -1) {
+            free = n;
+        }
+    }
+    if (optname == IP_DROP_MEMBERSHIP) {
+        if (n == UDP_CB_MSHIP_MAX) {
+            return -1;
+        }
+        cb->mship[n].iface = NULL;
+        return igmp_leave(iface, mreq->imr_multiaddr);
+    }
+    if (n != UDP_CB_MSHIP_MAX || free == -1) {
+        return -1;
+    }
+    if (igmp_join(iface, mreq->imr_multiaddr) == -1) {
+        return -1;
+    }
+    cb->mship[free].group = mreq->imr_multiaddr;
+    cb->mship[free].iface = iface;
+    return 0;
+}
+
+int
+udp_api_setsockopt (int soc, int level, int optname, void *optval, int optlen) {
+    struct udp_cb *cb;
+    int ret = -1;
+
+    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
+        return -1;
+    }
+    acquire(&udplock);
+    cb = &cb_table[soc];
+    if (!cb->used) {
+        release(&udplock);
+        return -1;
+    }
+    if (level == SOL_SOCKET && optname == SO_REUSEADDR && optlen >= sizeof(int)) {
+        cb->reuse = *(int *)optval ? 1 : 0;
+        ret = 0;
+    } else if (level == IPPROTO_IP && (optname == IP_ADD_MEMBERSHIP || optname == IP_DROP_MEMBERSHIP) && optlen >= sizeof(struct ip_mreq)) {
+        ret = udp_cb_membership(cb, optname, (struct ip_mreq *)optval);
+    }
+    release(&udplock);
+    return ret;
+}
+
+int
+udp_api_getsockopt (int soc, int level, int optname, void *optval, int *optlen) {
+    struct udp_cb *cb;
+
+    if (soc < 0 || soc >= UDP_CB_TABLE_SIZE) {
+        return -1;
+    }
+    if (level != SOL_SOCKET || optname != SO_REUSEADDR || *optlen < sizeof(int)) {
+        return -1;
+    }
+    acquire(&udplock);
+    cb = &cb_table[soc];
+    if (!cb->used) {
+        release(&udplock);
+        return -1;
+    }
+    *(int *)optval = cb->reuse;
+    *optlen = sizeof(int);
     release(&udplock);
-    return udp_tx(iface, sport, buf, len, &peer->sin_addr, peer->sin_port);
+    return 0;
 }
 
 int
 udp_init (void) {
     initlock(&udplock, "udp");
-    ip_add_protocol(IP_PROTOCOL_UDP, udp_rx);
+    ip_add_protocol(IP_PROTOCOL_UDP, udp_rx, udp_rx_error);
+    ip6_add_protocol(IP6_NEXTHDR_UDP, udp6_rx, NULL);
     return 0;
 }
@@ -31,6 +31,11 @@ main (int argc, char *argv[])
     while (1) {
         peerlen = sizeof(peer);
         ret = recvfrom(soc, buf, sizeof(buf), (struct sockaddr *)&peer, &peerlen);
+        if (ret == -1) {
+            // 上一个回复的对端不可达（ICMP 差错），继续服务其他客户端
+            printf(1, "recvfrom: error\n");
+            continue;
+        }
         if (ret <= 0) {
             printf(1, "EOF\n");
             break;
@@ -276,3 +276,106 @@ ip_addr_pton (const char *p, ip_addr_t *n) {
     }
     return 0;
 }
+
+int
+ip6_addr_pton (const char *p, ip6_addr_t *n) {
+    uint16_t head[8], tail[8];
+    int nhead = 0, ntail = 0, gap = 0, idx;
+    char *sp, *ep;
+    long ret;
+
+    sp = (char *)p;
+    if (sp[0] == ':') {
+        if (sp[1] != ':') {
+            return -1;
+        }
+        gap = 1;
+        sp += 2;
+    }
+    while (*sp) {
+        ret = strtol(sp, &ep, 16);
+        if (ep == sp || ep - sp > 4 || ret < 0 || ret > 0xffff) {
+            return -1;
+        }
+        if (nhead + ntail == 8) {
+            return -1;
+        }
+        if (gap) {
+            tail[ntail++] = ret;
+        } else {
+            head[nhead++] = ret;
+        }
+        if (*ep == '\0') {
+            break;
+        }
+        if (*ep != ':') {
+            return -1;
+        }
+        if (ep[1] == ':') {
+            // "::" 只能出现一次
+            if (gap) {
+                return -1;
+            }
+            gap = 1;
+            ep++;
+        } else if (ep[1] == '\0') {
+            return -1;
+        }
+        sp = ep + 1;
+    }
+    if (gap ? nhead + ntail > 7 : nhead != 8) {
+        return -1;
+    }
+    memset(n, 0, sizeof(*n));
+    for (idx = 0; idx < nhead; idx++) {
+        n->addr16[idx] = hton16(head[idx]);
+    }
+    for (idx = 0; idx < ntail; idx++) {
+        n->addr16[8 - ntail + idx] = hton16(tail[idx]);
+    }
+    return 0;
+}
+
+// RFC 5952 的格式：小写、省略前导零、最长的连续全零组（至少两组）压缩成 "::"
+char *
+ip6_addr_ntop (const ip6_addr_t *n, char *p, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    int idx, run = 0, best = -1, bestlen = 1, shift;
+    uint16_t group;
+    char *s;
+
+    if (size < IP6_ADDR_STR_LEN) {
+        if (size) {
+            *p = '\0';
+        }
+        return p;
+    }
+    for (idx = 0; idx < 8; idx++) {
+        run = n->addr16[idx] ? 0 : run + 1;
+        if (run > bestlen) {
+            bestlen = run;
+            best = idx - run + 1;
+        }
+    }
+    s = p;
+    for (idx = 0; idx < 8; idx++) {
+        if (idx == best) {
+            *s++ = ':';
+            idx += bestlen - 1;
+            if (idx == 7) {
+                *s++ = ':';
+            }
+            continue;
+        }
+        if (idx) {
+            *s++ = ':';
+        }
+        group = ntoh16(n->addr16[idx]);
+        for (shift = 12; shift > 0 && !(group >> shift); shift -= 4);
+        for (; shift >= 0; shift -= 4) {
+            *s++ = digits[(group >> shift) & 0xf];
+        }
+    }
+    *s = '\0';
+    return p;
+}
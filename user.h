@@ -35,6 +35,8 @@ int recv(int, char*, int);
 int send(int, char*, int);
 int recvfrom(int, char*, int, struct sockaddr*, int*);
 int sendto(int, char*, int, struct sockaddr*, int);
+int setsockopt(int, int, int, void*, int);
+int getsockopt(int, int, int, void*, int*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -57,6 +59,9 @@ uint32_t hton32(uint32_t h);
 uint32_t ntoh32(uint32_t n);
 long strtol(const char *s, char **endptr, int base);
 int ip_addr_pton(const char *p, ip_addr_t *n);
+int ip6_addr_pton(const char *p, ip6_addr_t *n);
+char *ip6_addr_ntop(const ip6_addr_t *n, char *p, size_t size);
 
 #define IP_ADDR_LEN 4
 #define IP_ADDR_STR_LEN 16 /* "ddd.ddd.ddd.ddd\0" */
+#define IP6_ADDR_STR_LEN 40 /* "xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx\0" */
@@ -137,6 +137,17 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// 原子地把 val 加到 *addr 上，返回相加之前的值
+static inline uint
+xadd(volatile uint *addr, uint val)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (val), "+m" (*addr) :
+               :
+               "cc");
+  return val;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -151,6 +162,14 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint64_t
+rdtsc(void)
+{
+  uint64_t val;
+  asm volatile("rdtsc" : "=A" (val));
+  return val;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().